@@ -0,0 +1,636 @@
+
+/*
+ *   Includes
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "types.h"
+#include "isa.h"
+#include "aot.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define AOT_HAVE_DLOPEN /* Modules can be loaded */
+#include <dlfcn.h>
+#endif
+
+/*
+ *   Constants
+ */
+#define AOT_SYMBOL  "aot_module" /* Module description exported by the shared object */
+#define AOT_CMD_MAX 4096         /* Longest compiler command line                     */
+
+/*
+ *   Marks of the image bytes while emitting
+ */
+#define AOT_M_CMD    0x01 /* A command starts here         */
+#define AOT_M_TARGET 0x02 /* An immediate branch goes here */
+#define AOT_M_ENTRY  0x04 /* A block starts here           */
+
+/*
+ *   Types
+ */
+typedef struct _aot_entry_t
+{
+	word_t     addr;             /* Guest address of the block        */
+	aot_code_t code;             /* Its code                          */
+} aot_entry_t;
+
+/*
+ *   What the shared object exports (mirrored in the prelude)
+ */
+typedef struct _aot_module_t
+{
+	word_t            abi;       /* AOT_ABI of the emitter            */
+	word_t            addr;      /* Guest address of the image        */
+	word_t            size;      /* Bytes of the image                */
+	word_t            memory;    /* Bytes of the memory it was made
+	                                for, its operands are checked
+	                                against                           */
+	const byte_t      *image;    /* Code the module was made from     */
+	word_t            nr_entries;/* Number of blocks                  */
+	const aot_entry_t *entries;  /* Blocks, by address                */
+} aot_module_t;
+
+struct _aot_t
+{
+	void               *handle;  /* Shared object                     */
+	const aot_module_t *module;  /* Its description                   */
+	aot_code_t         *table;   /* Code by address, from module->addr */
+};
+
+/*
+ *   Command bodies as C text. The isa.h bodies are expanded here
+ *   with the accessors of the generated code and turned into
+ *   strings, so the module runs the commands exactly the way the
+ *   executors do. The generated code names its locals after them.
+ */
+#define AOT_STR(...)            #__VA_ARGS__
+#define AOT_XSTR(...)           AOT_STR(__VA_ARGS__)
+
+#define ISA_IP                  ip
+#define ISA_REG_GET(code, v)    (v) = (((code) == ISA_REG_IP) ? ip : regs[code])
+#define ISA_REG_SET(code, v)    regs[code] = (v)
+#define ISA_MEM_GET(addr, v)                                   \
+	if (aot_load(env, (addr), &(v)) == -1)                 \
+	{                                                      \
+		goto fault;                                    \
+	}
+#define ISA_MEM_SET(addr, v)                                   \
+	if ((stored = env->store(env->ctx, (addr), (v))) == -1)\
+	{                                                      \
+		goto fault;                                    \
+	}
+#define ISA_COMPARE(a, b)                                      \
+	cmp[0] = (a);                                          \
+	cmp[1] = (b)
+#define ISA_EQU                 ISA_FLAG_EQU(cmp[0], cmp[1])
+#define ISA_GREATER             ISA_FLAG_GREATER(cmp[0], cmp[1])
+#define ISA_ERROR()             *env->error = 1
+
+#define AOT_BINARY_BODY(mode, am, name, class, expr, fault)                 \
+	[ISA_H_##name##_##mode] = AOT_XSTR(ISA_BODY_##class(mode, expr, fault)),
+#define AOT_BINARY_BODIES(name, opcode, class, expr, fault)                 \
+	ISA_BINARY_MODES(AOT_BINARY_BODY, name, class, expr, fault)
+#define AOT_JUMP_BODY(mode, am, name, cond)                                 \
+	[ISA_H_##name##_##mode] = AOT_XSTR(ISA_BODY_JUMP(mode, cond)),
+#define AOT_JUMP_BODIES(name, opcode, cond)                                 \
+	ISA_JUMP_MODES(AOT_JUMP_BODY, name, cond)
+
+static const char *bodies[NR_HANDLERS] =
+{
+	[ISA_H_bad_mode] = "*env->error = 1; ip += insn->length;",
+	[ISA_H_trap]     = "goto fault;",
+	[ISA_H_halt]     = "*env->halt = 1;",
+	ISA_BINARY_OPS(AOT_BINARY_BODIES)
+	ISA_JUMP_OPS(AOT_JUMP_BODIES)
+};
+
+#undef ISA_IP
+#undef ISA_REG_GET
+#undef ISA_REG_SET
+#undef ISA_MEM_GET
+#undef ISA_MEM_SET
+#undef ISA_COMPARE
+#undef ISA_EQU
+#undef ISA_GREATER
+#undef ISA_ERROR
+
+/*
+ *   Handler names, for the comments of the generated code
+ */
+#define AOT_NAME(mode, am, name, ...) [ISA_H_##name##_##mode] = #name "_" #mode,
+#define AOT_BINARY_NAMES(name, opcode, class, expr, fault) ISA_BINARY_MODES(AOT_NAME, name)
+#define AOT_JUMP_NAMES(name, opcode, cond) ISA_JUMP_MODES(AOT_NAME, name)
+
+static const char *names[NR_HANDLERS] =
+{
+	[ISA_H_bad_mode] = "bad_mode",
+	[ISA_H_trap]     = "trap",
+	[ISA_H_halt]     = "halt",
+	ISA_BINARY_OPS(AOT_BINARY_NAMES)
+	ISA_JUMP_OPS(AOT_JUMP_NAMES)
+};
+
+/*
+ *   Handlers storing to memory, which may drop the module's code
+ */
+#define AOT_STORES_ALU(am) ISA_OP2_IS_MEM(am)
+#define AOT_STORES_MOV(am) ISA_OP2_IS_MEM(am)
+#define AOT_STORES_CMP(am) 0
+#define AOT_STORE(mode, am, name, class, ...) [ISA_H_##name##_##mode] = AOT_STORES_##class(am),
+#define AOT_BINARY_STORES(name, opcode, class, expr, fault) ISA_BINARY_MODES(AOT_STORE, name, class)
+
+static const byte_t stores[NR_HANDLERS] =
+{
+	ISA_BINARY_OPS(AOT_BINARY_STORES)
+};
+
+/*
+ *   Handlers ending a block, and those with an immediate target
+ */
+#define AOT_END(mode, am, name, ...) [ISA_H_##name##_##mode] = 1,
+#define AOT_JUMP_ENDS(name, opcode, cond) ISA_JUMP_MODES(AOT_END, name)
+
+static const byte_t ends[NR_HANDLERS] =
+{
+	[ISA_H_trap] = 1,
+	[ISA_H_halt] = 1,
+	ISA_JUMP_OPS(AOT_JUMP_ENDS)
+};
+
+static const byte_t jumps_imm[NR_HANDLERS] =
+{
+	[ISA_H_jump_imm] = 1,
+	[ISA_H_jg_imm]   = 1,
+	[ISA_H_je_imm]   = 1
+};
+
+/*
+ *   Start of every generated file. The types are the ones of aot.h
+ *   and types.h, so the module builds on its own.
+ */
+static const char prelude[] =
+	"#include <string.h>\n"
+	"\n"
+	"typedef unsigned char byte_t;\n"
+	"typedef unsigned int  word_t;\n"
+	"\n"
+	"typedef struct _aot_env_t\n"
+	"{\n"
+	"\tword_t *regs;\n"
+	"\tword_t *cmp;\n"
+	"\tbyte_t *error;\n"
+	"\tbyte_t *halt;\n"
+	"\tlong   *budget;\n"
+	"\tbyte_t *stop;\n"
+	"\tbyte_t *bytes;\n"
+	"\tvoid   *ctx;\n"
+	"\tint    (*store)(void *ctx, word_t addr, word_t w);\n"
+	"\tconst word_t *load_lo;\n"
+	"\tconst word_t *load_hi;\n"
+	"\tint    (*load)(void *ctx, word_t addr, word_t *w);\n"
+	"} aot_env_t;\n"
+	"\n"
+	"typedef int (*aot_code_t)(const aot_env_t *env);\n"
+	"\n"
+	"typedef struct _aot_entry_t\n"
+	"{\n"
+	"\tword_t     addr;\n"
+	"\taot_code_t code;\n"
+	"} aot_entry_t;\n"
+	"\n"
+	"typedef struct _aot_module_t\n"
+	"{\n"
+	"\tword_t            abi;\n"
+	"\tword_t            addr;\n"
+	"\tword_t            size;\n"
+	"\tword_t            memory;\n"
+	"\tconst byte_t      *image;\n"
+	"\tword_t            nr_entries;\n"
+	"\tconst aot_entry_t *entries;\n"
+	"} aot_module_t;\n"
+	"\n"
+	"typedef struct _aot_cmd_t\n"
+	"{\n"
+	"\tword_t op1;\n"
+	"\tword_t op2;\n"
+	"\tword_t length;\n"
+	"} aot_cmd_t;\n"
+	"\n"
+	"static inline int aot_load(const aot_env_t *env, word_t addr, word_t *w)\n"
+	"{\n"
+	"\tif (addr < *env->load_hi && addr + sizeof(word_t) > *env->load_lo)\n"
+	"\t{\n"
+	"\t\treturn env->load(env->ctx, addr, w);\n"
+	"\t}\n"
+	"\n"
+	"\tmemcpy(w, env->bytes + addr, sizeof(word_t));\n"
+	"\n"
+	"\treturn 0;\n"
+	"}\n"
+	"\n"
+	"static inline int aot_yield(const aot_env_t *env)\n"
+	"{\n"
+	"\treturn *env->budget <= 0 || __atomic_load_n(env->stop, __ATOMIC_RELAXED);\n"
+	"}\n";
+
+/*
+ *   Emission
+ */
+
+/*
+ *   One block: the commands [first, last). Commands run in line and
+ *   a block whose successor is a block of the module goes on with it
+ *   as a tail call.
+ */
+static void aot_emit_block(FILE *out, const aot_insn_t *insns, word_t first, word_t last,
+                           word_t addr, const byte_t *marks, word_t size)
+{
+	const aot_insn_t *insn;
+	word_t           succ[2];
+	word_t           nr;
+	word_t           k;
+	word_t           i;
+
+
+	nr = last - first;
+
+	fprintf(out, "static int b_%08x(const aot_env_t *env)\n", insns[first].addr);
+	fprintf(out, "{\n");
+	fprintf(out, "\tword_t *const regs   = env->regs;\n");
+	fprintf(out, "\tword_t *const cmp    = env->cmp;\n");
+	fprintf(out, "\tword_t        ip     = 0x%08xu;\n", insns[first].addr);
+	fprintf(out, "\tword_t        done   = 0;\n");
+	fprintf(out, "\tint           stored = 0;\n");
+	fprintf(out, "\n\n");
+	fprintf(out, "\t*env->budget -= %u;\n", nr);
+
+	for (k = 0; k < nr; k++)
+	{
+		insn = &insns[first + k];
+
+		fprintf(out, "\n\t/* 0x%08x: %s */\n", insn->addr, names[insn->handler]);
+		fprintf(out, "\tdone = %u;\n", k);
+		fprintf(out, "\t{\n");
+		fprintf(out, "\t\tconst aot_cmd_t insn[1] = { { 0x%08xu, 0x%08xu, %u } };\n",
+			insn->op1, insn->op2, insn->length);
+		fprintf(out, "\n");
+		fprintf(out, "\t\t%s\n", bodies[insn->handler]);
+		fprintf(out, "\t}\n");
+
+		/*
+		 *   A store that dropped the module's code leaves it
+		 */
+		if (stores[insn->handler])
+		{
+			fprintf(out, "\tif (stored)\n");
+			fprintf(out, "\t{\n");
+			if (nr - k - 1 > 0)
+			{
+				fprintf(out, "\t\t*env->budget += %u;\n", nr - k - 1);
+			}
+			fprintf(out, "\t\tgoto out;\n");
+			fprintf(out, "\t}\n");
+		}
+	}
+
+	/*
+	 *   Successors: the target of an immediate branch and the
+	 *   command after the block, unless the block can not get there
+	 */
+	insn    = &insns[last - 1];
+	succ[0] = size;
+	succ[1] = size;
+	if (jumps_imm[insn->handler] && insn->op1 >= addr && insn->op1 - addr < size)
+	{
+		succ[0] = insn->op1 - addr;
+	}
+
+	if (!ends[insn->handler] || (jumps_imm[insn->handler] && insn->handler != ISA_H_jump_imm))
+	{
+		succ[1] = insn->addr + insn->length - addr;
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		if (succ[i] >= size || !(marks[succ[i]] & AOT_M_ENTRY))
+		{
+			succ[i] = size;
+		}
+	}
+
+	if (succ[0] < size || succ[1] < size)
+	{
+		fprintf(out, "\n\tif (aot_yield(env))\n");
+		fprintf(out, "\t{\n");
+		fprintf(out, "\t\tgoto out;\n");
+		fprintf(out, "\t}\n");
+
+		for (i = 0; i < 2; i++)
+		{
+			if (succ[i] < size && (i == 0 || succ[1] != succ[0]))
+			{
+				fprintf(out, "\n\tif (ip == 0x%08xu)\n", addr + succ[i]);
+				fprintf(out, "\t{\n");
+				fprintf(out, "\t\treturn b_%08x(env);\n", addr + succ[i]);
+				fprintf(out, "\t}\n");
+			}
+		}
+	}
+
+	fprintf(out, "\nout:\n");
+	fprintf(out, "\tregs[%u] = ip;\n", ISA_REG_IP);
+	fprintf(out, "\treturn 0;\n");
+	fprintf(out, "\nfault:\n");
+	fprintf(out, "\t*env->budget += %u - done;\n", nr);
+	fprintf(out, "\t*env->error = 1;\n");
+	fprintf(out, "\tregs[%u] = ip;\n", ISA_REG_IP);
+	fprintf(out, "\treturn -1;\n");
+	fprintf(out, "}\n\n");
+}
+
+/*
+ *   Write C source for the commands of the image loaded at the
+ *   address, given in address order. Blocks start at the first
+ *   command, at immediate branch targets and after commands ending
+ *   a block or followed by a gap; each one becomes a function.
+ *   Memory operands of the commands are within `memory` bytes (the
+ *   CPU traps the others when decoding), and the code accesses them
+ *   without checks.
+ */
+int aot_emit(const char *path, const aot_insn_t *insns, word_t nr,
+             word_t addr, const byte_t *image, word_t size, word_t memory)
+{
+	FILE   *out;
+	byte_t *marks;
+	word_t nr_entries;
+	word_t first;
+	word_t i;
+
+
+	if (path == NULL || insns == NULL || image == NULL || nr == 0 || size == 0)
+	{
+		return -1;
+	}
+
+	marks = (byte_t *)calloc(size, sizeof(byte_t));
+	if (marks == NULL)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++)
+	{
+		if (insns[i].addr < addr || insns[i].addr - addr >= size ||
+		    insns[i].length > size - (insns[i].addr - addr) ||
+		    (i > 0 && insns[i].addr < insns[i - 1].addr + insns[i - 1].length))
+		{
+			free(marks);
+			return -1;
+		}
+
+		marks[insns[i].addr - addr] |= AOT_M_CMD;
+		if (jumps_imm[insns[i].handler] && insns[i].op1 >= addr && insns[i].op1 - addr < size)
+		{
+			marks[insns[i].op1 - addr] |= AOT_M_TARGET;
+		}
+	}
+
+	nr_entries = 0;
+	for (i = 0; i < nr; i++)
+	{
+		if (i == 0 || (marks[insns[i].addr - addr] & AOT_M_TARGET) ||
+		    ends[insns[i - 1].handler] ||
+		    insns[i - 1].addr + insns[i - 1].length != insns[i].addr)
+		{
+			marks[insns[i].addr - addr] |= AOT_M_ENTRY;
+			nr_entries++;
+		}
+	}
+
+	out = fopen(path, "w");
+	if (out == NULL)
+	{
+		free(marks);
+		return -1;
+	}
+
+	fprintf(out, "/*\n");
+	fprintf(out, " *   Ahead-of-time code of [0x%08x, 0x%08x), generated by the VM\n", addr, addr + size);
+	fprintf(out, " */\n");
+	fprintf(out, "%s\n", prelude);
+
+	for (i = 0; i < nr; i++)
+	{
+		if (marks[insns[i].addr - addr] & AOT_M_ENTRY)
+		{
+			fprintf(out, "static int b_%08x(const aot_env_t *env);\n", insns[i].addr);
+		}
+	}
+	fprintf(out, "\n");
+
+	first = 0;
+	for (i = 1; i <= nr; i++)
+	{
+		if (i == nr || (marks[insns[i].addr - addr] & AOT_M_ENTRY))
+		{
+			aot_emit_block(out, insns, first, i, addr, marks, size);
+			first = i;
+		}
+	}
+
+	fprintf(out, "static const byte_t image[] =\n{");
+	for (i = 0; i < size; i++)
+	{
+		fprintf(out, "%s0x%02x,", (i % 12 == 0) ? "\n\t" : " ", image[i]);
+	}
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "static const aot_entry_t entries[] =\n{\n");
+	for (i = 0; i < nr; i++)
+	{
+		if (marks[insns[i].addr - addr] & AOT_M_ENTRY)
+		{
+			fprintf(out, "\t{ 0x%08xu, b_%08x },\n", insns[i].addr, insns[i].addr);
+		}
+	}
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "const aot_module_t %s = { %u, 0x%08xu, %uu, %uu, image, %uu, entries };\n",
+		AOT_SYMBOL, AOT_ABI, addr, size, memory, nr_entries);
+
+	free(marks);
+
+	return (fclose(out) == 0) ? 0 : -1;
+}
+
+#ifdef AOT_HAVE_DLOPEN
+
+/*
+ *   Build a shared object from generated source with the system C
+ *   compiler ($CC if set). Blocks chain through tail calls, so the
+ *   source is always built with optimization.
+ */
+int aot_compile(const char *src, const char *so)
+{
+	const char *cc;
+	char       cmd[AOT_CMD_MAX];
+	int        len;
+
+
+	if (src == NULL || so == NULL || strchr(src, '\'') != NULL || strchr(so, '\'') != NULL)
+	{
+		return -1;
+	}
+
+	cc = getenv("CC");
+	if (cc == NULL || *cc == '\0')
+	{
+		cc = AOT_CC;
+	}
+
+	len = snprintf(cmd, sizeof(cmd), "%s -O2 -fPIC -shared -o '%s' '%s'", cc, so, src);
+	if (len < 0 || len >= sizeof(cmd))
+	{
+		return -1;
+	}
+
+	return (system(cmd) == 0) ? 0 : -1;
+}
+
+/*
+ *   Load a shared object built by aot_compile(). A path without a
+ *   slash is searched the way dlopen() does.
+ */
+aot_t* aot_load(const char *so)
+{
+	const aot_module_t *module;
+	aot_t              *aot;
+	void               *handle;
+	word_t             i;
+
+
+	if (so == NULL)
+	{
+		return NULL;
+	}
+
+	handle = dlopen(so, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL)
+	{
+		return NULL;
+	}
+
+	module = (const aot_module_t *)dlsym(handle, AOT_SYMBOL);
+	if (module == NULL || module->abi != AOT_ABI || module->size == 0)
+	{
+		dlclose(handle);
+		return NULL;
+	}
+
+	aot = (aot_t *)malloc(sizeof(*aot));
+	if (aot == NULL)
+	{
+		dlclose(handle);
+		return NULL;
+	}
+
+	aot->table = (aot_code_t *)calloc(module->size, sizeof(aot_code_t));
+	if (aot->table == NULL)
+	{
+		free(aot);
+		dlclose(handle);
+		return NULL;
+	}
+
+	for (i = 0; i < module->nr_entries; i++)
+	{
+		if (module->entries[i].addr - module->addr < module->size)
+		{
+			aot->table[module->entries[i].addr - module->addr] = module->entries[i].code;
+		}
+	}
+
+	aot->handle = handle;
+	aot->module = module;
+
+	return aot;
+}
+
+int aot_free(aot_t *aot)
+{
+	if (aot == NULL)
+	{
+		return -1;
+	}
+
+	free(aot->table);
+	dlclose(aot->handle);
+	free(aot);
+
+	return 0;
+}
+
+/*
+ *   Code the module was made from and the size of the memory it was
+ *   made for, to be checked against memory
+ */
+int aot_image(const aot_t *aot, word_t *addr, word_t *size, const byte_t **image,
+              word_t *memory)
+{
+	if (aot == NULL || addr == NULL || size == NULL || image == NULL || memory == NULL)
+	{
+		return -1;
+	}
+
+	*addr   = aot->module->addr;
+	*size   = aot->module->size;
+	*image  = aot->module->image;
+	*memory = aot->module->memory;
+
+	return 0;
+}
+
+/*
+ *   Code of the block starting at the address, NULL if none
+ */
+aot_code_t aot_lookup(const aot_t *aot, word_t addr)
+{
+	if (addr - aot->module->addr >= aot->module->size)
+	{
+		return NULL;
+	}
+
+	return aot->table[addr - aot->module->addr];
+}
+
+#else /* No shared objects on this host */
+
+int aot_compile(const char *src, const char *so)
+{
+	return -1;
+}
+
+aot_t* aot_load(const char *so)
+{
+	return NULL;
+}
+
+int aot_free(aot_t *aot)
+{
+	return -1;
+}
+
+int aot_image(const aot_t *aot, word_t *addr, word_t *size, const byte_t **image,
+              word_t *memory)
+{
+	return -1;
+}
+
+aot_code_t aot_lookup(const aot_t *aot, word_t addr)
+{
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,73 @@
+
+#ifndef __AOT_H__
+#define __AOT_H__
+
+/*
+ *   Includes
+ */
+#include "types.h"
+
+/*
+ *   Constants
+ */
+#define AOT_ABI 3    /* Bumped whenever the module layout changes */
+#define AOT_CC  "cc" /* Compiler used when $CC is not set         */
+
+/*
+ *   Types
+ */
+typedef struct _aot_t aot_t;
+
+/*
+ *   Guest state and services used by the generated code
+ */
+typedef struct _aot_env_t
+{
+	word_t *regs;                                      /* Register file, by register code */
+	word_t *cmp;                                       /* Operands of the last compare    */
+	byte_t *error;                                     /* Error flag                      */
+	byte_t *halt;                                      /* Halt flag                       */
+	long   *budget;                                    /* Commands left to run            */
+	byte_t *stop;                                      /* Stop requested                  */
+	byte_t *bytes;                                     /* Guest memory                    */
+	void   *ctx;                                       /* Passed to the helpers           */
+	int    (*store)(void *ctx, word_t addr, word_t w); /* 0, 1 if the module's code was
+	                                                      dropped, -1 on fault            */
+	const word_t *load_lo;                             /* Loads to [*load_lo, *load_hi)   */
+	const word_t *load_hi;                             /* go through load                 */
+	int    (*load)(void *ctx, word_t addr, word_t *w); /* 0, -1 on fault                  */
+} aot_env_t;
+
+/*
+ *   Generated code of a block. Returns 0 with IP stored to the
+ *   register file, -1 when a command faulted (IP left on it).
+ *   Blocks branching to blocks of the module go on with them until
+ *   the budget is used up or a stop is requested.
+ */
+typedef int (*aot_code_t)(const aot_env_t *env);
+
+/*
+ *   Command handed to the emitter
+ */
+typedef struct _aot_insn_t
+{
+	word_t addr;    /* Guest address of the command          */
+	word_t op1;     /* First operand                         */
+	word_t op2;     /* Second operand                        */
+	byte_t handler; /* Handler identifier (isa.h)            */
+	byte_t length;  /* Command length in bytes               */
+} aot_insn_t;
+
+/*
+ *   Prototypes
+ */
+int        aot_emit   (const char *path, const aot_insn_t *insns, word_t nr,
+                       word_t addr, const byte_t *image, word_t size, word_t memory);
+int        aot_compile(const char *src, const char *so);
+aot_t*     aot_load   (const char *so);
+int        aot_free   (aot_t *aot);
+int        aot_image  (const aot_t *aot, word_t *addr, word_t *size, const byte_t **image,
+                       word_t *memory);
+aot_code_t aot_lookup (const aot_t *aot, word_t addr);
+
+#endif /* __AOT_H__ */
@@ -6,6 +6,11 @@
 #include "types.h"
 #include "asm.h"
 
+/*
+ *   Constants
+ */
+#define ASM_CODE_MAX (1 << 20) /* Largest image asm_assemble() makes */
+
 /*
  *   Types
  */
@@ -82,7 +87,11 @@ static char* read_symbol(FILE *file)
 		return NULL;
 	}
 
-	fscanf(file, "%s", symbol);
+	if (fscanf(file, "%31s", symbol) != 1)
+	{
+		free(symbol);
+		return NULL;
+	}
 
 	return symbol;
 }
@@ -348,6 +357,8 @@ static int label_destroy(void)
 		}
 	}
 
+	label_cnt = 0;
+
 	return 0;
 }
 
@@ -395,6 +406,22 @@ static int unresolved_destroy(void)
 		}
 	}
 
+	unresolved_cnt = 0;
+
+	return 0;
+}
+
+/*
+ *   Room for `n` more bytes of code at the offset
+ */
+static int code_room(word_t offset, word_t n, word_t capacity)
+{
+	if (n > capacity || offset > capacity - n)
+	{
+		printf("Code does not fit in %u bytes\n", capacity);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -417,7 +444,11 @@ static int command_find(const char *command, byte_t *opcode, int *nr_operands)
 	return -1;
 }
 
-int asm_assemble(const char *file_name, byte_t **code, word_t *size)
+/*
+ *   Assemble the file into the buffer, which may be guest memory,
+ *   `capacity` bytes long
+ */
+int asm_assemble_to(const char *file_name, byte_t *code, word_t capacity, word_t *size)
 {
 	FILE   *file;
 	char   *symbol;
@@ -443,20 +474,13 @@ int asm_assemble(const char *file_name, byte_t **code, word_t *size)
 		return -1;
 	}
 
-	*code = (byte_t *)malloc(sizeof(byte_t) * 1024);
-	if (*code == NULL)
-	{
-		return -1;
-	}
-
-	p_code = *code;
+	p_code = code;
 
 	*size = 0;
 
 	file = fopen(file_name, "r");
 	if (file == NULL)
 	{
-		free(p_code);
 		return -1;
 	}
 
@@ -464,6 +488,18 @@ int asm_assemble(const char *file_name, byte_t **code, word_t *size)
 	ret    = 0;
 	err    = 0;
 	state  = ST_START;
+
+	/*
+	 *   Set by the states before the ones using them
+	 */
+	nr_operands = 0;
+	fst_operand = 0;
+	fst_op_type = OP_REGISTER;
+	snd_operand = 0;
+	snd_op_type = OP_REGISTER;
+	operand_idx = 0;
+	a_mode      = 0;
+	def_size    = 0;
 	while (!feof(file) && !err)
 	{
 		symbol = read_symbol(file);
@@ -491,6 +527,12 @@ int asm_assemble(const char *file_name, byte_t **code, word_t *size)
 					break;
 				}
 
+				if (code_room(offset, 1, capacity) == -1)
+				{
+					err = 1;
+					break;
+				}
+
 				*p_code = opcode;
 				(p_code)++;
 				offset++;
@@ -529,6 +571,12 @@ int asm_assemble(const char *file_name, byte_t **code, word_t *size)
 					break;
 				}
 
+				if (code_room(offset, 1, capacity) == -1)
+				{
+					err = 1;
+					break;
+				}
+
 				*p_code = opcode;
 				(p_code)++;
 				offset++;
@@ -551,6 +599,12 @@ int asm_assemble(const char *file_name, byte_t **code, word_t *size)
 		case ST_DEFINITION:
 			if (is_number(symbol))
 			{
+				if (code_room(offset, def_size, capacity) == -1)
+				{
+					err = 1;
+					break;
+				}
+
 				sym2number(symbol, &number);
 				memcpy(p_code, &number, def_size);
 				(p_code) += def_size;
@@ -573,6 +627,12 @@ int asm_assemble(const char *file_name, byte_t **code, word_t *size)
 					break;
 				}
 
+				if (code_room(offset, 1, capacity) == -1)
+				{
+					err = 1;
+					break;
+				}
+
 				*p_code = opcode;
 				(p_code)++;
 				offset++;
@@ -700,6 +760,12 @@ int asm_assemble(const char *file_name, byte_t **code, word_t *size)
 							break;
 						} /* switch */
 
+						if (code_room(offset, sizeof(a_mode) + sizeof(fst_operand), capacity) == -1)
+						{
+							err = 1;
+							break;
+						}
+
 						*p_code = a_mode;
 						(p_code)++;
 						memcpy(p_code, &fst_operand, sizeof(fst_operand));
@@ -754,6 +820,12 @@ int asm_assemble(const char *file_name, byte_t **code, word_t *size)
 							}
 						}
 
+						if (code_room(offset, sizeof(a_mode) + sizeof(fst_operand) + sizeof(snd_operand), capacity) == -1)
+						{
+							err = 1;
+							break;
+						}
+
 						*p_code = a_mode;
 						(p_code)++;
 						memcpy(p_code, &fst_operand, sizeof(fst_operand));
@@ -795,7 +867,7 @@ int asm_assemble(const char *file_name, byte_t **code, word_t *size)
 
 	*size = offset;
 
-	ret = unresolved_resolve(*code);
+	ret = unresolved_resolve(code);
 	if (ret == -1)
 	{
 		printf("Code contains some unresolved symbols\n");
@@ -806,3 +878,38 @@ int asm_assemble(const char *file_name, byte_t **code, word_t *size)
 
 	return ret;
 }
+
+/*
+ *   Assemble the file into a buffer of its own, handed out in `code`
+ */
+int asm_assemble(const char *file_name, byte_t **code, word_t *size)
+{
+	byte_t *shrunk;
+
+
+	if (code == NULL || size == NULL)
+	{
+		return -1;
+	}
+
+	*code = (byte_t *)malloc(sizeof(byte_t) * ASM_CODE_MAX);
+	if (*code == NULL)
+	{
+		return -1;
+	}
+
+	if (asm_assemble_to(file_name, *code, ASM_CODE_MAX, size) == -1)
+	{
+		free(*code);
+		*code = NULL;
+		return -1;
+	}
+
+	shrunk = (byte_t *)realloc(*code, (*size > 0) ? *size : 1);
+	if (shrunk != NULL)
+	{
+		*code = shrunk;
+	}
+
+	return 0;
+}
@@ -10,6 +10,7 @@
 /*
  *   Prototypes
  */
-int asm_assemble(const char *file_name, byte_t **code, word_t *size);
+int asm_assemble   (const char *file_name, byte_t **code, word_t *size);
+int asm_assemble_to(const char *file_name, byte_t *code, word_t capacity, word_t *size);
 
 #endif /* __ASM_H__ */
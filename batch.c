@@ -0,0 +1,879 @@
+
+/*
+ *   Includes
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "types.h"
+#include "isa.h"
+#include "mem.h"
+#include "io.h"
+#include "cpu.h"
+#include "batch.h"
+
+#ifdef __GNUC__
+#define BATCH_HAVE_VECTORS /* Vector extensions are available */
+#endif
+
+/*
+ *   Constants
+ */
+#define BATCH_WIDTH 8                      /* Lanes in one vector (a 256-bit AVX2 register) */
+#define BATCH_FETCH ISA_LENGTH_BINARY      /* Longest command                              */
+#ifndef BATCH_TILE
+#define BATCH_TILE  16                     /* Groups run together (their state fits in L1) */
+#endif
+
+#ifdef BATCH_HAVE_VECTORS
+
+/*
+ *   The hot functions are built for AVX2 as well and the variant the
+ *   host supports is picked at load time. Elsewhere the compiler
+ *   lowers the vectors to what the target has (SSE2 on x86-64).
+ */
+#if defined(__x86_64__) && defined(__linux__)
+#define BATCH_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define BATCH_CLONES
+#endif
+
+/*
+ *   Types
+ */
+typedef word_t batch_vec_t __attribute__((vector_size(BATCH_WIDTH * sizeof(word_t))));
+typedef int    batch_cmp_t __attribute__((vector_size(BATCH_WIDTH * sizeof(int))));
+
+/*
+ *   Instances run in lockstep. Their state is kept structure-of-
+ *   arrays, one vector per register holding BATCH_WIDTH instances
+ *   (lanes), so a command runs on every lane at once. The vectors
+ *   of a group of lanes are kept together, so a command touches
+ *   one run of memory per group.
+ *
+ *   Lanes that branched apart keep their own IP; the lowest IP is
+ *   run next, masked to the lanes standing on it, which brings
+ *   lanes of a loop or an if/else back together where the paths
+ *   meet. Masks are vectors of all-ones (lane taken) and zero words.
+ *   Diverged lanes run their commands once per distinct IP, so
+ *   lockstep only pays while most lanes agree.
+ *
+ *   Memory commands load and store lane by lane, each lane in its
+ *   own BATCH_MEM bytes of memory.
+ */
+typedef struct _batch_group_t
+{
+	batch_vec_t regs[NR_REGISTERS]; /* Registers by code, g[r][lane]       */
+	batch_vec_t cmp[2];             /* Operands of the last compare        */
+	batch_vec_t executed;           /* Commands run                        */
+	batch_vec_t live;               /* Lanes still running (mask)          */
+	batch_vec_t halt;               /* Halt flags (mask)                   */
+	batch_vec_t error;              /* Error flags (mask)                  */
+} batch_group_t;
+
+typedef struct _batch_t
+{
+	word_t        nr;                 /* Instances                           */
+	word_t        nr_groups;          /* Groups holding them                 */
+	word_t        tile_lo;            /* First group of the tile being run   */
+	word_t        tile_hi;            /* End of the tile                     */
+	word_t        cur;                /* IP the tile runs next               */
+	word_t        slack;              /* Commands every live lane may still run */
+	byte_t        converged;          /* Every live lane of the tile is on cur */
+	batch_group_t *groups;            /* Lane state                          */
+	int           *ret;               /* Outcome of the lanes that are done  */
+	word_t        *stored_lo;         /* Lowest byte stored to, per lane     */
+	word_t        *stored_hi;         /* End of the highest one, per lane    */
+	word_t        any_lo;             /* The same, over every lane           */
+	word_t        any_hi;
+	byte_t        *mem;               /* Memory of the lanes, one after another */
+	mem_t         *image;             /* Memory every lane started with      */
+	io_t          *io;
+	cpu_t         *cpu;               /* Decodes commands from the image     */
+	word_t        max;                /* Commands a lane may run             */
+} batch_t;
+
+/*
+ *   Vector helpers. BATCH_TRUE turns a condition (a vector compare
+ *   or a constant) into a mask; it needs `izero` in scope.
+ */
+#define BATCH_BLEND(m, x, y) (((x) & (m)) | ((y) & ~(m)))
+#define BATCH_TRUE(x)        ((batch_vec_t)((izero | (x)) != 0))
+#define BATCH_LANE(v, l)     ((v) * BATCH_WIDTH + (l))
+
+/*
+ *   Local utility functions
+ */
+static inline int batch_any(const batch_vec_t *m)
+{
+	word_t x;
+	word_t l;
+
+
+	x = 0;
+	for (l = 0; l < BATCH_WIDTH; l++)
+	{
+		x |= (*m)[l];
+	}
+
+	return x != 0;
+}
+
+/*
+ *   The word in every lane
+ */
+static inline void batch_splat(word_t w, batch_vec_t *x)
+{
+	word_t l;
+
+
+	for (l = 0; l < BATCH_WIDTH; l++)
+	{
+		(*x)[l] = w;
+	}
+}
+
+static inline byte_t* batch_lane_mem(const batch_t *batch, word_t lane)
+{
+	return batch->mem + (size_t)lane * BATCH_MEM;
+}
+
+/*
+ *   Word at the address (checked by the caller) of every lane in
+ *   the mask; the other lanes read 0
+ */
+static inline void batch_load(const batch_t *batch, word_t v, const batch_vec_t *m, word_t addr, batch_vec_t *x)
+{
+	word_t w;
+	word_t l;
+
+
+	for (l = 0; l < BATCH_WIDTH; l++)
+	{
+		w = 0;
+		if ((*m)[l])
+		{
+			memcpy(&w, batch_lane_mem(batch, BATCH_LANE(v, l)) + addr, WORD_SIZE);
+		}
+		(*x)[l] = w;
+	}
+}
+
+/*
+ *   Note that the lane wrote the word at the address
+ */
+static inline void batch_mark(batch_t *batch, word_t lane, word_t addr)
+{
+	if (addr < batch->stored_lo[lane])
+	{
+		batch->stored_lo[lane] = addr;
+	}
+
+	if (addr + WORD_SIZE > batch->stored_hi[lane])
+	{
+		batch->stored_hi[lane] = addr + WORD_SIZE;
+	}
+
+	if (addr < batch->any_lo)
+	{
+		batch->any_lo = addr;
+	}
+
+	if (addr + WORD_SIZE > batch->any_hi)
+	{
+		batch->any_hi = addr + WORD_SIZE;
+	}
+}
+
+/*
+ *   Store to the address (checked by the caller) of every lane in
+ *   the mask
+ */
+static inline void batch_store(batch_t *batch, word_t v, const batch_vec_t *m, word_t addr, const batch_vec_t *x)
+{
+	word_t lane;
+	word_t w;
+	word_t l;
+
+
+	for (l = 0; l < BATCH_WIDTH; l++)
+	{
+		if (!(*m)[l])
+		{
+			continue;
+		}
+
+		lane = BATCH_LANE(v, l);
+		w    = (*x)[l];
+		memcpy(batch_lane_mem(batch, lane) + addr, &w, WORD_SIZE);
+		batch_mark(batch, lane, addr);
+	}
+}
+
+/*
+ *   Stop the lanes in the mask on a fault. IP is left on the command.
+ */
+static void batch_fault(batch_t *batch, word_t v, const batch_vec_t *m)
+{
+	word_t l;
+
+
+	batch->groups[v].error |= *m;
+	batch->groups[v].live  &= ~*m;
+
+	for (l = 0; l < BATCH_WIDTH; l++)
+	{
+		if ((*m)[l])
+		{
+			batch->ret[BATCH_LANE(v, l)] = -1;
+		}
+	}
+}
+
+static void batch_get_state(const batch_t *batch, word_t lane, cpu_state_t *state)
+{
+	word_t v = lane / BATCH_WIDTH;
+	word_t l = lane % BATCH_WIDTH;
+	word_t r;
+
+
+	for (r = 0; r < NR_REGISTERS; r++)
+	{
+		state->regs[r] = batch->groups[v].regs[r][l];
+	}
+
+	state->cmp[0] = batch->groups[v].cmp[0][l];
+	state->cmp[1] = batch->groups[v].cmp[1][l];
+	state->halt   = (batch->groups[v].halt[l] != 0);
+	state->error  = (batch->groups[v].error[l] != 0);
+}
+
+static void batch_set_state(batch_t *batch, word_t lane, const cpu_state_t *state)
+{
+	word_t v = lane / BATCH_WIDTH;
+	word_t l = lane % BATCH_WIDTH;
+	word_t r;
+
+
+	for (r = 0; r < NR_REGISTERS; r++)
+	{
+		batch->groups[v].regs[r][l] = state->regs[r];
+	}
+
+	batch->groups[v].cmp[0][l] = state->cmp[0];
+	batch->groups[v].cmp[1][l] = state->cmp[1];
+	batch->groups[v].halt[l]   = state->halt ? ~0U : 0;
+	batch->groups[v].error[l]  = state->error ? ~0U : 0;
+}
+
+/*
+ *   Finish a lane on a CPU of its own. Used for a lane that wrote
+ *   over code it is about to run, which the other lanes do not see.
+ */
+static void batch_evict(batch_t *batch, word_t lane)
+{
+	cpu_state_t state;
+	mem_t       *mem;
+	cpu_t       *cpu;
+	word_t      v = lane / BATCH_WIDTH;
+	word_t      l = lane % BATCH_WIDTH;
+	word_t      done;
+	int         ret;
+
+
+	batch->groups[v].live[l] = 0;
+	batch->ret[lane]  = -1;
+
+	mem = mem_init(BATCH_MEM);
+	cpu = cpu_init(mem, batch->io);
+	if (mem == NULL || cpu == NULL)
+	{
+		batch->groups[v].error[l] = ~0U;
+		cpu_free(cpu);
+		mem_free(mem);
+		return;
+	}
+
+	memcpy(mem_bytes(mem), batch_lane_mem(batch, lane), BATCH_MEM);
+	batch_get_state(batch, lane, &state);
+	cpu_set_state(cpu, &state);
+
+	done = 0;
+	ret  = cpu_run_budget(cpu, batch->max - batch->groups[v].executed[l], &done);
+
+	cpu_get_state(cpu, &state);
+	batch_set_state(batch, lane, &state);
+	memcpy(batch_lane_mem(batch, lane), mem_bytes(mem), BATCH_MEM);
+
+	batch->groups[v].executed[l] += done;
+	batch->ret[lane]       = ret;
+
+	cpu_free(cpu);
+	mem_free(mem);
+}
+
+/*
+ *   Evict the lanes about to run the `length` bytes of command at
+ *   `cur` whose memory differs there from the image the command was
+ *   decoded from
+ */
+static void batch_check_code(batch_t *batch, word_t cur, word_t length)
+{
+	const byte_t *image = mem_bytes(batch->image);
+	word_t       end;
+	word_t       lane;
+
+
+	if (cur >= BATCH_MEM)
+	{
+		return;
+	}
+
+	end = (length < BATCH_MEM - cur) ? cur + length : BATCH_MEM;
+
+	for (lane = batch->tile_lo * BATCH_WIDTH; lane < batch->tile_hi * BATCH_WIDTH; lane++)
+	{
+		if (!batch->groups[lane / BATCH_WIDTH].live[lane % BATCH_WIDTH] ||
+		    batch->groups[lane / BATCH_WIDTH].regs[ISA_REG_IP][lane % BATCH_WIDTH] != cur ||
+		    batch->stored_hi[lane] <= cur || batch->stored_lo[lane] >= end)
+		{
+			continue;
+		}
+
+		if (memcmp(batch_lane_mem(batch, lane) + cur, image + cur, end - cur) != 0)
+		{
+			batch_evict(batch, lane);
+		}
+	}
+}
+
+/*
+ *   Take the lanes out of the run, out of budget
+ */
+static void batch_retire(batch_t *batch, word_t v, const batch_vec_t *over)
+{
+	word_t l;
+
+
+	batch->groups[v].live &= ~*over;
+
+	for (l = 0; l < BATCH_WIDTH; l++)
+	{
+		if ((*over)[l])
+		{
+			batch->ret[BATCH_LANE(v, l)] = 1;
+		}
+	}
+}
+
+/*
+ *   Lowest IP of the live lanes, from the fold of every group.
+ *   Returns -1 when no lane is left.
+ */
+static inline int batch_lowest(batch_t *batch, const batch_vec_t *lo, const batch_vec_t *hi,
+                               const batch_vec_t *live, const batch_vec_t *left)
+{
+	word_t top;
+	word_t l;
+
+
+	if (!batch_any(live))
+	{
+		return -1;
+	}
+
+	batch->cur   = ~0U;
+	batch->slack = ~0U;
+	top          = 0;
+	for (l = 0; l < BATCH_WIDTH; l++)
+	{
+		if (!(*live)[l])
+		{
+			continue;
+		}
+
+		if ((*lo)[l] < batch->cur)
+		{
+			batch->cur = (*lo)[l];
+		}
+
+		if ((*hi)[l] > top)
+		{
+			top = (*hi)[l];
+		}
+
+		if ((*left)[l] < batch->slack)
+		{
+			batch->slack = (*left)[l];
+		}
+	}
+
+	batch->converged = (batch->cur == top);
+
+	return 0;
+}
+
+/*
+ *   Retire the lanes of group v that used up the budget and fold
+ *   the others into the lowest and highest IPs and the least budget
+ *   left per lane position
+ */
+#define BATCH_FOLD(v)                                                       \
+	{                                                                   \
+		batch_vec_t over_;                                          \
+		batch_vec_t ip_;                                            \
+		batch_vec_t x_;                                             \
+		                                                            \
+		over_ = batch->groups[v].executed >= max;                   \
+		over_ = batch->groups[v].live & BATCH_TRUE(over_);          \
+		if (batch_any(&over_))                                      \
+		{                                                           \
+			batch_retire(batch, v, &over_);                     \
+		}                                                           \
+		                                                            \
+		ip_   = batch->groups[v].regs[ISA_REG_IP];                  \
+		x_    = ip_ | ~batch->groups[v].live;                       \
+		lo    = BATCH_BLEND(BATCH_TRUE(x_ < lo), x_, lo);           \
+		x_    = ip_ & batch->groups[v].live;                        \
+		hi    = BATCH_BLEND(BATCH_TRUE(x_ > hi), x_, hi);           \
+		x_    = (max - batch->groups[v].executed) | ~batch->groups[v].live; \
+		left  = BATCH_BLEND(BATCH_TRUE(x_ < left), x_, left);       \
+		live |= batch->groups[v].live;                              \
+	}
+
+#define BATCH_FOLD_VARS                                                     \
+	batch_vec_t max  = zero + batch->max;                               \
+	batch_vec_t lo   = ~zero;                                           \
+	batch_vec_t hi   = zero;                                            \
+	batch_vec_t left = ~zero;                                           \
+	batch_vec_t live = zero
+
+/*
+ *   Find the IP to run first. Returns -1 when no lane is left.
+ */
+static BATCH_CLONES int batch_first(batch_t *batch)
+{
+	const batch_cmp_t izero = { 0 };
+	const batch_vec_t zero  = { 0 };
+	word_t            v;
+	BATCH_FOLD_VARS;
+
+
+	for (v = batch->tile_lo; v < batch->tile_hi; v++)
+	{
+		BATCH_FOLD(v)
+	}
+
+	return batch_lowest(batch, &lo, &hi, &live, &left);
+}
+
+/*
+ *   Command bodies over a group of lanes. `m` masks the lanes
+ *   standing on the command; the operand accessors give the
+ *   operands of every lane of group `v`.
+ */
+#define BATCH_REG(code)         batch->groups[v].regs[code]
+#define BATCH_IP                batch->groups[v].regs[ISA_REG_IP]
+#define BATCH_CMP(i)            batch->groups[v].cmp[i]
+
+#define BATCH_A_reg_mem(x)      (x) = BATCH_REG(insn->op1)
+#define BATCH_A_reg_reg(x)      (x) = BATCH_REG(insn->op1)
+#define BATCH_A_mem_reg(x)      batch_load(batch, v, &m, insn->op1, &(x))
+#define BATCH_A_imm_mem(x)      batch_splat(insn->op1, &(x))
+#define BATCH_A_imm_reg(x)      batch_splat(insn->op1, &(x))
+
+#define BATCH_B_reg_mem(x)      batch_load(batch, v, &m, insn->op2, &(x))
+#define BATCH_B_reg_reg(x)      (x) = BATCH_REG(insn->op2)
+#define BATCH_B_mem_reg(x)      (x) = BATCH_REG(insn->op2)
+#define BATCH_B_imm_mem(x)      batch_load(batch, v, &m, insn->op2, &(x))
+#define BATCH_B_imm_reg(x)      (x) = BATCH_REG(insn->op2)
+
+#define BATCH_D_REG(x, w)       BATCH_REG(insn->op2) = BATCH_BLEND(w, x, BATCH_REG(insn->op2))
+#define BATCH_D_reg_mem(x, w)   batch_store(batch, v, &(w), insn->op2, &(x))
+#define BATCH_D_reg_reg(x, w)   BATCH_D_REG(x, w)
+#define BATCH_D_mem_reg(x, w)   BATCH_D_REG(x, w)
+#define BATCH_D_imm_mem(x, w)   batch_store(batch, v, &(w), insn->op2, &(x))
+#define BATCH_D_imm_reg(x, w)   BATCH_D_REG(x, w)
+
+#define BATCH_T_reg(x, c)       (x) = BATCH_REG(insn->op1)
+#define BATCH_T_imm(x, c)       batch_splat(insn->op1, &(x))
+#define BATCH_T_mem(x, c)                                                   \
+	if (insn->op1 > BATCH_MEM - WORD_SIZE)                              \
+	{                                                                   \
+		batch_fault(batch, v, &(c));                                \
+		m &= ~(c);                                                  \
+		(c) = zero;                                                 \
+	}                                                                   \
+	else                                                                \
+	{                                                                   \
+		batch_load(batch, v, &(c), insn->op1, &(x));                \
+	}
+
+#define BATCH_STEP              BATCH_IP = BATCH_BLEND(m, curv + insn->length, BATCH_IP)
+
+#define ISA_EQU                 ISA_FLAG_EQU(BATCH_CMP(0), BATCH_CMP(1))
+#define ISA_GREATER             ISA_FLAG_GREATER(BATCH_CMP(0), BATCH_CMP(1))
+
+/*
+ *   A fault possible in any lane (division by zero) sends the
+ *   vector down the lane-by-lane path, so no lane ever faults in
+ *   the host
+ */
+#define BATCH_BODY_ALU(mode, expr, fault)                                   \
+	{                                                                   \
+		batch_vec_t av = zero;                                      \
+		batch_vec_t bv = zero;                                      \
+		batch_vec_t rv = zero;                                      \
+		batch_vec_t f;                                              \
+		word_t      l;                                              \
+		                                                            \
+		BATCH_A_##mode(av);                                         \
+		BATCH_B_##mode(bv);                                         \
+		{                                                           \
+			batch_vec_t a = av;                                 \
+			batch_vec_t b = bv;                                 \
+			                                                    \
+			f = BATCH_TRUE(fault);                              \
+			if (!batch_any(&f))                                 \
+			{                                                   \
+				rv = expr;                                  \
+			}                                                   \
+		}                                                           \
+		if (batch_any(&f))                                          \
+		{                                                           \
+			for (l = 0; l < BATCH_WIDTH; l++)                   \
+			{                                                   \
+				word_t a = av[l];                           \
+				word_t b = bv[l];                           \
+				                                            \
+				f[l]  = (m[l] && (fault)) ? ~0U : 0;        \
+				rv[l] = (m[l] && !f[l]) ? (expr) : 0;       \
+			}                                                   \
+			batch->groups[v].error |= f;                               \
+		}                                                           \
+		f = m & ~f;                                                 \
+		BATCH_D_##mode(rv, f);                                      \
+		BATCH_STEP;                                                 \
+	}
+
+#define BATCH_BODY_MOV(mode, expr, fault)                                   \
+	{                                                                   \
+		batch_vec_t a;                                              \
+		                                                            \
+		BATCH_A_##mode(a);                                          \
+		BATCH_D_##mode(a, m);                                       \
+		BATCH_STEP;                                                 \
+	}
+
+#define BATCH_BODY_CMP(mode, expr, fault)                                   \
+	{                                                                   \
+		batch_vec_t a;                                              \
+		batch_vec_t b;                                              \
+		                                                            \
+		BATCH_A_##mode(a);                                          \
+		BATCH_B_##mode(b);                                          \
+		BATCH_CMP(0) = BATCH_BLEND(m, a, BATCH_CMP(0));             \
+		BATCH_CMP(1) = BATCH_BLEND(m, b, BATCH_CMP(1));             \
+		BATCH_STEP;                                                 \
+	}
+
+#define BATCH_BODY_JUMP(mode, cond)                                         \
+	{                                                                   \
+		batch_vec_t c = m & BATCH_TRUE(cond);                       \
+		batch_vec_t t = zero;                                       \
+		                                                            \
+		if (batch_any(&c))                                          \
+		{                                                           \
+			BATCH_T_##mode(t, c);                               \
+		}                                                           \
+		BATCH_STEP;                                                 \
+		BATCH_IP = BATCH_BLEND(c, t, BATCH_IP);                     \
+	}
+
+/*
+ *   Run the body on every group with lanes standing on the command
+ *   and count the command for them. The IP to run next is found on
+ *   the way, unless every lane stands on the command and it is not
+ *   a branch: then the lanes all go on to the next command.
+ */
+#define BATCH_LANES(body)                                                   \
+	for (v = batch->tile_lo; v < batch->tile_hi; v++)                   \
+	{                                                                   \
+		m = batch->groups[v].live;                                  \
+		if (!straight)                                              \
+		{                                                           \
+			m &= BATCH_TRUE(BATCH_IP == curv);                  \
+		}                                                           \
+		if (batch_any(&m))                                          \
+		{                                                           \
+			body                                                \
+			batch->groups[v].executed -= m;                     \
+		}                                                           \
+		if (!straight)                                              \
+		{                                                           \
+			BATCH_FOLD(v)                                       \
+		}                                                           \
+	}
+
+#define BATCH_BINARY_MODE(mode, am, name, class, expr, fault)               \
+	case ISA_H_##name##_##mode:                                         \
+		BATCH_LANES(BATCH_BODY_##class(mode, expr, fault))          \
+		break;
+#define BATCH_BINARY(name, opcode, class, expr, fault)                      \
+	ISA_BINARY_MODES(BATCH_BINARY_MODE, name, class, expr, fault)
+
+#define BATCH_JUMP_MODE(mode, am, name, cond)                               \
+	case ISA_H_##name##_##mode:                                         \
+		BATCH_LANES(BATCH_BODY_JUMP(mode, cond))                    \
+		break;
+#define BATCH_JUMP(name, opcode, cond)                                      \
+	ISA_JUMP_MODES(BATCH_JUMP_MODE, name, cond)
+
+/*
+ *   Run the command at batch->cur on every lane standing on it and
+ *   find the IP to run next. Memory operands of two-operand commands
+ *   were checked by the caller. Returns -1 when no lane is left.
+ */
+static BATCH_CLONES int batch_exec(batch_t *batch, const cpu_command_t *insn)
+{
+	const batch_cmp_t izero = { 0 };
+	const batch_vec_t zero  = { 0 };
+	batch_vec_t       curv  = zero + batch->cur;
+	batch_vec_t       m;
+	word_t            v;
+	int               straight;
+	BATCH_FOLD_VARS;
+
+
+	straight = batch->converged && batch->slack > 1 && insn->length == ISA_LENGTH_BINARY &&
+	           insn->handler != ISA_H_trap;
+
+	switch (insn->handler)
+	{
+	ISA_BINARY_OPS(BATCH_BINARY)
+	ISA_JUMP_OPS(BATCH_JUMP)
+
+	case ISA_H_halt:
+		BATCH_LANES(batch->groups[v].halt |= m; batch->groups[v].live &= ~m;)
+		break;
+
+	case ISA_H_bad_mode:
+		BATCH_LANES(batch->groups[v].error |= m; BATCH_STEP;)
+		break;
+
+	default:
+		BATCH_LANES(batch_fault(batch, v, &m); m = zero;)
+		break;
+	}
+
+	if (straight)
+	{
+		batch->cur   += insn->length;
+		batch->slack -= 1;
+		return 0;
+	}
+
+	return batch_lowest(batch, &lo, &hi, &live, &left);
+}
+
+#undef ISA_EQU
+#undef ISA_GREATER
+
+/*
+ *   Run one command on the lanes with the lowest IP. Returns -1
+ *   when every lane of the tile is done.
+ */
+static int batch_step(batch_t *batch)
+{
+	cpu_command_t insn;
+	word_t        length;
+	word_t        cur;
+	int           fault;
+
+
+	cur = batch->cur;
+
+	/*
+	 *   A command the image has no room for is checked over the
+	 *   longest command a lane could have written there instead
+	 */
+	fault  = (cpu_get_command(batch->cpu, cur, &insn) == -1);
+	length = fault ? BATCH_FETCH : insn.length;
+	if (cur < batch->any_hi && cur + length > batch->any_lo)
+	{
+		batch_check_code(batch, cur, length);
+		batch->converged = 0;
+	}
+
+	if (!fault && insn.length == ISA_LENGTH_BINARY && insn.handler != ISA_H_bad_mode)
+	{
+		fault = (ISA_OP1_IS_MEM(insn.mode) && insn.op1 > BATCH_MEM - WORD_SIZE) ||
+		        (ISA_OP2_IS_MEM(insn.mode) && insn.op2 > BATCH_MEM - WORD_SIZE);
+	}
+
+	if (fault)
+	{
+		insn.handler = ISA_H_trap;
+	}
+
+	return batch_exec(batch, &insn);
+}
+
+static int batch_free(batch_t *batch)
+{
+	if (batch == NULL)
+	{
+		return -1;
+	}
+
+	cpu_free(batch->cpu);
+	io_free(batch->io);
+	mem_free(batch->image);
+	free(batch->mem);
+	free(batch->stored_lo);
+	free(batch->stored_hi);
+	free(batch->ret);
+	free(batch->groups);
+	free(batch);
+
+	return 0;
+}
+
+static batch_t* batch_init(const byte_t *code, word_t size, word_t nr, word_t max)
+{
+	batch_t *batch;
+	word_t  i;
+
+
+	batch = (batch_t *)calloc(1, sizeof(*batch));
+	if (batch == NULL)
+	{
+		return NULL;
+	}
+
+	batch->nr      = nr;
+	batch->nr_groups = (nr + BATCH_WIDTH - 1) / BATCH_WIDTH;
+	batch->max     = max;
+	batch->any_lo  = BATCH_MEM;
+	batch->any_hi  = 0;
+
+	batch->groups    = (batch_group_t *)aligned_alloc(sizeof(batch_vec_t),
+	                   batch->nr_groups * sizeof(batch_group_t));
+	batch->ret       = (int *)calloc(nr, sizeof(int));
+	batch->stored_lo = (word_t *)malloc(nr * sizeof(word_t));
+	batch->stored_hi = (word_t *)calloc(nr, sizeof(word_t));
+	batch->mem       = (byte_t *)calloc(nr, BATCH_MEM);
+	batch->image     = mem_init(BATCH_MEM);
+	batch->io        = io_init();
+	batch->cpu       = cpu_init(batch->image, batch->io);
+	if (batch->groups == NULL || batch->ret == NULL || batch->stored_lo == NULL ||
+	    batch->stored_hi == NULL || batch->mem == NULL || batch->cpu == NULL)
+	{
+		batch_free(batch);
+		return NULL;
+	}
+
+	memset(batch->groups, 0, batch->nr_groups * sizeof(batch_group_t));
+
+	/*
+	 *   Every lane starts powered on, with the code loaded at 0
+	 *   and the rest of memory cleared (lane memory comes cleared,
+	 *   so pages a lane never touches are never made). A compare of
+	 *   (0, 1) leaves the flags clear.
+	 */
+	memset(mem_bytes(batch->image), 0, BATCH_MEM);
+	if (cpu_load_code(batch->cpu, 0, (byte_t *)code, size) == -1)
+	{
+		batch_free(batch);
+		return NULL;
+	}
+
+	for (i = 0; i < nr; i++)
+	{
+		memcpy(batch_lane_mem(batch, i), code, size);
+		batch->stored_lo[i] = BATCH_MEM;
+		batch->groups[i / BATCH_WIDTH].live[i % BATCH_WIDTH]   = ~0U;
+		batch->groups[i / BATCH_WIDTH].cmp[1][i % BATCH_WIDTH] = 1;
+	}
+
+	return batch;
+}
+
+#endif /* BATCH_HAVE_VECTORS */
+
+/*
+ *   Implementation
+ */
+
+/*
+ *   Run `nr` instances of the code (loaded at address 0) in lockstep,
+ *   instance i with patches[i] applied to its memory. Each instance
+ *   gets a budget of `max` commands, counted the way cpu_run_budget()
+ *   counts it, and results[i] gets its outcome as cpu_run_budget()
+ *   would report it. Instances never see each other's memory.
+ */
+int batch_run(const byte_t *code, word_t size, const batch_patch_t *patches,
+              word_t nr, word_t max, batch_result_t *results)
+{
+#ifdef BATCH_HAVE_VECTORS
+	batch_t *batch;
+	word_t  v;
+	word_t  i;
+
+
+	if (code == NULL || size == 0 || size > BATCH_MEM || patches == NULL ||
+	    nr == 0 || results == NULL)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++)
+	{
+		if (patches[i].addr > BATCH_MEM - WORD_SIZE)
+		{
+			return -1;
+		}
+	}
+
+	batch = batch_init(code, size, nr, max);
+	if (batch == NULL)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++)
+	{
+		memcpy(batch_lane_mem(batch, i) + patches[i].addr, &patches[i].value, WORD_SIZE);
+		batch_mark(batch, i, patches[i].addr);
+	}
+
+	for (v = 0; v < batch->nr_groups; v += BATCH_TILE)
+	{
+		batch->tile_lo = v;
+		batch->tile_hi = (BATCH_TILE < batch->nr_groups - v) ? v + BATCH_TILE : batch->nr_groups;
+
+		if (batch_first(batch) == -1)
+		{
+			continue;
+		}
+
+		while (batch_step(batch) == 0)
+		{
+		}
+	}
+
+	for (i = 0; i < nr; i++)
+	{
+		v = i / BATCH_WIDTH;
+
+		results[i].ret      = batch->ret[i];
+		results[i].executed = batch->groups[v].executed[i % BATCH_WIDTH];
+		batch_get_state(batch, i, &results[i].state);
+	}
+
+	batch_free(batch);
+
+	return 0;
+#else
+	return -1;
+#endif
+}
@@ -0,0 +1,50 @@
+
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+/*
+ *   Includes
+ */
+#include "types.h"
+#include "mem.h"
+#include "cpu.h"
+
+/*
+ *   Constants
+ */
+#define BATCH_MEM (MEM_SIZE * WORD_SIZE) /* Bytes of memory of one instance (4 KiB) */
+
+/*
+ *   Types
+ */
+
+/*
+ *   Input of one instance: a word written to its memory before
+ *   the run
+ */
+typedef struct _batch_patch_t
+{
+	word_t addr;  /* Byte address of the word */
+	word_t value; /* Value stored there       */
+} batch_patch_t;
+
+/*
+ *   Outcome of one instance
+ */
+typedef struct _batch_result_t
+{
+	int         ret;      /* 0 on halt, 1 when out of budget, -1 on error */
+	word_t      executed; /* Commands run                                 */
+	cpu_state_t state;    /* Registers and flags at the end               */
+} batch_result_t;
+
+/*
+ *   Prototypes. Every instance has BATCH_MEM bytes of memory, the
+ *   default of a VM, whatever the code needs: batch_run() fails on
+ *   code or patches that do not fit, and accesses past the end fault
+ *   as they would on a VM of that size.
+ */
+int batch_run(const byte_t *code, word_t size, const batch_patch_t *patches,
+              word_t nr, word_t max, batch_result_t *results);
+
+#endif /* __BATCH_H__ */
@@ -0,0 +1,1568 @@
+
+/*
+ *   Includes
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "types.h"
+#include "asm.h"
+#include "cpu.h"
+#include "mem.h"
+#include "io.h"
+#include "aot.h"
+#include "cache.h"
+#include "batch.h"
+#include "vm.h"
+
+/*
+ *   Constants
+ */
+#define BENCH_STEPS   2000000 /* Commands executed per measurement      */
+#define BENCH_UNROLL  16      /* Copies of the measured command in loop */
+#define SEARCH_ROUNDS 2000000 /* Lookups per dispatch table size        */
+#define FACTORIAL_N   200000  /* Loop iterations of code.text           */
+#define MEM_ACCESSES  4000000 /* Word accesses per memory measurement   */
+#define ONE_SHOT_RUNS 2000    /* Cold runs of the one-shot measurement  */
+#define CACHE_RUNS    200     /* Starts of the translation cache measurement */
+#define CACHE_BUILDS  3       /* ...of them, with the cache emptied first    */
+#define BATCH_INSTANCES 4096  /* Instances of the lockstep measurement       */
+#define BATCH_N         256   /* Largest n of code.text they run with        */
+#define SPARSE_RUNS     200   /* Starts per memory size of the sparse measurement */
+#define LOAD_SIZE       (16U << 20) /* Bytes of the image of the load measurement    */
+#define MAP_SIZE        (256U << 20) /* Bytes of the data image of the map measurement */
+#define PAGES_SIZE      (256U << 20) /* Bytes of memory of the page size measurement   */
+#define PAGES_ACCESSES  20000000     /* Random word accesses per page size             */
+#define IDLE_INSTANCES  10000        /* Instances of the idle footprint measurement    */
+
+/*
+ *   Types
+ */
+typedef struct _bench_cmd_t
+{
+	const char *mnemonic;
+	byte_t     opcode;
+	byte_t     mode;
+	word_t     op1;
+	word_t     op2;
+	word_t     size;
+} bench_cmd_t;
+
+typedef struct _bench_vm_t
+{
+	mem_t *mem;
+	io_t  *io;
+	cpu_t *cpu;
+} bench_vm_t;
+
+/*
+ *   One representative command per opcode. Operands are picked
+ *   so that the command can be repeated forever: g1 holds 1 and
+ *   every arithmetic command leaves it at 1.
+ */
+static bench_cmd_t bench_cmds[] =
+{
+	{ "add",  0x01, MODE_IMMEDIATE_REGISTER, 0, 0x03, 10 },
+	{ "sub",  0x02, MODE_IMMEDIATE_REGISTER, 2, 0x03, 10 },
+	{ "jump", 0x03, MODE_IMMEDIATE,          0, 0,     6 },
+	{ "halt", 0x04, 0,                       0, 0,     1 },
+	{ "mov",  0x05, MODE_IMMEDIATE_REGISTER, 1, 0x03, 10 },
+	{ "cmp",  0x06, MODE_IMMEDIATE_REGISTER, 1, 0x03, 10 },
+	{ "jg",   0x07, MODE_IMMEDIATE,          0, 0,     6 },
+	{ "je",   0x08, MODE_IMMEDIATE,          0, 0,     6 },
+	{ "mul",  0x09, MODE_IMMEDIATE_REGISTER, 1, 0x03, 10 },
+	{ "div",  0x0a, MODE_IMMEDIATE_REGISTER, 1, 0x03, 10 },
+	{ NULL,                                               },
+};
+
+/*
+ *   Local utility functions
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *   Resident set size of the process, in bytes
+ */
+static long rss(void)
+{
+	FILE *file;
+	long pages;
+	long resident;
+
+
+	file = fopen("/proc/self/statm", "r");
+	if (file == NULL)
+	{
+		return 0;
+	}
+
+	if (fscanf(file, "%ld %ld", &pages, &resident) != 2)
+	{
+		resident = 0;
+	}
+
+	fclose(file);
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static word_t emit(byte_t *code, word_t offset, byte_t opcode, byte_t mode, word_t op1, word_t op2, word_t size)
+{
+	code[offset] = opcode;
+
+	if (size > 1)
+	{
+		code[offset + 1] = mode;
+		memcpy(code + offset + 2, &op1, sizeof(op1));
+	}
+
+	if (size > 6)
+	{
+		memcpy(code + offset + 6, &op2, sizeof(op2));
+	}
+
+	return offset + size;
+}
+
+static int vm_create_sized(bench_vm_t *vm, word_t size)
+{
+	vm->mem = mem_init(size);
+	vm->io  = io_init();
+	if (vm->mem == NULL || vm->io == NULL)
+	{
+		return -1;
+	}
+
+	vm->cpu = cpu_init(vm->mem, vm->io);
+	if (vm->cpu == NULL)
+	{
+		return -1;
+	}
+
+	return cpu_poweron(vm->cpu);
+}
+
+static int vm_create(bench_vm_t *vm)
+{
+	return vm_create_sized(vm, MEM_SIZE * WORD_SIZE);
+}
+
+static void vm_destroy(bench_vm_t *vm)
+{
+	cpu_free(vm->cpu);
+	io_free(vm->io);
+	mem_free(vm->mem);
+}
+
+/*
+ *   Word access the way the CPU did it before mem_load_word() and
+ *   mem_store_word(): two aligned words and a byte shuffle for any
+ *   unaligned address. Kept as the reference for the benchmark.
+ */
+static int legacy_read_word(mem_t *mem, word_t addr, word_t *word)
+{
+	mem_word_t w1;
+	mem_word_t w2;
+	mem_word_t w3;
+	word_t     byte;
+	int        ret;
+	int        i;
+	int        j;
+
+
+	if (addr % WORD_SIZE == 0)
+	{
+		return mem_read(mem, addr, word);
+	}
+
+	byte = addr % WORD_SIZE;
+	addr = addr / WORD_SIZE * WORD_SIZE;
+
+	ret  = mem_read(mem, addr, &w1.w);
+	ret += mem_read(mem, addr + WORD_SIZE, &w2.w);
+	if (ret < 0)
+	{
+		return -1;
+	}
+
+	for (i = 0, j = byte; j < WORD_SIZE; i++, j++)
+	{
+		w3.bytes[i] = w1.bytes[j];
+	}
+
+	for (j = 0; i < WORD_SIZE; i++, j++)
+	{
+		w3.bytes[i] = w2.bytes[j];
+	}
+
+	*word = w3.w;
+
+	return 0;
+}
+
+static int legacy_write_word(mem_t *mem, word_t addr, word_t word)
+{
+	mem_word_t w1;
+	mem_word_t w2;
+	mem_word_t w3;
+	word_t     byte;
+	int        ret;
+	int        i;
+	int        j;
+
+
+	if (addr % WORD_SIZE == 0)
+	{
+		return mem_write(mem, addr, word);
+	}
+
+	byte = addr % WORD_SIZE;
+	addr = addr / WORD_SIZE * WORD_SIZE;
+
+	ret  = mem_read(mem, addr, &w1.w);
+	ret += mem_read(mem, addr + WORD_SIZE, &w2.w);
+	if (ret < 0)
+	{
+		return -1;
+	}
+
+	w3.w = word;
+
+	for (i = byte, j = 0; i < WORD_SIZE; i++, j++)
+	{
+		w1.bytes[i] = w3.bytes[j];
+	}
+
+	for (i = 0; j < WORD_SIZE; i++, j++)
+	{
+		w2.bytes[i] = w3.bytes[j];
+	}
+
+	ret  = mem_write(mem, addr, w1.w);
+	ret += mem_write(mem, addr + WORD_SIZE, w2.w);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+/*
+ *   Benchmarks
+ */
+
+/*
+ *   Cost of one cpu_next_command() for every opcode of the ISA.
+ *   With the old linear table search, the cost grew with the
+ *   position of the opcode in the table.
+ */
+static void bench_dispatch_per_opcode(void)
+{
+	bench_vm_t vm;
+	byte_t     code[512];
+	word_t     offset;
+	word_t     loop;
+	word_t     target;
+	int        c;
+	int        u;
+	long       s;
+	double     t;
+
+
+	printf("Dispatch cost per opcode (cpu_next_command):\n");
+
+	for (c = 0; bench_cmds[c].mnemonic != NULL; c++)
+	{
+		if (vm_create(&vm) == -1)
+		{
+			printf("Unable to create VM\n");
+			return;
+		}
+
+		/*
+		 *   mov $1 g1, then the measured command repeated and
+		 *   a jump back to the first copy
+		 */
+		offset = emit(code, 0, 0x05, MODE_IMMEDIATE_REGISTER, 1, 0x03, 10);
+		loop   = offset;
+		for (u = 0; u < BENCH_UNROLL; u++)
+		{
+			/*
+			 *   Branches go to the next command, so the taken and
+			 *   not-taken paths execute the same sequence
+			 */
+			target = offset + bench_cmds[c].size;
+			offset = emit(code, offset, bench_cmds[c].opcode, bench_cmds[c].mode,
+				      bench_cmds[c].size == 6 ? target : bench_cmds[c].op1,
+				      bench_cmds[c].op2, bench_cmds[c].size);
+		}
+		offset = emit(code, offset, 0x03, MODE_IMMEDIATE, loop, 0, 6);
+
+		cpu_load_code(vm.cpu, 0, code, offset);
+		cpu_next_command(vm.cpu);
+
+		t = now();
+		for (s = 0; s < BENCH_STEPS; s++)
+		{
+			cpu_next_command(vm.cpu);
+		}
+		t = now() - t;
+
+		printf("\t%-5s (0x%02x): %6.2f ns/command\n", bench_cmds[c].mnemonic,
+		       bench_cmds[c].opcode, t * 1e9 / BENCH_STEPS);
+
+		vm_destroy(&vm);
+	}
+}
+
+/*
+ *   Stand-alone model of the two dispatch schemes: searching a
+ *   table of pairs against indexing a table by opcode, while the
+ *   number of defined opcodes grows.
+ */
+static void bench_dispatch_scaling(void)
+{
+	static const int sizes[] = { 10, 32, 64, 128, 256 };
+	byte_t           opcodes[256];
+	int              handlers[256];
+	volatile int     sink;
+	int              n;
+	int              i;
+	int              k;
+	long             r;
+	byte_t           op;
+	double           t_search;
+	double           t_index;
+
+
+	printf("Dispatch cost against number of opcodes:\n");
+	printf("\t%8s %14s %14s\n", "opcodes", "search (ns)", "indexed (ns)");
+
+	for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+	{
+		for (i = 0; i < 256; i++)
+		{
+			opcodes[i]  = i;
+			handlers[i] = i;
+		}
+
+		sink = 0;
+
+		t_search = now();
+		for (r = 0; r < SEARCH_ROUNDS; r++)
+		{
+			op = r % sizes[n];
+			for (k = 0; k < sizes[n]; k++)
+			{
+				if (opcodes[k] == op)
+				{
+					break;
+				}
+			}
+			sink += handlers[k];
+		}
+		t_search = now() - t_search;
+
+		t_index = now();
+		for (r = 0; r < SEARCH_ROUNDS; r++)
+		{
+			op    = r % sizes[n];
+			sink += handlers[op];
+		}
+		t_index = now() - t_index;
+
+		printf("\t%8d %14.2f %14.2f\n", sizes[n],
+		       t_search * 1e9 / SEARCH_ROUNDS, t_index * 1e9 / SEARCH_ROUNDS);
+	}
+}
+
+/*
+ *   Build the ahead-of-time module of the code loaded at 0 and attach
+ *   it. Returns the seconds taken, or -1.
+ */
+static double bench_aot_attach(cpu_t *cpu, word_t size)
+{
+	char   src[64];
+	char   so[64];
+	int    ret;
+	double t;
+
+
+	snprintf(src, sizeof(src), "/tmp/vm_bench_%d.c", (int)getpid());
+	snprintf(so, sizeof(so), "/tmp/vm_bench_%d.so", (int)getpid());
+
+	t = now();
+	ret = cpu_aot_emit(cpu, 0, size, src);
+	if (ret == 0)
+	{
+		ret = aot_compile(src, so);
+	}
+
+	if (ret == 0)
+	{
+		ret = cpu_aot_attach(cpu, so);
+	}
+	t = now() - t;
+
+	remove(src);
+	remove(so);
+
+	return (ret == 0) ? t : -1;
+}
+
+/*
+ *   Instructions per second of a program for every run engine,
+ *   with and without superinstructions, the share of decoded
+ *   commands that were fused and the basic blocks translated
+ */
+static void bench_program(const char *name, byte_t *code, word_t size)
+{
+	static const struct
+	{
+		const char   *name;
+		cpu_engine_t engine;
+	} engines[] =
+	{
+		{ "portable", CPU_ENGINE_PORTABLE },
+		{ "threaded", CPU_ENGINE_THREADED },
+		{ "jit",      CPU_ENGINE_JIT      },
+		{ "tiered",   CPU_ENGINE_TIERED   },
+	};
+	bench_vm_t       vm;
+	cpu_stats_t      before;
+	cpu_stats_t      after;
+	cpu_tier_stats_t tiers_before;
+	cpu_tier_stats_t tiers_after;
+	word_t      ip;
+	word_t      next_ip;
+	long        steps;
+	int         e;
+	int         fusion;
+	double      t[2];
+	double      build;
+
+
+	printf("Engines on %s:\n", name);
+
+	if (vm_create(&vm) == -1)
+	{
+		printf("\tUnable to create VM\n");
+		return;
+	}
+
+	cpu_load_code(vm.cpu, 0, code, size);
+
+	/*
+	 *   Count the commands of one run by single stepping, up to
+	 *   halt (the only command that leaves IP where it was)
+	 */
+	steps = 0;
+	do
+	{
+		cpu_get_ip(vm.cpu, &ip);
+		if (cpu_next_command(vm.cpu) == -1)
+		{
+			break;
+		}
+		cpu_get_ip(vm.cpu, &next_ip);
+		steps++;
+	} while (ip != next_ip);
+
+	build = bench_aot_attach(vm.cpu, size);
+
+	for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+	{
+		if (cpu_set_engine(vm.cpu, engines[e].engine) == -1)
+		{
+			printf("\t%-10s: not available\n", engines[e].name);
+			continue;
+		}
+
+		for (fusion = 0; fusion < 2; fusion++)
+		{
+			cpu_set_fusion(vm.cpu, fusion);
+			cpu_poweron(vm.cpu);
+			cpu_get_stats(vm.cpu, &before);
+			cpu_get_tier_stats(vm.cpu, &tiers_before);
+
+			t[fusion] = now();
+			cpu_run(vm.cpu);
+			t[fusion] = now() - t[fusion];
+
+			cpu_get_stats(vm.cpu, &after);
+			cpu_get_tier_stats(vm.cpu, &tiers_after);
+		}
+
+		printf("\t%-10s: %ld commands, %8.2f M commands/s, %8.2f fused (x%.2f)\n",
+		       engines[e].name, steps, steps / t[0] / 1e6, steps / t[1] / 1e6, t[0] / t[1]);
+	}
+
+	/*
+	 *   Ahead-of-time module (superinstructions do not apply to it)
+	 */
+	if (build >= 0 && cpu_set_engine(vm.cpu, CPU_ENGINE_AOT) == 0)
+	{
+		cpu_poweron(vm.cpu);
+
+		t[0] = now();
+		cpu_run(vm.cpu);
+		t[0] = now() - t[0];
+
+		printf("\t%-10s: %ld commands, %8.2f M commands/s, module built in %.1f ms\n",
+		       "aot", steps, steps / t[0] / 1e6, build * 1e3);
+	}
+	else
+	{
+		printf("\t%-10s: not available\n", "aot");
+	}
+
+	printf("\t%-10s: %u of %u decoded commands fused\n", "fusion",
+	       after.fused - before.fused, after.decoded - before.decoded);
+	printf("\t%-10s: %u translated, %u compiled, cache emptied %u times\n", "blocks",
+	       after.blocks - before.blocks, after.native - before.native, after.flushes - before.flushes);
+	printf("\t%-10s: %u loops traced\n", "traces", after.traces - before.traces);
+	printf("\t%-10s: %u blocks threaded, %u compiled, %u tier switches\n", "tiers",
+	       tiers_after.promoted[CPU_TIER_THREADED] - tiers_before.promoted[CPU_TIER_THREADED],
+	       tiers_after.promoted[CPU_TIER_NATIVE] - tiers_before.promoted[CPU_TIER_NATIVE],
+	       tiers_after.switches - tiers_before.switches);
+
+	vm_destroy(&vm);
+}
+
+/*
+ *   The factorial program in code.text, with the loop counter (the
+ *   last word of the program) patched to make the run long enough to
+ *   measure, and a counting loop made of fusable pairs only
+ */
+static void bench_engines(void)
+{
+	byte_t code[64];
+	byte_t *text;
+	word_t size;
+	word_t n;
+	word_t loop;
+	char   name[64];
+
+
+	if (asm_assemble("code.text", &text, &size) == -1)
+	{
+		printf("Unable to assemble code.text\n");
+		return;
+	}
+
+	n = FACTORIAL_N;
+	memcpy(text + size - sizeof(n), &n, sizeof(n));
+
+	snprintf(name, sizeof(name), "code.text (n = %d)", FACTORIAL_N);
+	bench_program(name, text, size);
+	free(text);
+
+	/*
+	 *   loop: mov $1 g1; add g1 g0; cmp $N g0; jg $loop; halt
+	 */
+	size = 0;
+	loop = size;
+	size = emit(code, size, 0x05, MODE_IMMEDIATE_REGISTER, 1, 0x03, 10);
+	size = emit(code, size, 0x01, MODE_REGISTER_REGISTER, 0x03, 0x02, 10);
+	size = emit(code, size, 0x06, MODE_IMMEDIATE_REGISTER, BENCH_STEPS, 0x02, 10);
+	size = emit(code, size, 0x07, MODE_IMMEDIATE, loop, 0, 6);
+	size = emit(code, size, 0x04, 0, 0, 0, 1);
+
+	snprintf(name, sizeof(name), "counting loop (n = %d)", BENCH_STEPS);
+	bench_program(name, code, size);
+}
+
+/*
+ *   Process start of a short batch job: code.text assembled, loaded
+ *   and run once in a fresh VM, without the translation cache, with
+ *   an empty one (everything built and stored) and with a warm one
+ */
+static void bench_cache(void)
+{
+	static const char *names[] = { "no cache", "cold", "warm" };
+	static const int  runs[]   = { CACHE_RUNS, CACHE_BUILDS, CACHE_RUNS };
+	bench_vm_t vm;
+	cache_t    *cache;
+	byte_t     *text;
+	word_t     size;
+	char       dir[64];
+	double     t;
+	int        k;
+	int        i;
+	int        ret;
+
+
+	printf("Starts of code.text through the translation cache (us/start):\n");
+
+	snprintf(dir, sizeof(dir), "/tmp/vm_bench_cache_%d", (int)getpid());
+	cache = cache_open(dir);
+	if (cache == NULL)
+	{
+		printf("\tUnable to open %s\n", dir);
+		return;
+	}
+
+	for (k = 0; k < sizeof(names) / sizeof(names[0]); k++)
+	{
+		ret = 0;
+		t   = 0;
+		for (i = 0; i < runs[k] && ret == 0; i++)
+		{
+			if (k == 1)
+			{
+				cache_purge(cache);
+			}
+
+			t -= now();
+			if (k == 0)
+			{
+				ret = asm_assemble("code.text", &text, &size);
+			}
+			else
+			{
+				ret = cache_assemble(cache, "code.text", &text, &size);
+			}
+
+			if (ret == 0)
+			{
+				ret = vm_create(&vm);
+				if (ret == 0 && k == 0)
+				{
+					cpu_load_code(vm.cpu, 0, text, size);
+				}
+				else if (ret == 0 && cache_load(cache, vm.cpu, 0, text, size) == 0)
+				{
+					cpu_set_engine(vm.cpu, CPU_ENGINE_AOT);
+				}
+				else
+				{
+					ret = -1;
+				}
+
+				if (ret == 0)
+				{
+					cpu_run(vm.cpu);
+					vm_destroy(&vm);
+				}
+				free(text);
+			}
+			t += now();
+		}
+
+		if (ret == 0)
+		{
+			printf("\t%-10s: %10.2f\n", names[k], t / runs[k] * 1e6);
+		}
+		else
+		{
+			printf("\t%-10s: not available\n", names[k]);
+		}
+	}
+
+	cache_purge(cache);
+	cache_close(cache);
+	rmdir(dir);
+}
+
+/*
+ *   Counting loop run in slices of a command budget, the way a host
+ *   time-slices guests (the last slice covers the whole run)
+ */
+static void bench_budget(void)
+{
+	static const word_t slices[] = { 100, 10000, 1000000, 100000000 };
+	bench_vm_t vm;
+	byte_t     code[64];
+	word_t     size;
+	word_t     loop;
+	word_t     executed;
+	word_t     total;
+	word_t     calls;
+	int        s;
+	int        ret;
+	double     t;
+
+
+	printf("Budgeted runs of the counting loop, tiered engine (n = %d):\n", BENCH_STEPS);
+
+	if (vm_create(&vm) == -1)
+	{
+		printf("\tUnable to create VM\n");
+		return;
+	}
+
+	size = 0;
+	loop = size;
+	size = emit(code, size, 0x05, MODE_IMMEDIATE_REGISTER, 1, 0x03, 10);
+	size = emit(code, size, 0x01, MODE_REGISTER_REGISTER, 0x03, 0x02, 10);
+	size = emit(code, size, 0x06, MODE_IMMEDIATE_REGISTER, BENCH_STEPS, 0x02, 10);
+	size = emit(code, size, 0x07, MODE_IMMEDIATE, loop, 0, 6);
+	size = emit(code, size, 0x04, 0, 0, 0, 1);
+	cpu_load_code(vm.cpu, 0, code, size);
+
+	for (s = 0; s < sizeof(slices) / sizeof(slices[0]); s++)
+	{
+		cpu_poweron(vm.cpu);
+		total = 0;
+		calls = 0;
+
+		t = now();
+		do
+		{
+			ret = cpu_run_budget(vm.cpu, slices[s], &executed);
+			total += executed;
+			calls++;
+		} while (ret == 1);
+		t = now() - t;
+
+		printf("\t%-10u: %u commands, %8.2f M commands/s, %u runs\n", slices[s], total, total / t / 1e6, calls);
+	}
+
+	vm_destroy(&vm);
+}
+
+/*
+ *   Threaded engine on a loop of memory commands, with the code as
+ *   loaded (verified, load and store checks compiled out) and after
+ *   the host invalidated it (checked)
+ */
+static void bench_verified(void)
+{
+	static const char *names[] = { "verified", "checked" };
+	bench_vm_t  vm;
+	cpu_stats_t stats;
+	byte_t      code[64];
+	word_t      size;
+	word_t      loop;
+	long        steps;
+	int         v;
+	double      t;
+
+
+	printf("Threaded engine on memory commands (n = %d):\n", BENCH_STEPS);
+
+	if (vm_create(&vm) == -1 || cpu_set_engine(vm.cpu, CPU_ENGINE_THREADED) == -1)
+	{
+		printf("\tUnable to create VM\n");
+		return;
+	}
+
+	/*
+	 *   loop: add $1 800; mov 800 g1; add 800 g1; cmp $N g1; jg $loop; halt
+	 */
+	size = 0;
+	loop = size;
+	size = emit(code, size, 0x01, MODE_IMMEDIATE_MEMORY, 1, 800, 10);
+	size = emit(code, size, 0x05, MODE_MEMORY_REGISTER, 800, 0x03, 10);
+	size = emit(code, size, 0x01, MODE_MEMORY_REGISTER, 800, 0x03, 10);
+	size = emit(code, size, 0x06, MODE_IMMEDIATE_REGISTER, 2 * BENCH_STEPS, 0x03, 10);
+	size = emit(code, size, 0x07, MODE_IMMEDIATE, loop, 0, 6);
+	size = emit(code, size, 0x04, 0, 0, 0, 1);
+	steps = 5L * BENCH_STEPS + 1;
+
+	cpu_load_code(vm.cpu, 0, code, size);
+	cpu_get_stats(vm.cpu, &stats);
+	printf("\t%-10s: %u commands verified at load time\n", "verifier", stats.verified);
+
+	for (v = 0; v < 2; v++)
+	{
+		if (v == 1)
+		{
+			cpu_invalidate(vm.cpu, 0, size);
+		}
+
+		mem_store_word(vm.mem, 800, 0);
+		cpu_poweron(vm.cpu);
+
+		t = now();
+		cpu_run(vm.cpu);
+		t = now() - t;
+
+		printf("\t%-10s: %8.2f M commands/s\n", names[v], steps / t / 1e6);
+	}
+
+	vm_destroy(&vm);
+}
+
+/*
+ *   Guest word access throughput, aligned and unaligned, with the
+ *   old two-word algorithm and with the single-access path
+ */
+static void bench_memory(void)
+{
+	static const word_t offsets[] = { 0, 1, 2 };
+	static const char   *names[]  = { "aligned", "addr%4=1", "addr%4=2" };
+	mem_t       *mem;
+	mem_arena_t arena;
+	word_t      span;
+	word_t      addr;
+	word_t      w;
+	word_t      sum;
+	long        i;
+	int         o;
+	double      t_old_rd;
+	double      t_old_wr;
+	double      t_new_rd;
+	double      t_new_wr;
+	double      t_arena_rd;
+	double      t_arena_wr;
+
+
+	mem = mem_init(MEM_SIZE * WORD_SIZE);
+	if (mem == NULL)
+	{
+		printf("Unable to initialize memory\n");
+		return;
+	}
+
+	mem_get_arena(mem, &arena);
+
+	/*
+	 *   Stay two words away from the end: the old algorithm
+	 *   reads the word following an unaligned address
+	 */
+	span = MEM_SIZE * WORD_SIZE - 2 * WORD_SIZE;
+	sum  = 0;
+
+	printf("Guest word access (M accesses/s):\n");
+	printf("\t%-10s %10s %10s %10s %10s %10s %10s\n", "offset", "old read", "new read", "arena read",
+	       "old write", "new write", "arena write");
+
+	for (o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++)
+	{
+		t_old_rd = now();
+		for (i = 0, addr = offsets[o]; i < MEM_ACCESSES; i++)
+		{
+			legacy_read_word(mem, addr, &w);
+			sum += w;
+			addr = (addr + WORD_SIZE * 3) % span;
+		}
+		t_old_rd = now() - t_old_rd;
+
+		t_new_rd = now();
+		for (i = 0, addr = offsets[o]; i < MEM_ACCESSES; i++)
+		{
+			mem_load_word(mem, addr, &w);
+			sum += w;
+			addr = (addr + WORD_SIZE * 3) % span;
+		}
+		t_new_rd = now() - t_new_rd;
+
+		t_arena_rd = now();
+		for (i = 0, addr = offsets[o]; i < MEM_ACCESSES; i++)
+		{
+			mem_load_u32(&arena, addr, &w);
+			sum += w;
+			addr = (addr + WORD_SIZE * 3) % span;
+		}
+		t_arena_rd = now() - t_arena_rd;
+
+		t_old_wr = now();
+		for (i = 0, addr = offsets[o]; i < MEM_ACCESSES; i++)
+		{
+			legacy_write_word(mem, addr, i);
+			addr = (addr + WORD_SIZE * 3) % span;
+		}
+		t_old_wr = now() - t_old_wr;
+
+		t_new_wr = now();
+		for (i = 0, addr = offsets[o]; i < MEM_ACCESSES; i++)
+		{
+			mem_store_word(mem, addr, i);
+			addr = (addr + WORD_SIZE * 3) % span;
+		}
+		t_new_wr = now() - t_new_wr;
+
+		t_arena_wr = now();
+		for (i = 0, addr = offsets[o]; i < MEM_ACCESSES; i++)
+		{
+			mem_store_u32(&arena, addr, i);
+			addr = (addr + WORD_SIZE * 3) % span;
+		}
+		t_arena_wr = now() - t_arena_wr;
+
+		printf("\t%-10s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", names[o],
+		       MEM_ACCESSES / t_old_rd / 1e6, MEM_ACCESSES / t_new_rd / 1e6, MEM_ACCESSES / t_arena_rd / 1e6,
+		       MEM_ACCESSES / t_old_wr / 1e6, MEM_ACCESSES / t_new_wr / 1e6, MEM_ACCESSES / t_arena_wr / 1e6);
+	}
+
+	/*
+	 *   Keep the reads alive
+	 */
+	if (sum == 1)
+	{
+		printf("\n");
+	}
+
+	mem_free(mem);
+}
+
+/*
+ *   Time per run of a short program started cold every time (the
+ *   code caches are emptied before each run), where translation
+ *   and compilation costs are not paid back
+ */
+static void bench_one_shot(void)
+{
+	static const struct
+	{
+		const char   *name;
+		cpu_engine_t engine;
+	} engines[] =
+	{
+		{ "portable", CPU_ENGINE_PORTABLE },
+		{ "threaded", CPU_ENGINE_THREADED },
+		{ "jit",      CPU_ENGINE_JIT      },
+		{ "tiered",   CPU_ENGINE_TIERED   },
+	};
+	bench_vm_t vm;
+	byte_t     *text;
+	word_t     size;
+	double     t;
+	int        e;
+	int        i;
+
+
+	printf("One-shot runs of code.text (us/run, cold caches):\n");
+
+	if (asm_assemble("code.text", &text, &size) == -1)
+	{
+		printf("\tUnable to assemble code.text\n");
+		return;
+	}
+
+	if (vm_create(&vm) == -1)
+	{
+		printf("\tUnable to create VM\n");
+		free(text);
+		return;
+	}
+
+	cpu_load_code(vm.cpu, 0, text, size);
+
+	for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+	{
+		if (cpu_set_engine(vm.cpu, engines[e].engine) == -1)
+		{
+			printf("\t%-10s: not available\n", engines[e].name);
+			continue;
+		}
+
+		t = now();
+		for (i = 0; i < ONE_SHOT_RUNS; i++)
+		{
+			cpu_set_fusion(vm.cpu, 1);
+			cpu_poweron(vm.cpu);
+			cpu_run(vm.cpu);
+		}
+		t = now() - t;
+
+		printf("\t%-10s: %8.2f\n", engines[e].name, t / ONE_SHOT_RUNS * 1e6);
+	}
+
+	vm_destroy(&vm);
+	free(text);
+}
+
+/*
+ *   Starts of code.text in memories of growing size: the memory and
+ *   the CPU's tables are paged in on first touch, so a start should
+ *   cost about the same whatever size the guest declares
+ */
+static void bench_sparse(void)
+{
+	static const word_t sizes[] =
+	{
+		MEM_SIZE * WORD_SIZE, 1U << 20, 1U << 26, 1U << 30,
+	};
+	bench_vm_t vm;
+	byte_t     *text;
+	word_t     size;
+	double     t;
+	int        k;
+	int        i;
+	int        ret;
+
+
+	printf("Starts of code.text by memory size (us/start):\n");
+
+	if (asm_assemble("code.text", &text, &size) == -1)
+	{
+		printf("\tUnable to assemble code.text\n");
+		return;
+	}
+
+	for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+	{
+		ret = 0;
+		t   = now();
+		for (i = 0; i < SPARSE_RUNS && ret == 0; i++)
+		{
+			ret = vm_create_sized(&vm, sizes[k]);
+			if (ret == 0)
+			{
+				cpu_load_code(vm.cpu, 0, text, size);
+				cpu_run(vm.cpu);
+				vm_destroy(&vm);
+			}
+		}
+		t = now() - t;
+
+		if (ret == 0)
+		{
+			printf("\t%8u KiB: %10.2f\n", sizes[k] >> 10, t / SPARSE_RUNS * 1e6);
+		}
+		else
+		{
+			printf("\t%8u KiB: not available\n", sizes[k] >> 10);
+		}
+	}
+
+	free(text);
+}
+
+/*
+ *   Loading of a large image: byte by byte the way cpu_load_code()
+ *   used to, through the CPU in one block, and plain memcpy()
+ */
+static void bench_load(void)
+{
+	bench_vm_t vm;
+	byte_t     *image;
+	byte_t     *copy;
+	double     t_byte;
+	double     t_block;
+	double     t_memcpy;
+	word_t     i;
+
+
+	printf("Loading a %u MiB image (MB/s):\n", LOAD_SIZE >> 20);
+
+	image = (byte_t *)malloc(LOAD_SIZE);
+	copy  = (byte_t *)malloc(LOAD_SIZE);
+	if (image == NULL || copy == NULL || vm_create_sized(&vm, LOAD_SIZE) == -1)
+	{
+		printf("\tUnable to create VM\n");
+		free(image);
+		free(copy);
+		return;
+	}
+
+	/*
+	 *   Undefined opcodes: verification stops at the first byte
+	 */
+	memset(image, 0xff, LOAD_SIZE);
+	memset(copy, 0, LOAD_SIZE);
+
+	t_byte = now();
+	for (i = 0; i < LOAD_SIZE; i++)
+	{
+		mem_store_byte(vm.mem, i, image[i]);
+		cpu_invalidate(vm.cpu, i, 1);
+	}
+	t_byte = now() - t_byte;
+
+	t_block = now();
+	cpu_load_code(vm.cpu, 0, image, LOAD_SIZE);
+	t_block = now() - t_block;
+
+	t_memcpy = now();
+	memcpy(copy, image, LOAD_SIZE);
+	t_memcpy = now() - t_memcpy;
+
+	printf("\t%-10s: %10.1f\n", "per byte", LOAD_SIZE / t_byte / 1e6);
+	printf("\t%-10s: %10.1f\n", "block", LOAD_SIZE / t_block / 1e6);
+	printf("\t%-10s: %10.1f\n", "memcpy", LOAD_SIZE / t_memcpy / 1e6);
+
+	vm_destroy(&vm);
+	free(image);
+	free(copy);
+}
+
+/*
+ *   Loading of a large data image from a file: read in and copied
+ *   to memory, and mapped over memory
+ */
+static void bench_map(void)
+{
+	bench_vm_t vm;
+	bench_vm_t fresh;
+	FILE       *file;
+	byte_t     *buf;
+	char       path[64];
+	word_t     size;
+	word_t     w;
+	double     t_read;
+	double     t_map;
+	word_t     i;
+	int        ret;
+
+
+	printf("Loading a %u MiB data image from a file (ms):\n", MAP_SIZE >> 20);
+
+	snprintf(path, sizeof(path), "/tmp/vm_bench_map_%d", (int)getpid());
+	buf  = (byte_t *)malloc(MAP_SIZE);
+	file = fopen(path, "wb");
+	if (buf == NULL || file == NULL)
+	{
+		printf("\tUnable to create %s\n", path);
+		free(buf);
+		if (file != NULL)
+		{
+			fclose(file);
+		}
+		return;
+	}
+
+	for (i = 0; i < MAP_SIZE; i++)
+	{
+		buf[i] = (byte_t)i;
+	}
+
+	ret = (fwrite(buf, 1, MAP_SIZE, file) == MAP_SIZE) ? 0 : -1;
+	ret = (fclose(file) == 0) ? ret : -1;
+	if (ret == 0)
+	{
+		ret  = vm_create_sized(&vm, MAP_SIZE);
+		ret += vm_create_sized(&fresh, MAP_SIZE);
+	}
+
+	if (ret == -1)
+	{
+		printf("\tUnable to set up\n");
+		unlink(path);
+		free(buf);
+		return;
+	}
+
+	t_read = now();
+	file = fopen(path, "rb");
+	ret  = (file != NULL && fread(buf, 1, MAP_SIZE, file) == MAP_SIZE) ? 0 : -1;
+	if (file != NULL)
+	{
+		fclose(file);
+	}
+	ret += mem_write_block(vm.mem, 0, buf, MAP_SIZE);
+	t_read = now() - t_read;
+
+	t_map = now();
+	ret += mem_map_file(fresh.mem, 0, path, &size);
+	ret += mem_load_word(fresh.mem, MAP_SIZE / 2, &w);
+	t_map = now() - t_map;
+
+	if (ret == 0)
+	{
+		printf("\t%-10s: %10.3f\n", "read", t_read * 1e3);
+		printf("\t%-10s: %10.3f\n", "map", t_map * 1e3);
+	}
+	else
+	{
+		printf("\tnot available\n");
+	}
+
+	vm_destroy(&vm);
+	vm_destroy(&fresh);
+	unlink(path);
+	free(buf);
+}
+
+/*
+ *   A loop storing to a data page between two pages of code, with
+ *   the code pages left open and closed to stores (R and X only).
+ *   Neither case drops the cached code; with the pages closed, the
+ *   stores to the data page between them look it up in the watch
+ *   table of the CPU first.
+ */
+static void bench_protect(void)
+{
+	static const char *names[] = { "open", "rx" };
+	bench_vm_t  vm;
+	cpu_stats_t stats;
+	mem_stats_t mem_stats;
+	byte_t      code[64];
+	word_t      page;
+	word_t      size;
+	word_t      loop;
+	long        steps;
+	int         v;
+	int         ret;
+	double      t;
+
+
+	printf("Stores between pages of code (n = %d):\n", BENCH_STEPS);
+
+	for (v = 0; v < 2; v++)
+	{
+		if (vm_create_sized(&vm, 3 * 4096) == -1 || mem_get_stats(vm.mem, &mem_stats) == -1 ||
+		    mem_stats.page_size != 4096)
+		{
+			printf("\tUnable to create VM\n");
+			return;
+		}
+
+		/*
+		 *   0: jump $2p
+		 *   2p: add $1 p; mov p g1; cmp $N g1; jg $2p; halt
+		 */
+		page = mem_stats.page_size;
+		size = emit(code, 0, 0x03, MODE_IMMEDIATE, 2 * page, 0, 6);
+		ret  = cpu_load_code(vm.cpu, 0, code, size);
+
+		size = 0;
+		loop = 2 * page;
+		size = emit(code, size, 0x01, MODE_IMMEDIATE_MEMORY, 1, page, 10);
+		size = emit(code, size, 0x05, MODE_MEMORY_REGISTER, page, 0x03, 10);
+		size = emit(code, size, 0x06, MODE_IMMEDIATE_REGISTER, BENCH_STEPS, 0x03, 10);
+		size = emit(code, size, 0x07, MODE_IMMEDIATE, loop, 0, 6);
+		size = emit(code, size, 0x04, 0, 0, 0, 1);
+		ret += cpu_load_code(vm.cpu, loop, code, size);
+		steps = 4L * BENCH_STEPS + 2;
+
+		if (v == 1)
+		{
+			ret += cpu_protect(vm.cpu, 0, page, MEM_ATTR_R | MEM_ATTR_X);
+			ret += cpu_protect(vm.cpu, 2 * page, page, MEM_ATTR_R | MEM_ATTR_X);
+		}
+
+		t = now();
+		ret += cpu_run(vm.cpu);
+		t = now() - t;
+
+		cpu_get_stats(vm.cpu, &stats);
+		if (ret == 0)
+		{
+			printf("\t%-10s: %8.2f M commands/s, cache emptied %u times\n", names[v], steps / t / 1e6,
+			       stats.flushes);
+		}
+		else
+		{
+			printf("\t%-10s: not available\n", names[v]);
+		}
+
+		vm_destroy(&vm);
+	}
+}
+
+/*
+ *   Idle instances with the default memory, powered on with code.text
+ *   loaded: created the classic way (memory, IO and CPU apart, the
+ *   memory mapped), in one block each and packed in one arena. Bytes
+ *   are those the process grew by per instance.
+ */
+static void bench_instances(void)
+{
+	static const char *names[] = { "classic", "block", "arena" };
+	bench_vm_t *classic;
+	vm_t       **vms;
+	byte_t     *arena;
+	byte_t     *text;
+	word_t     text_size;
+	word_t     size;
+	size_t     footprint;
+	long       before;
+	long       grown;
+	double     t;
+	int        k;
+	int        i;
+	int        ret;
+
+
+	size      = MEM_SIZE * WORD_SIZE;
+	footprint = vm_footprint(size);
+	printf("Idle instances (n = %d, %u bytes of memory, %lu bytes per block):\n", IDLE_INSTANCES, size,
+	       (unsigned long)footprint);
+
+	if (asm_assemble("code.text", &text, &text_size) == -1)
+	{
+		printf("\tUnable to assemble code.text\n");
+		return;
+	}
+
+	classic = (bench_vm_t *)calloc(IDLE_INSTANCES, sizeof(*classic));
+	vms     = (vm_t **)calloc(IDLE_INSTANCES, sizeof(*vms));
+	if (classic == NULL || vms == NULL)
+	{
+		printf("\tUnable to allocate instances\n");
+		free(classic);
+		free(vms);
+		free(text);
+		return;
+	}
+
+	for (k = 0; k < 3; k++)
+	{
+		arena = NULL;
+		if (k == 2)
+		{
+			arena = (byte_t *)mmap(NULL, footprint * IDLE_INSTANCES, PROT_READ | PROT_WRITE,
+			                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (arena == MAP_FAILED)
+			{
+				printf("\t%-10s: not available\n", names[k]);
+				continue;
+			}
+		}
+
+		ret    = 0;
+		before = rss();
+		t      = now();
+		for (i = 0; i < IDLE_INSTANCES && ret == 0; i++)
+		{
+			if (k == 0)
+			{
+				ret = vm_create(&classic[i]);
+				ret = (ret == 0) ? cpu_load_code(classic[i].cpu, 0, text, text_size) : -1;
+				continue;
+			}
+
+			vms[i] = (k == 1) ? vm_init(size) : vm_init_at(arena + footprint * i, footprint, size);
+			if (vms[i] == NULL || cpu_poweron(vm_cpu(vms[i])) == -1)
+			{
+				ret = -1;
+				continue;
+			}
+
+			ret = cpu_load_code(vm_cpu(vms[i]), 0, text, text_size);
+		}
+		t     = now() - t;
+		grown = rss() - before;
+
+		if (ret == 0)
+		{
+			printf("\t%-10s: %10.0f bytes/instance, %8.2f us/create\n", names[k], (double)grown / IDLE_INSTANCES,
+			       t / IDLE_INSTANCES * 1e6);
+		}
+		else
+		{
+			printf("\t%-10s: not available after %d instances\n", names[k], i);
+		}
+
+		while (i-- > 0)
+		{
+			if (k == 0)
+			{
+				vm_destroy(&classic[i]);
+			}
+			else
+			{
+				vm_free(vms[i]);
+			}
+		}
+
+		if (arena != NULL)
+		{
+			munmap(arena, footprint * IDLE_INSTANCES);
+		}
+
+		/* Hand the freed side tables back so the next way pays for its own */
+		malloc_trim(0);
+	}
+
+	free(classic);
+	free(vms);
+	free(text);
+}
+
+/*
+ *   Random word accesses across a large memory on normal pages,
+ *   transparent huge pages and pages from the huge page pool, with
+ *   what the host actually gave each
+ */
+static void bench_pages(void)
+{
+	static const struct
+	{
+		const char *name;
+		int        flags;
+	} kinds[] =
+	{
+		{ "normal", MEM_NUMA_LOCAL                },
+		{ "thp",    MEM_NUMA_LOCAL | MEM_HUGE_THP },
+		{ "tlb",    MEM_NUMA_LOCAL | MEM_HUGE_TLB },
+	};
+	mem_t       *mem;
+	mem_arena_t arena;
+	mem_stats_t stats;
+	word_t      x;
+	word_t      w;
+	word_t      sum;
+	word_t      i;
+	double      t;
+	int         k;
+
+
+	printf("Random accesses to %u MiB of memory by page kind (ns/access):\n", PAGES_SIZE >> 20);
+
+	for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+	{
+		mem = mem_init_with(PAGES_SIZE, kinds[k].flags);
+		if (mem == NULL || mem_get_arena(mem, &arena) == -1)
+		{
+			printf("\t%-7s: not available\n", kinds[k].name);
+			mem_free(mem);
+			continue;
+		}
+
+		/*
+		 *   Touch every page first, so the walk measures the TLB and
+		 *   not the faults
+		 */
+		memset(arena.bytes, 1, PAGES_SIZE);
+
+		x   = 12345;
+		w   = 0;
+		sum = 0;
+		t   = now();
+		for (i = 0; i < PAGES_ACCESSES; i++)
+		{
+			x = x * 1103515245 + 12345;
+			mem_load_u32(&arena, (x >> 4) % (PAGES_SIZE / WORD_SIZE) * WORD_SIZE, &w);
+			sum += w;
+		}
+		t = now() - t;
+
+		mem_get_stats(mem, &stats);
+		printf("\t%-7s: %10.2f  (pages of %u KiB, aligned to %u KiB, %u MiB huge, node %d%s)\n",
+		       kinds[k].name, t / PAGES_ACCESSES * 1e9, stats.page_size >> 10, stats.huge_size >> 10,
+		       stats.huge_bytes >> 20, stats.node, (sum == 0) ? "?" : "");
+
+		mem_free(mem);
+	}
+}
+
+/*
+ *   Many instances of code.text, each with its own n, run in lockstep
+ *   and one after another on a single CPU. n is the same for every
+ *   instance (no divergence) or spread over 1 .. BATCH_N.
+ */
+static void bench_batch(void)
+{
+	static const struct
+	{
+		const char   *name;
+		cpu_engine_t engine;
+	} engines[] =
+	{
+		{ "threaded", CPU_ENGINE_THREADED },
+		{ "tiered",   CPU_ENGINE_TIERED   },
+	};
+	batch_patch_t  *patches;
+	batch_result_t *results;
+	bench_vm_t     vm;
+	byte_t         *text;
+	word_t         size;
+	word_t         done;
+	word_t         total;
+	double         t;
+	int            spread;
+	int            e;
+	int            i;
+
+
+	printf("Lockstep runs of %d code.text instances (M commands/s):\n", BATCH_INSTANCES);
+
+	if (asm_assemble("code.text", &text, &size) == -1)
+	{
+		printf("\tUnable to assemble code.text\n");
+		return;
+	}
+
+	patches = (batch_patch_t *)malloc(BATCH_INSTANCES * sizeof(*patches));
+	results = (batch_result_t *)malloc(BATCH_INSTANCES * sizeof(*results));
+	if (patches == NULL || results == NULL || vm_create(&vm) == -1)
+	{
+		printf("\tUnable to create VM\n");
+		free(patches);
+		free(results);
+		free(text);
+		return;
+	}
+
+	for (spread = 0; spread < 2; spread++)
+	{
+		for (i = 0; i < BATCH_INSTANCES; i++)
+		{
+			patches[i].addr  = size - sizeof(word_t);
+			patches[i].value = spread ? 1 + i % BATCH_N : BATCH_N;
+		}
+
+		printf("\t%s:\n", spread ? "n = 1 .. 256" : "n = 256");
+
+		t = now();
+		if (batch_run(text, size, patches, BATCH_INSTANCES, (word_t)-1, results) == -1)
+		{
+			printf("\t\t%-10s: not available\n", "lockstep");
+			continue;
+		}
+		t = now() - t;
+
+		total = 0;
+		for (i = 0; i < BATCH_INSTANCES; i++)
+		{
+			total += results[i].executed;
+		}
+
+		printf("\t\t%-10s: %8.2f\n", "lockstep", total / t / 1e6);
+
+		for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+		{
+			cpu_load_code(vm.cpu, 0, text, size);
+			if (cpu_set_engine(vm.cpu, engines[e].engine) == -1)
+			{
+				printf("\t\t%-10s: not available\n", engines[e].name);
+				continue;
+			}
+
+			total = 0;
+			t     = now();
+			for (i = 0; i < BATCH_INSTANCES; i++)
+			{
+				cpu_poweron(vm.cpu);
+				mem_store_word(vm.mem, patches[i].addr, patches[i].value);
+				cpu_run_budget(vm.cpu, (word_t)-1, &done);
+				total += done;
+			}
+			t = now() - t;
+
+			printf("\t\t%-10s: %8.2f\n", engines[e].name, total / t / 1e6);
+		}
+	}
+
+	vm_destroy(&vm);
+	free(patches);
+	free(results);
+	free(text);
+}
+
+/*
+ *   Program entry point
+ */
+int main(int argc, char **argv)
+{
+	bench_dispatch_per_opcode();
+	bench_dispatch_scaling();
+	bench_engines();
+	bench_one_shot();
+	bench_cache();
+	bench_batch();
+	bench_sparse();
+	bench_load();
+	bench_map();
+	bench_pages();
+	bench_protect();
+	bench_instances();
+	bench_budget();
+	bench_verified();
+	bench_memory();
+
+	return 0;
+}
@@ -0,0 +1,624 @@
+
+/*
+ *   Includes
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "types.h"
+#include "asm.h"
+#include "aot.h"
+#include "cpu.h"
+#include "cache.h"
+
+/*
+ *   Constants
+ */
+#define CACHE_PATH_MAX   4096 /* Longest path of a cache file        */
+#define CACHE_KEY_LENGTH 16   /* Hexadecimal digits of an entry name */
+
+/*
+ *   Kinds of entries, by file extension
+ *
+ *   img  - source text followed by its assembled image, keyed by the
+ *          source text
+ *   code - image the entries below were made from, keyed by the image
+ *   ver  - verifier results, keyed by the image
+ *   so   - ahead-of-time module, keyed by the image
+ *   c    - source of a module being built
+ *
+ *   Keys only name entries. An entry is used once what it was made
+ *   from compares equal, byte for byte, to what it is looked up for.
+ */
+static const char *cache_exts[] = { ".img", ".code", ".ver", ".so", ".c" };
+
+#define NR_CACHE_EXTS (sizeof(cache_exts) / sizeof(cache_exts[0]))
+
+/*
+ *   Types
+ */
+typedef unsigned long long cache_key_t;
+
+struct _cache_t
+{
+	char *dir; /* Directory holding the entries */
+};
+
+/*
+ *   Local utility functions
+ */
+
+/*
+ *   FNV-1a, continued from the given hash
+ */
+static cache_key_t cache_hash(cache_key_t h, const void *data, word_t size)
+{
+	const byte_t *p = (const byte_t *)data;
+	word_t       i;
+
+
+	for (i = 0; i < size; i++)
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+/*
+ *   Key of a run of bytes. The versions of everything the entries
+ *   depend on are part of it, so stale entries are never found;
+ *   so is the size of the memory the code is loaded to (0 for
+ *   images), which the verifier results depend on.
+ */
+static cache_key_t cache_key(const void *data, word_t size, word_t addr, word_t mem_size)
+{
+	word_t      salt[5];
+	cache_key_t h;
+
+
+	salt[0] = CACHE_VERSION;
+	salt[1] = AOT_ABI;
+	salt[2] = mem_size;
+	salt[3] = addr;
+	salt[4] = size;
+
+	h = 14695981039346656037ULL;
+	h = cache_hash(h, salt, sizeof(salt));
+	h = cache_hash(h, data, size);
+
+	return h;
+}
+
+/*
+ *   Whether the directory is the user's alone: owned by the user
+ *   running the VM, nobody else having any access to it. Entries in
+ *   it were made by that user.
+ */
+static int cache_private(const char *dir)
+{
+	struct stat st;
+
+
+	if (stat(dir, &st) == -1)
+	{
+		return 0;
+	}
+
+	return S_ISDIR(st.st_mode) && st.st_uid == geteuid() && (st.st_mode & (S_IRWXG | S_IRWXO)) == 0;
+}
+
+/*
+ *   Whether an entry is the user's alone: owned by the user running
+ *   the VM, nobody else allowed to write it
+ */
+static int cache_owned(const struct stat *st)
+{
+	return S_ISREG(st->st_mode) && st->st_uid == geteuid() && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+static int cache_path(const cache_t *cache, char *path, cache_key_t key, const char *tmp, const char *ext)
+{
+	int len;
+
+
+	len = snprintf(path, CACHE_PATH_MAX, "%s/%016llx%s%s", cache->dir, key, tmp, ext);
+
+	return (len < 0 || len >= CACHE_PATH_MAX) ? -1 : 0;
+}
+
+/*
+ *   Map a file read-only; an entry only if it is the user's alone.
+ *   Returns NULL if there is none.
+ */
+static void* cache_map(const char *path, int entry, word_t *size)
+{
+	struct stat st;
+	void        *p;
+	int         fd;
+
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0 || st.st_size > (off_t)(word_t)-1 || (entry && !cache_owned(&st)))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	*size = (word_t)st.st_size;
+
+	return p;
+}
+
+/*
+ *   Write an entry. It is written under a name of its own and renamed,
+ *   so processes sharing the cache never see it half written; unless
+ *   `replace` is set, an entry already there is kept and -1 returned.
+ */
+static int cache_store(const cache_t *cache, cache_key_t key, const char *ext, const void *data, word_t size,
+                       int replace)
+{
+	char path[CACHE_PATH_MAX];
+	char tmp[CACHE_PATH_MAX];
+	char pid[32];
+	FILE *file;
+	int  fd;
+	int  ok;
+
+
+	snprintf(pid, sizeof(pid), ".%d", (int)getpid());
+	if (cache_path(cache, path, key, "", ext) == -1 || cache_path(cache, tmp, key, pid, ext) == -1)
+	{
+		return -1;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	file = (fd != -1) ? fdopen(fd, "wb") : NULL;
+	if (file == NULL)
+	{
+		if (fd != -1)
+		{
+			close(fd);
+			unlink(tmp);
+		}
+
+		return -1;
+	}
+
+	ok = (fwrite(data, 1, size, file) == size);
+	ok = (fclose(file) == 0) && ok;
+	ok = ok && (replace ? rename(tmp, path) : link(tmp, path)) == 0;
+	if (!ok || !replace)
+	{
+		unlink(tmp);
+	}
+
+	return ok ? 0 : -1;
+}
+
+/*
+ *   Whether the entry holds exactly the bytes given
+ */
+static int cache_same(const char *path, const void *data, word_t size)
+{
+	void   *entry;
+	word_t entry_size;
+	int    same;
+
+
+	entry = cache_map(path, 1, &entry_size);
+	if (entry == NULL)
+	{
+		return 0;
+	}
+
+	same = (entry_size == size && memcmp(entry, data, size) == 0);
+	munmap(entry, entry_size);
+
+	return same;
+}
+
+/*
+ *   Claim the key for the code. The first code stored under a key
+ *   keeps it, so the entries of the key are only made from it and
+ *   used for it. Returns 0 when the key is the code's.
+ */
+static int cache_claim(const cache_t *cache, cache_key_t key, const byte_t *code, word_t size)
+{
+	char path[CACHE_PATH_MAX];
+
+
+	if (cache_path(cache, path, key, "", ".code") == -1)
+	{
+		return -1;
+	}
+
+	if (!cache_same(path, code, size))
+	{
+		cache_store(cache, key, ".code", code, size, 0);
+	}
+
+	return cache_same(path, code, size) ? 0 : -1;
+}
+
+/*
+ *   Attach the module of the entry, if it is the user's alone
+ */
+static int cache_attach(cpu_t *cpu, const char *path)
+{
+	struct stat st;
+
+
+	if (stat(path, &st) == -1 || !cache_owned(&st))
+	{
+		return -1;
+	}
+
+	return cpu_aot_attach(cpu, path);
+}
+
+/*
+ *   Store the verifier results of the code loaded at the address
+ */
+static int cache_store_verified(const cache_t *cache, cpu_t *cpu, cache_key_t key, word_t addr, word_t size)
+{
+	byte_t *verified;
+	int    ret;
+
+
+	verified = (byte_t *)malloc(size);
+	if (verified == NULL)
+	{
+		return -1;
+	}
+
+	ret = cpu_get_verified(cpu, addr, size, verified);
+	if (ret == 0)
+	{
+		ret = cache_store(cache, key, ".ver", verified, size, 1);
+	}
+
+	free(verified);
+
+	return ret;
+}
+
+/*
+ *   Build the ahead-of-time module of the code loaded at the address
+ *   and store it
+ */
+static int cache_build(const cache_t *cache, cpu_t *cpu, cache_key_t key, word_t addr, word_t size)
+{
+	char path[CACHE_PATH_MAX];
+	char src[CACHE_PATH_MAX];
+	char so[CACHE_PATH_MAX];
+	char pid[32];
+	int  ret;
+
+
+	snprintf(pid, sizeof(pid), ".%d", (int)getpid());
+	if (cache_path(cache, path, key, "", ".so") == -1 ||
+	    cache_path(cache, src, key, pid, ".c") == -1 ||
+	    cache_path(cache, so, key, pid, ".so") == -1)
+	{
+		return -1;
+	}
+
+	ret = cpu_aot_emit(cpu, addr, size, src);
+	if (ret == 0)
+	{
+		ret = aot_compile(src, so);
+	}
+
+	if (ret == 0 && (chmod(so, S_IRWXU) == -1 || rename(so, path) == -1))
+	{
+		ret = -1;
+	}
+
+	unlink(src);
+	unlink(so);
+
+	return ret;
+}
+
+/*
+ *   Implementation
+ */
+
+/*
+ *   Open the cache kept in the directory, creating the directory if
+ *   needed. Entries are named after the key of what they were made
+ *   from and may be shared by any number of processes of the user;
+ *   a directory anyone else has access to is refused.
+ */
+cache_t* cache_open(const char *dir)
+{
+	cache_t *cache;
+
+
+	if (dir == NULL)
+	{
+		return NULL;
+	}
+
+	if (mkdir(dir, S_IRWXU) == -1 && errno != EEXIST)
+	{
+		return NULL;
+	}
+
+	if (!cache_private(dir))
+	{
+		return NULL;
+	}
+
+	cache = (cache_t *)malloc(sizeof(*cache));
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+
+	cache->dir = (char *)malloc(strlen(dir) + 1);
+	if (cache->dir == NULL)
+	{
+		free(cache);
+		return NULL;
+	}
+
+	strcpy(cache->dir, dir);
+
+	return cache;
+}
+
+int cache_close(cache_t *cache)
+{
+	if (cache == NULL)
+	{
+		return -1;
+	}
+
+	free(cache->dir);
+	free(cache);
+
+	return 0;
+}
+
+/*
+ *   asm_assemble() through the cache: a source text assembled before
+ *   is not parsed again. The image is handed out the same way.
+ */
+int cache_assemble(cache_t *cache, const char *file_name, byte_t **code, word_t *size)
+{
+	char        path[CACHE_PATH_MAX];
+	cache_key_t key;
+	byte_t      *text;
+	byte_t      *entry;
+	word_t      text_size;
+	word_t      entry_size;
+	int         ret;
+
+
+	if (cache == NULL || file_name == NULL || code == NULL || size == NULL)
+	{
+		return -1;
+	}
+
+	text = (byte_t *)cache_map(file_name, 0, &text_size);
+	if (text == NULL || !cache_private(cache->dir))
+	{
+		if (text != NULL)
+		{
+			munmap(text, text_size);
+		}
+
+		return asm_assemble(file_name, code, size);
+	}
+
+	key = cache_key(text, text_size, 0, 0);
+
+	/*
+	 *   An image is taken only from an entry made from the same text
+	 */
+	entry = NULL;
+	if (cache_path(cache, path, key, "", ".img") == 0)
+	{
+		entry = (byte_t *)cache_map(path, 1, &entry_size);
+	}
+
+	if (entry != NULL && entry_size > text_size && memcmp(entry, text, text_size) == 0)
+	{
+		*code = (byte_t *)malloc(entry_size - text_size);
+		if (*code != NULL)
+		{
+			memcpy(*code, entry + text_size, entry_size - text_size);
+			*size = entry_size - text_size;
+		}
+
+		munmap(entry, entry_size);
+		munmap(text, text_size);
+
+		return (*code != NULL) ? 0 : -1;
+	}
+
+	if (entry != NULL)
+	{
+		munmap(entry, entry_size);
+	}
+
+	ret = asm_assemble(file_name, code, size);
+	if (ret == 0 && text_size <= (word_t)-1 - *size)
+	{
+		entry = (byte_t *)malloc(text_size + *size);
+		if (entry != NULL)
+		{
+			memcpy(entry, text, text_size);
+			memcpy(entry + text_size, *code, *size);
+			cache_store(cache, key, ".img", entry, text_size + *size, 1);
+			free(entry);
+		}
+	}
+
+	munmap(text, text_size);
+
+	return ret;
+}
+
+/*
+ *   cpu_load_code() through the cache, attaching the ahead-of-time
+ *   module of the code. Code loaded before gets its verifier results
+ *   and module from the cache; new code has them made and stored.
+ *   Returns 0 with the module attached, 1 when the code is loaded
+ *   without one (none could be built, or its key is another code's),
+ *   -1 on error or when the cache directory is no longer private.
+ */
+int cache_load(cache_t *cache, cpu_t *cpu, word_t addr, byte_t *code, word_t size)
+{
+	char        path[CACHE_PATH_MAX];
+	cache_key_t key;
+	byte_t      *verified;
+	word_t      verified_size;
+	word_t      mem_size;
+	int         ret;
+
+
+	if (cache == NULL || cpu == NULL || code == NULL || size == 0)
+	{
+		return -1;
+	}
+
+	if (cpu_get_mem_size(cpu, &mem_size) == -1 || !cache_private(cache->dir))
+	{
+		return -1;
+	}
+
+	key = cache_key(code, size, addr, mem_size);
+	if (cache_claim(cache, key, code, size) == -1)
+	{
+		return (cpu_load_code(cpu, addr, code, size) == 0) ? 1 : -1;
+	}
+
+	/*
+	 *   Verifier results
+	 */
+	verified = NULL;
+	if (cache_path(cache, path, key, "", ".ver") == 0)
+	{
+		verified = (byte_t *)cache_map(path, 1, &verified_size);
+	}
+
+	if (verified != NULL && verified_size != size)
+	{
+		munmap(verified, verified_size);
+		verified = NULL;
+	}
+
+	if (verified != NULL)
+	{
+		ret = cpu_load_verified(cpu, addr, code, size, verified);
+		munmap(verified, verified_size);
+	}
+	else
+	{
+		ret = cpu_load_code(cpu, addr, code, size);
+		if (ret == 0)
+		{
+			cache_store_verified(cache, cpu, key, addr, size);
+		}
+	}
+
+	if (ret == -1)
+	{
+		return -1;
+	}
+
+	/*
+	 *   Module. One that fails to attach (left by another build of
+	 *   the VM, say) is built again.
+	 */
+	if (cache_path(cache, path, key, "", ".so") == -1)
+	{
+		return 1;
+	}
+
+	if (cache_attach(cpu, path) == 0)
+	{
+		return 0;
+	}
+
+	if (cache_build(cache, cpu, key, addr, size) == -1 || cache_attach(cpu, path) == -1)
+	{
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ *   Drop every entry of the cache
+ */
+int cache_purge(cache_t *cache)
+{
+	char          path[CACHE_PATH_MAX];
+	DIR           *dir;
+	struct dirent *ent;
+	size_t        len;
+	size_t        ext;
+	word_t        i;
+
+
+	if (cache == NULL)
+	{
+		return -1;
+	}
+
+	dir = opendir(cache->dir);
+	if (dir == NULL)
+	{
+		return -1;
+	}
+
+	while ((ent = readdir(dir)) != NULL)
+	{
+		/*
+		 *   Entries only: a key, maybe a process id, an extension
+		 */
+		len = strlen(ent->d_name);
+		if (len < CACHE_KEY_LENGTH || strspn(ent->d_name, "0123456789abcdef") < CACHE_KEY_LENGTH)
+		{
+			continue;
+		}
+
+		for (i = 0; i < NR_CACHE_EXTS; i++)
+		{
+			ext = strlen(cache_exts[i]);
+			if (len > ext && strcmp(ent->d_name + len - ext, cache_exts[i]) == 0)
+			{
+				snprintf(path, sizeof(path), "%s/%s", cache->dir, ent->d_name);
+				unlink(path);
+				break;
+			}
+		}
+	}
+
+	closedir(dir);
+
+	return 0;
+}
@@ -0,0 +1,30 @@
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+/*
+ *   Includes
+ */
+#include "types.h"
+#include "cpu.h"
+
+/*
+ *   Constants
+ */
+#define CACHE_VERSION 2 /* Bumped whenever cached translations change meaning */
+
+/*
+ *   Types
+ */
+typedef struct _cache_t cache_t;
+
+/*
+ *   Prototypes
+ */
+cache_t* cache_open    (const char *dir);
+int      cache_close   (cache_t *cache);
+int      cache_assemble(cache_t *cache, const char *file_name, byte_t **code, word_t *size);
+int      cache_load    (cache_t *cache, cpu_t *cpu, word_t addr, byte_t *code, word_t size);
+int      cache_purge   (cache_t *cache);
+
+#endif /* __CACHE_H__ */
@@ -5,1264 +5,3098 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include "types.h"
 #include "mem.h"
 #include "io.h"
 #include "cpu.h"
+#include "isa.h"
+#include "jit.h"
+#include "aot.h"
+
+/*
+ *   Constants
+ */
+#ifdef __GNUC__
+#define CPU_HAVE_THREADED /* Labels as values are available */
+#endif
+
+#define CMD_MAX_LENGTH ISA_LENGTH_BINARY       /* Longest command          */
+#define CMD_MAX_FUSED  (2 * ISA_LENGTH_BINARY) /* Longest superinstruction */
+
+#define BLOCK_MAX_OPS  64   /* Commands in one translated block           */
+#define BLOCK_CACHE    1024 /* Translated blocks kept at most             */
+#define BLOCK_POOL     8192 /* Commands kept in all translated blocks     */
+#define BLOCK_HASH     1024 /* Buckets of the block lookup (power of two) */
+
+#define TRACE_HOT      64   /* Backward branches to a loop head before it is traced */
+
+#define TIER_THREADED  16   /* Runs of a block before it is threaded (default) */
+#define TIER_NATIVE    256  /* Runs of a block before it is compiled (default) */
+
+#define DECODE_SHIFT   8    /* Commands are predecoded by pages of 256 bytes of memory */
+#define DECODE_PAGE    (1U << DECODE_SHIFT)
+
+#define WATCH_SHIFT    12   /* Stores are watched in runs of 4 KiB of memory */
+#define WATCH_CODE     0x01 /* The run holds code cached on an open page     */
+#define WATCH_CLOSED   0x02 /* The run holds (part of) a page closed to stores */
+#define WATCH_UNREAD   0x04 /* The run holds (part of) a page closed to loads  */
+
+#if CPU_NR_REGS != NR_REGISTERS
+#error "cpu.h and isa.h disagree on the register file"
+#endif
 
 /*
  *   Types
  */
-typedef void (*executor_t)(cpu_t *cpu);
+typedef struct _cpu_insn_t  cpu_insn_t;
+typedef struct _cpu_page_t  cpu_page_t;
+typedef struct _cpu_block_t cpu_block_t;
+
+typedef int  (*executor_t)(cpu_t *cpu, const cpu_insn_t *insn);
+typedef int  (*engine_t)(cpu_t *cpu);
 struct _cmd_t
 {
 	byte_t     opcode;
-	executor_t exec;
+	byte_t     length;             /* Command length in bytes (opcode included) */
+	byte_t     handlers[NR_MODES]; /* Handler per addressing mode               */
 };
 
-typedef struct _cpu_flags_t
+/*
+ *   Predecoded command. Commands are decoded once into a side
+ *   table indexed by their address and executed from there until
+ *   a write to memory invalidates them.
+ */
+struct _cpu_insn_t
 {
-	byte_t halt;      /* Halt flag. If set, CPU must not fetch further commands from memory. */
-	byte_t error;     /* Error flag. Some error appeared while executing command.            */
-	byte_t equ;       /* Equivalence flag. Set depending on the last compare operation.      */
-	byte_t greater;   /* Greater flag. Set after compare.                                    */
-} cpu_flags_t;
+	executor_t exec;   /* Executor used by the run engines       */
+	word_t     op1;    /* First operand                          */
+	word_t     op2;    /* Second operand                         */
+	byte_t     handler;/* Handler of the (opcode, mode) pair     */
+	byte_t     fused;  /* Handler of the superinstruction starting here, or handler */
+	byte_t     opcode; /* Opcode                                 */
+	byte_t     mode;   /* Addressing mode                        */
+	byte_t     length; /* Command length in bytes                */
+	byte_t     valid;  /* Entry holds a decoded command          */
+	byte_t     span;   /* Commands run by the executor (in blocks) */
+};
+
+/*
+ *   Side table of a page of memory, allocated when the first command
+ *   on the page is decoded, so the table costs the pages of the code
+ *   and not the memory
+ */
+struct _cpu_page_t
+{
+	cpu_insn_t insns[DECODE_PAGE];    /* Predecoded commands, by address        */
+	byte_t     verified[DECODE_PAGE]; /* Commands verified at load time         */
+};
 
-typedef struct _cpu_register_t
+/*
+ *   Translated basic block: the commands from the entry address up
+ *   to the first branch or halt, copied in execution order. Blocks
+ *   are chained to the blocks they were seen to branch to, so the
+ *   lookup is skipped on hot paths.
+ */
+struct _cpu_block_t
 {
-	word_t data;
-	word_t code;
-} cpu_register_t;
+	word_t      entry;   /* Address of the first command            */
+	word_t      end;     /* Address following the last command      */
+	cpu_insn_t  *ops;    /* Commands, in the block command pool     */
+	word_t      nr_ops;  /* Number of commands                      */
+	cpu_block_t *succ[2];/* Chained successor blocks                */
+	cpu_block_t *next;   /* Next block in the lookup bucket         */
+	jit_code_t  native;  /* Native code, if compiled                */
+	jit_code_t  trace;   /* Native loop starting here, if traced    */
+	word_t      hits;    /* Backward branches seen to this block    */
+	word_t      runs;    /* Runs counted by the tiered engine       */
+	byte_t      tier;    /* Tier the block runs on (cpu_tier_t)     */
+	byte_t      jitted;  /* Compilation was attempted               */
+	byte_t      traced;  /* Tracing was attempted                   */
+	byte_t      verified;/* Every command passed the verifier       */
+};
 
-typedef struct _cpu_registers_t
+typedef struct _cpu_flags_t
 {
-	cpu_register_t ip; /* Instruction pointer */
-	cpu_register_t sp; /* Stack pointer */
-	cpu_register_t g[16]; /* General purpose registers g0 - g15 */
-} cpu_registers_t;
+	byte_t halt;      /* Halt flag. If set, CPU must not fetch further commands from memory. */
+	byte_t error;     /* Error flag. Some error appeared while executing command.            */
+	word_t cmp[2];    /* Operands of the last compare. EQU and GREATER are derived from them. */
+} cpu_flags_t;
 
 struct _cpu_t
 {
 	mem_t           *mem;      /* Memory resource available for the CPU        */
 	io_t            *io;       /* Input/Output facility for the CPU            */
 	cpu_flags_t     flags;     /* CPU state flags                              */
-	cpu_registers_t registers; /* Set of CPU registers                         */
-	cmd_t           *cmd_tbl;  /* Table of commands (pairs: opcode - executor) */
-	word_t          nr_cmds;   /* Number of entries in the table of commands   */
+	word_t          regs[NR_REGISTERS]; /* Registers indexed by register code */
+	engine_t        run;       /* Run engine selected at initialization        */
+	cpu_page_t      **pages;   /* Side tables by page of memory, NULL unused   */
+	word_t          nr_decoded;/* Number of addresses the side tables cover    */
+	word_t          code_lo;   /* Lowest address of a predecoded command       */
+	word_t          code_hi;   /* End of the highest predecoded command        */
+	cpu_insn_t      scratch;   /* Decoding area for commands out of the tables */
+	word_t          verified_lo;/* Lowest address of a verified command        */
+	word_t          verified_hi;/* End of the highest verified command         */
+	word_t          store_lo;  /* Lowest address stores have to look at        */
+	word_t          store_hi;  /* End of the range                             */
+	word_t          load_lo;   /* Lowest address loads have to look at         */
+	word_t          load_hi;   /* End of the range                             */
+	byte_t          *watch;    /* What accesses find there, by run (WATCH_*)   */
+	mem_arena_t     arena;     /* Guest memory, flat                           */
+	byte_t          fusion;    /* Superinstructions are formed at decode time  */
+	cpu_block_t     *blocks;   /* Translated blocks                            */
+	word_t          nr_blocks; /* Number of translated blocks in use           */
+	cpu_insn_t      *pool;     /* Commands of the translated blocks            */
+	word_t          nr_pool;   /* Number of pool entries in use                */
+	cpu_block_t     **bucket;  /* Translated blocks by entry address           */
+	word_t          block_lo;  /* Lowest address of a translated command       */
+	word_t          block_hi;  /* End of the highest translated command        */
+	byte_t          flushed;   /* Blocks were dropped since the last lookup    */
+	jit_t           *jit;      /* Native code generator, created on demand     */
+	cpu_stats_t     stats;     /* Decoder statistics                           */
+	byte_t          tiered;    /* Threaded engine runs for the tiered engine   */
+	byte_t          tier_start;/* Tier new blocks start on                     */
+	byte_t          tier_top;  /* Highest tier available                       */
+	word_t          thresholds[NR_CPU_TIERS]; /* Runs before promotion to the tier */
+	cpu_tier_stats_t tier_stats; /* Tiered engine statistics                  */
+	long            budget;    /* Commands left to run before returning        */
+	byte_t          stop;      /* Stop requested (written by any thread)       */
+	aot_t           *aot;      /* Ahead-of-time module attached                */
+	aot_env_t       aot_env;   /* Guest state handed to the module's code      */
+	word_t          aot_lo;    /* Lowest address of the module's code          */
+	word_t          aot_hi;    /* End of the module's code                     */
+	byte_t          aot_live;  /* The module's code was not written to         */
+	byte_t          embedded;  /* Lives in a block of the caller's (cpu_init_at) */
 };
 
-static int cpu_mem_read_word(cpu_t *cpu, word_t addr, word_t *word)
+/*
+ *   Directories of the side tables, indexed by guest address. They
+ *   are mapped the way memory is: pages are zero-filled on first
+ *   touch, so only the pages around the code are paid for.
+ */
+static void* cpu_table_alloc(word_t nr, size_t size)
 {
-	int        ret;
-	word_t     byte;
-	mem_word_t w1;
-	mem_word_t w2;
-	mem_word_t w3;
-	int        i;
-	int        j;
+	void *p;
 
 
-	if (cpu == NULL || word == 0)
-	{
-		return -1;
-	}
+	p = mmap(NULL, (size_t)nr * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 
-	/*
-	 *   If address is not word-aligned, we need more
-	 *   sophisticated reading algorithm
-	 */
-	if (addr % WORD_SIZE != 0)
-	{
-		byte = addr % WORD_SIZE;
-		addr = addr / WORD_SIZE;
-		addr = addr * WORD_SIZE;
+	return (p == MAP_FAILED) ? NULL : p;
+}
 
-		/*
-		 *   Read two words from memory
-		 */
-		ret  = mem_read(cpu->mem, addr, &w1.w);
-		ret += mem_read(cpu->mem, addr + WORD_SIZE, &w2.w);
-		if (ret < 0)
-		{
-			return -1;
-		}
+static void cpu_table_free(void *p, word_t nr, size_t size)
+{
+	if (p != NULL)
+	{
+		munmap(p, (size_t)nr * size);
+	}
+}
 
-		/*
-		 *   Fetch the requested word from the
-		 *   two words
-		 */
-		for (i = 0, j = byte; i < WORD_SIZE && j < WORD_SIZE; i++, j++)
-		{
-			w3.bytes[i] = w1.bytes[j];
-		}
+/*
+ *   Side table of the page of the address, allocated (nothing decoded
+ *   or verified) on first use. NULL when out of host memory.
+ */
+static cpu_page_t* cpu_page(cpu_t *cpu, word_t ip)
+{
+	cpu_page_t **page;
 
-		for (i = i, j = 0; i < WORD_SIZE && j < WORD_SIZE; i++, j++)
-		{
-			w3.bytes[i] = w2.bytes[j];
-		}
 
-		*word = w3.w;
-	}
-	else
+	page = &cpu->pages[ip >> DECODE_SHIFT];
+	if (*page == NULL)
 	{
-		ret = mem_read(cpu->mem, addr, word);
-		if (ret == -1)
-		{
-			return -1;
-		}
+		*page = (cpu_page_t *)calloc(1, sizeof(cpu_page_t));
 	}
 
-	return 0;
+	return *page;
 }
 
-static int cpu_mem_write_word(cpu_t *cpu, word_t addr, word_t word)
+/*
+ *   Predecoded entry of the address, NULL while its page has no table
+ */
+static inline cpu_insn_t* cpu_insn_at(const cpu_t *cpu, word_t ip)
 {
-	int        ret;
-	word_t     byte;
-	mem_word_t w1;
-	mem_word_t w2;
-	mem_word_t w3;
-	int        i;
-	int        j;
+	cpu_page_t *page = cpu->pages[ip >> DECODE_SHIFT];
 
 
-	if (cpu == NULL)
-	{
-		return -1;
-	}
+	return (page != NULL) ? &page->insns[ip & (DECODE_PAGE - 1)] : NULL;
+}
 
-	if (addr % WORD_SIZE != 0)
-	{
-		byte = addr % WORD_SIZE;
-		addr = addr / WORD_SIZE;
-		addr = addr * WORD_SIZE;
+/*
+ *   Verification mark of the address
+ */
+static inline int cpu_verified_at(const cpu_t *cpu, word_t ip)
+{
+	cpu_page_t *page = cpu->pages[ip >> DECODE_SHIFT];
 
-		ret  = mem_read(cpu->mem, addr, &w1.w);
-		ret += mem_read(cpu->mem, addr + WORD_SIZE, &w2.w);
-		if (ret < 0)
-		{
-			return -1;
-		}
 
-		w3.w = word;
+	return page != NULL && page->verified[ip & (DECODE_PAGE - 1)];
+}
 
-		for (i = byte, j = 0; i < WORD_SIZE && j < WORD_SIZE; i++, j++)
-		{
-			w1.bytes[i] = w3.bytes[j];
-		}
+/*
+ *   Clear the verification marks, or the predecoded entries, of
+ *   [lo, hi)
+ */
+static void cpu_verified_clear(cpu_t *cpu, word_t lo, word_t hi)
+{
+	cpu_page_t *page;
+	word_t     i;
 
-		for (i = 0, j = j; i < WORD_SIZE && j < WORD_SIZE; i++, j++)
-		{
-			w2.bytes[i] = w3.bytes[j];
-		}
 
-		ret  = mem_write(cpu->mem, addr, w1.w);
-		ret += mem_write(cpu->mem, addr + WORD_SIZE, w2.w);
-		if (ret < 0)
+	for (i = lo; i < hi; i++)
+	{
+		page = cpu->pages[i >> DECODE_SHIFT];
+		if (page != NULL)
 		{
-			return -1;
+			page->verified[i & (DECODE_PAGE - 1)] = 0;
 		}
 	}
-	else
+}
+
+static void cpu_decoded_clear(cpu_t *cpu, word_t lo, word_t hi)
+{
+	cpu_insn_t *insn;
+	word_t     i;
+
+
+	for (i = lo; i < hi; i++)
 	{
-		ret = mem_write(cpu->mem, addr, word);
-		if (ret == -1)
+		insn = cpu_insn_at(cpu, i);
+		if (insn != NULL)
 		{
-			return -1;
+			insn->valid = 0;
 		}
 	}
+}
 
-	return 0;
+/*
+ *   Drop every translated block. The cache is small and self-
+ *   modifying code is rare, so blocks are evicted all at once.
+ */
+static void cpu_block_flush(cpu_t *cpu)
+{
+	cpu->nr_blocks = 0;
+	cpu->nr_pool   = 0;
+	if (cpu->bucket != NULL)
+	{
+		memset(cpu->bucket, 0, BLOCK_HASH * sizeof(cpu->bucket[0]));
+	}
+
+	cpu->block_lo = cpu->nr_decoded;
+	cpu->block_hi = 0;
+	cpu->flushed  = 1;
+	cpu->stats.flushes++;
+
+	/*
+	 *   Native code goes with the blocks it was compiled from
+	 */
+	if (cpu->jit != NULL)
+	{
+		jit_reset(cpu->jit);
+	}
 }
 
-static int cpu_mem_read_byte(cpu_t *cpu, word_t addr, byte_t *byte)
+/*
+ *   Drop predecoded commands overlapping [addr, addr + size)
+ */
+static void cpu_code_invalidate(cpu_t *cpu, word_t addr, word_t size)
 {
-	int        ret;
-	mem_word_t word;
+	word_t first;
+	word_t last;
 
 
-	if (cpu == NULL || byte == NULL)
+	/*
+	 *   Rewritten code has to be verified again. Verification
+	 *   outlives the predecoded commands, so it is tracked apart.
+	 */
+	if (addr < cpu->verified_hi && addr + size > cpu->verified_lo)
 	{
-		return -1;
+		first = (addr > CMD_MAX_LENGTH - 1) ? addr - (CMD_MAX_LENGTH - 1) : 0;
+		first = (first > cpu->verified_lo) ? first : cpu->verified_lo;
+		last  = (addr + size < cpu->verified_hi) ? addr + size : cpu->verified_hi;
+		cpu_verified_clear(cpu, first, last);
 	}
 
-	ret = cpu_mem_read_word(cpu, addr, &word.w);
-	if (ret == -1)
+	/*
+	 *   Ahead-of-time code is dropped as a whole; the interpreter
+	 *   runs it from then on
+	 */
+	if (cpu->aot_live && addr < cpu->aot_hi && addr + size > cpu->aot_lo)
 	{
-		cpu->flags.error = 1;
-		return -1;
+		cpu->aot_live = 0;
+	}
+
+	/*
+	 *   Cheap test first: most writes hit data, not code
+	 */
+	if (addr >= cpu->code_hi || addr + size <= cpu->code_lo)
+	{
+		return;
 	}
 
-	*byte = word.bytes[0];
+	/*
+	 *   A superinstruction depends on every byte of both of its commands
+	 */
+	first = (addr > CMD_MAX_FUSED - 1) ? addr - (CMD_MAX_FUSED - 1) : 0;
+	first = (first > cpu->code_lo) ? first : cpu->code_lo;
+	last  = (addr + size < cpu->code_hi) ? addr + size : cpu->code_hi;
+	cpu_decoded_clear(cpu, first, last);
 
-	return 0;
+	if (addr < cpu->block_hi && addr + size > cpu->block_lo)
+	{
+		cpu_block_flush(cpu);
+	}
 }
 
-static int cpu_mem_write_byte(cpu_t *cpu, word_t addr, byte_t byte)
+/*
+ *   Stores have to look at the range holding cached code and pages
+ *   closed to them; the rest go straight to memory. Within the range
+ *   the watch table tells the runs of memory holding either from the
+ *   rest, so code on closed pages costs the stores around it nothing.
+ *   A store to a closed page fails here rather than on the page
+ *   protection, so the engines stop on it with their state up to
+ *   date.
+ */
+static int cpu_code_stored(cpu_t *cpu, word_t addr)
 {
-	mem_word_t word;
-	int        ret;
+	int watch;
+	int all;
+	int any;
 
 
-	if (cpu == NULL)
+	watch = cpu->watch[addr >> WATCH_SHIFT] | cpu->watch[(addr + WORD_SIZE - 1) >> WATCH_SHIFT];
+	if ((watch & WATCH_CLOSED) && mem_get_attrs(cpu->mem, addr, WORD_SIZE, &all, &any) == 0 &&
+	    !(all & MEM_ATTR_W))
 	{
 		return -1;
 	}
 
-	ret = cpu_mem_read_word(cpu, addr, &word.w);
-	if (ret == -1)
+	if (watch & WATCH_CODE)
 	{
-		cpu->flags.error = 1;
-		return -1;
+		cpu_code_invalidate(cpu, addr, WORD_SIZE);
 	}
 
-	word.bytes[0] = byte;
+	return 0;
+}
 
-	ret = cpu_mem_write_word(cpu, addr, word.w);
-	if (ret == -1)
+static inline int cpu_code_store(cpu_t *cpu, word_t addr)
+{
+	if (addr < cpu->store_hi && addr + WORD_SIZE > cpu->store_lo)
 	{
-		cpu->flags.error = 1;
-		return -1;
+		return cpu_code_stored(cpu, addr);
 	}
 
 	return 0;
 }
 
-static int cpu_reg_read(cpu_t *cpu, word_t code, word_t *data)
+/*
+ *   Stores the verifier allowed (see cpu_verify()) may not fail,
+ *   they only drop the code they overwrite
+ */
+static inline void cpu_code_overwrite(cpu_t *cpu, word_t addr)
 {
-	word_t r;
+	if (addr < cpu->store_hi && addr + WORD_SIZE > cpu->store_lo &&
+	    ((cpu->watch[addr >> WATCH_SHIFT] | cpu->watch[(addr + WORD_SIZE - 1) >> WATCH_SHIFT]) & WATCH_CODE))
+	{
+		cpu_code_invalidate(cpu, addr, WORD_SIZE);
+	}
+}
+
+/*
+ *   Loads look at the range holding pages closed to them the same
+ *   way, and fail before touching the host page: pages closed to
+ *   loads stay mapped readable when they keep X or W.
+ */
+static int cpu_data_loaded(cpu_t *cpu, word_t addr)
+{
+	int watch;
+	int all;
+	int any;
 
 
-	for (r = 0; r < 0x10; r++)
+	watch = cpu->watch[addr >> WATCH_SHIFT] | cpu->watch[(addr + WORD_SIZE - 1) >> WATCH_SHIFT];
+	if ((watch & WATCH_UNREAD) && mem_get_attrs(cpu->mem, addr, WORD_SIZE, &all, &any) == 0 &&
+	    !(all & MEM_ATTR_R))
 	{
-		if (cpu->registers.g[r].code == code)
-		{
-			*data = cpu->registers.g[r].data;
-		}
+		return -1;
 	}
 
 	return 0;
 }
 
-static int cpu_reg_write(cpu_t *cpu, word_t code, word_t data)
+static inline int cpu_data_load(cpu_t *cpu, word_t addr)
 {
-	word_t r;
-
-
-	for (r = 0; r < 0x10; r++)
+	if (addr < cpu->load_hi && addr + WORD_SIZE > cpu->load_lo)
 	{
-		if (cpu->registers.g[r].code == code)
-		{
-			cpu->registers.g[r].data = data;
-		}
+		return cpu_data_loaded(cpu, addr);
 	}
 
 	return 0;
 }
 
 /*
- *   Command executors
+ *   Make stores to [lo, hi) look for what the watch bit stands for,
+ *   or loads for WATCH_UNREAD
  */
-static void add(cpu_t *cpu)
+static void cpu_code_watch(cpu_t *cpu, word_t lo, word_t hi, byte_t watch)
 {
-	int    ret;
-	byte_t am;
-	word_t op1;
-	word_t op2;
-	word_t reg;
-	word_t aux;
+	word_t i;
 
 
-	if (cpu == NULL)
+	for (i = lo >> WATCH_SHIFT; i <= (hi - 1) >> WATCH_SHIFT; i++)
 	{
-		return;
+		cpu->watch[i] |= watch;
 	}
 
-	ret = cpu_mem_read_byte(cpu, cpu->registers.ip.data + 1, &am);
-	if (ret == -1)
+	if (watch & WATCH_UNREAD)
 	{
-		cpu->flags.error = 1;
+		cpu->load_lo = (lo < cpu->load_lo) ? lo : cpu->load_lo;
+		cpu->load_hi = (hi > cpu->load_hi) ? hi : cpu->load_hi;
 		return;
 	}
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1, &op1);
-	if (ret == -1)
+	if (lo < cpu->store_lo)
 	{
-		cpu->flags.error = 1;
-		return;
+		cpu->store_lo = lo;
 	}
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1 + 4, &op2);
-	if (ret == -1)
+	if (hi > cpu->store_hi)
 	{
-		cpu->flags.error = 1;
-		return;
+		cpu->store_hi = hi;
 	}
+}
 
-	switch (am)
-	{
-	case MODE_REGISTER_MEMORY:
-		ret = cpu_mem_read_word(cpu, op2, &aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		cpu_reg_read(cpu, op1, &reg);
+/*
+ *   Code cached for [lo, hi): stores have to look for it unless every
+ *   page of it is closed to them, in which case they fail anyway
+ */
+static void cpu_code_track(cpu_t *cpu, word_t lo, word_t hi)
+{
+	int all;
+	int any;
 
-		aux = reg + aux;
 
-		ret = cpu_mem_write_word(cpu, op2, aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		break;
+	if (mem_get_attrs(cpu->mem, lo, hi - lo, &all, &any) == 0 && !(any & MEM_ATTR_W))
+	{
+		return;
+	}
 
-	case MODE_REGISTER_REGISTER:
-		cpu_reg_read(cpu, op1, &reg);
-		cpu_reg_read(cpu, op2, &aux);
-		aux = reg + aux;
-		cpu_reg_write(cpu, op2, aux);
-		break;
+	cpu_code_watch(cpu, lo, hi, WATCH_CODE);
+}
 
-	case MODE_MEMORY_REGISTER:
-		ret = cpu_mem_read_word(cpu, op1, &aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		cpu_reg_read(cpu, op2, &reg);
-		reg = aux + reg;
-		cpu_reg_write(cpu, op2, reg);
-		break;
+/*
+ *   May commands be run from every page of [addr, addr + size)?
+ */
+static int cpu_code_fetchable(cpu_t *cpu, word_t addr, word_t size)
+{
+	int all;
+	int any;
 
-	case MODE_IMMEDIATE_MEMORY:
-		ret = cpu_mem_read_word(cpu, op2, &aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		aux = op1 + aux;
 
-		ret = cpu_mem_write_word(cpu, op2, aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		break;
+	return mem_get_attrs(cpu->mem, addr, size, &all, &any) == 0 && (all & MEM_ATTR_X);
+}
 
-	case MODE_IMMEDIATE_REGISTER:
-		cpu_reg_read(cpu, op2, &reg);
-		reg = op1 + reg;
-		cpu_reg_write(cpu, op2, reg);
-		break;
+/*
+ *   Guest loads and stores. Their addresses are memory operands,
+ *   checked against the memory when the command is decoded, so only
+ *   the watched ranges are looked at here.
+ */
+static inline int cpu_mem_read_word(cpu_t *cpu, word_t addr, word_t *word)
+{
+	if (cpu_data_load(cpu, addr) == -1)
+	{
+		return -1;
+	}
 
-	default:
-		cpu->flags.error = 1;
-		break;
-	} /* switch */
+	*word = mem_peek_u32(&cpu->arena, addr);
 
-	cpu->registers.ip.data += (1 + 1 + 4 + 4);
+	return 0;
 }
 
-static void sub(cpu_t *cpu)
+static inline int cpu_mem_write_word(cpu_t *cpu, word_t addr, word_t word)
 {
-	int    ret;
-	byte_t am;
-	word_t op1;
-	word_t op2;
-	word_t reg;
-	word_t aux;
-
-
-	if (cpu == NULL)
+	if (cpu_code_store(cpu, addr) == -1)
 	{
-		return;
+		return -1;
 	}
 
-	ret = cpu_mem_read_byte(cpu, cpu->registers.ip.data + 1, &am);
-	if (ret == -1)
-	{
-		cpu->flags.error = 1;
-		return;
-	}
+	mem_poke_u32(&cpu->arena, addr, word);
+
+	return 0;
+}
+
+static int cpu_mem_read_byte(cpu_t *cpu, word_t addr, byte_t *byte)
+{
+	int ret;
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1, &op1);
-	if (ret == -1)
-	{
-		cpu->flags.error = 1;
-		return;
-	}
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1 + 4, &op2);
+	ret = mem_load_u8(&cpu->arena, addr, byte);
 	if (ret == -1)
 	{
 		cpu->flags.error = 1;
-		return;
+		return -1;
 	}
 
-	switch (am)
-	{
-	case MODE_REGISTER_MEMORY:
-		ret = cpu_mem_read_word(cpu, op2, &aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		cpu_reg_read(cpu, op1, &reg);
-
-		aux = reg - aux;
+	return 0;
+}
 
-		ret = cpu_mem_write_word(cpu, op2, aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		break;
+/*
+ *   Command executors
+ */
+static int bad_mode(cpu_t *cpu, const cpu_insn_t *insn)
+{
+	/*
+	 *   Addressing mode not accepted by the command
+	 */
+	cpu->flags.error = 1;
+
+	cpu->regs[ISA_REG_IP] += insn->length;
+
+	return 0;
+}
+
+static int trap(cpu_t *cpu, const cpu_insn_t *insn)
+{
+	/*
+	 *   Undefined opcode
+	 */
+	cpu->flags.error = 1;
+
+	return -1;
+}
+
+static int halt(cpu_t *cpu, const cpu_insn_t *insn)
+{
+	cpu->flags.halt = 1;
+
+	return 0;
+}
+
+/*
+ *   One executor per (command, addressing mode) pair, generated
+ *   from the instruction set tables (add_imm_reg, je_imm, ...).
+ *   Executors return -1 when the command could not complete.
+ */
+#define ISA_IP                  cpu->regs[ISA_REG_IP]
+#define ISA_REG_GET(code, v)    (v) = cpu->regs[code]
+#define ISA_REG_SET(code, v)    cpu->regs[code] = (v)
+#define ISA_MEM_GET(addr, v)                                   \
+	if (cpu_mem_read_word(cpu, (addr), &(v)) == -1)        \
+	{                                                      \
+		cpu->flags.error = 1;                          \
+		return -1;                                     \
+	}
+#define ISA_MEM_SET(addr, v)                                   \
+	if (cpu_mem_write_word(cpu, (addr), (v)) == -1)        \
+	{                                                      \
+		cpu->flags.error = 1;                          \
+		return -1;                                     \
+	}
+#define ISA_COMPARE(a, b)                                      \
+	cpu->flags.cmp[0] = (a);                               \
+	cpu->flags.cmp[1] = (b)
+#define ISA_EQU                 ISA_FLAG_EQU(cpu->flags.cmp[0], cpu->flags.cmp[1])
+#define ISA_GREATER             ISA_FLAG_GREATER(cpu->flags.cmp[0], cpu->flags.cmp[1])
+#define ISA_ERROR()             cpu->flags.error = 1
+#define ISA_NEXT                (insn + 1)
+
+#define EXEC_BINARY_MODE(mode, am, name, class, expr, fault)                \
+	static int name##_##mode(cpu_t *cpu, const cpu_insn_t *insn)       \
+	{                                                                   \
+		ISA_BODY_##class(mode, expr, fault)                         \
+		return 0;                                                   \
+	}
+#define EXEC_BINARY(name, opcode, class, expr, fault)                       \
+	ISA_BINARY_MODES(EXEC_BINARY_MODE, name, class, expr, fault)
+
+#define EXEC_JUMP_MODE(mode, am, name, cond)                                \
+	static int name##_##mode(cpu_t *cpu, const cpu_insn_t *insn)       \
+	{                                                                   \
+		ISA_BODY_JUMP(mode, cond)                                   \
+		return 0;                                                   \
+	}
+#define EXEC_JUMP(name, opcode, cond)                                       \
+	ISA_JUMP_MODES(EXEC_JUMP_MODE, name, cond)
+
+#define EXEC_CMP_BRANCH(branch, cond, mode)                                 \
+	static int cmp_##mode##_##branch(cpu_t *cpu, const cpu_insn_t *insn) \
+	{                                                                   \
+		ISA_BODY_CMP_BRANCH(mode, cond)                             \
+		return 0;                                                   \
+	}
+#define EXEC_CMP_BRANCHES(mode, am, ...)                                    \
+	ISA_CMP_BRANCHES(EXEC_CMP_BRANCH, mode)
+
+#define EXEC_MOVI_MODE(mode, am, name, class, expr, fault)                  \
+	static int movi_##name##_##mode(cpu_t *cpu, const cpu_insn_t *insn) \
+	{                                                                   \
+		ISA_BODY_MOVI(mode, class, expr, fault)                     \
+		return 0;                                                   \
+	}
+#define EXEC_MOVI(name, opcode, class, expr, fault)                         \
+	ISA_BINARY_MODES(EXEC_MOVI_MODE, name, class, expr, fault)
+
+ISA_BINARY_OPS(EXEC_BINARY)
+ISA_JUMP_OPS(EXEC_JUMP)
+ISA_BINARY_MODES(EXEC_CMP_BRANCHES, cmp)
+ISA_BINARY_OPS(EXEC_MOVI)
+
+#undef ISA_IP
+#undef ISA_REG_GET
+#undef ISA_REG_SET
+#undef ISA_MEM_GET
+#undef ISA_MEM_SET
+#undef ISA_COMPARE
+#undef ISA_EQU
+#undef ISA_GREATER
+#undef ISA_ERROR
+#undef ISA_NEXT
+
+/*
+ *   Executors indexed by handler identifier
+ */
+#define EXEC_ENTRY(mode, am, name, ...) [ISA_H_##name##_##mode] = name##_##mode,
+#define EXEC_BINARY_ENTRIES(name, opcode, class, expr, fault) ISA_BINARY_MODES(EXEC_ENTRY, name)
+#define EXEC_JUMP_ENTRIES(name, opcode, cond) ISA_JUMP_MODES(EXEC_ENTRY, name)
+#define EXEC_CMP_BRANCH_ENTRY(branch, cond, mode) [ISA_H_cmp_##mode##_##branch] = cmp_##mode##_##branch,
+#define EXEC_CMP_BRANCH_ENTRIES(mode, am, ...) ISA_CMP_BRANCHES(EXEC_CMP_BRANCH_ENTRY, mode)
+#define EXEC_MOVI_ENTRY(mode, am, name, ...) [ISA_H_movi_##name##_##mode] = movi_##name##_##mode,
+#define EXEC_MOVI_ENTRIES(name, opcode, class, expr, fault) ISA_BINARY_MODES(EXEC_MOVI_ENTRY, name)
+
+static const executor_t executors[NR_HANDLERS] =
+{
+	[ISA_H_bad_mode] = bad_mode,
+	[ISA_H_trap]     = trap,
+	[ISA_H_halt]     = halt,
+	ISA_BINARY_OPS(EXEC_BINARY_ENTRIES)
+	ISA_JUMP_OPS(EXEC_JUMP_ENTRIES)
+	ISA_BINARY_MODES(EXEC_CMP_BRANCH_ENTRIES, cmp)
+	ISA_BINARY_OPS(EXEC_MOVI_ENTRIES)
+};
+
+/*
+ *   Command table indexed by opcode: opcode, length and the handler
+ *   of every addressing mode (modes left out map to bad_mode). It is
+ *   built by the compiler and shared by every CPU; opcodes no command
+ *   claims are left zero (length 0) and decode as cmd_trap.
+ */
+#define CMD_HANDLER(mode, am, name, ...) [am] = ISA_H_##name##_##mode,
+#define CMD_BINARY(name, opcode, class, expr, fault)                        \
+	[opcode] = { opcode, ISA_LENGTH_BINARY, { ISA_BINARY_MODES(CMD_HANDLER, name) } },
+#define CMD_JUMP(name, opcode, cond)                                        \
+	[opcode] = { opcode, ISA_LENGTH_JUMP, { ISA_JUMP_MODES(CMD_HANDLER, name) } },
+
+static const cmd_t commands[NR_OPCODES] =
+{
+	ISA_BINARY_OPS(CMD_BINARY)
+	ISA_JUMP_OPS(CMD_JUMP)
+	[ISA_HALT_OPCODE] = { ISA_HALT_OPCODE, ISA_LENGTH_HALT, { ISA_H_halt } },
+};
+
+/*
+ *   Undefined opcodes
+ */
+static const cmd_t cmd_trap = { 0x00, 1, { ISA_H_trap } };
+
+/*
+ *   Superinstructions: handlers of the first and the second
+ *   command and the handler running both
+ */
+typedef struct _cpu_fusion_t
+{
+	byte_t first;
+	byte_t second;
+	byte_t fused;
+} cpu_fusion_t;
+
+#define FUSE_CMP_BRANCH(branch, cond, mode)                                 \
+	{ ISA_H_cmp_##mode, ISA_H_##branch##_imm, ISA_H_cmp_##mode##_##branch },
+#define FUSE_CMP_BRANCHES(mode, am, ...)                                    \
+	ISA_CMP_BRANCHES(FUSE_CMP_BRANCH, mode)
+#define FUSE_MOVI_MODE(mode, am, name, ...)                                 \
+	{ ISA_H_mov_imm_reg, ISA_H_##name##_##mode, ISA_H_movi_##name##_##mode },
+#define FUSE_MOVI(name, opcode, class, expr, fault)                         \
+	ISA_BINARY_MODES(FUSE_MOVI_MODE, name)
+
+static const cpu_fusion_t fusions[] =
+{
+	ISA_BINARY_MODES(FUSE_CMP_BRANCHES, cmp)
+	ISA_BINARY_OPS(FUSE_MOVI)
+};
+
+#define NR_FUSIONS (sizeof(fusions) / sizeof(fusions[0]))
+
+/*
+ *   Decode the command at the address into its predecoded entry
+ *   (or the scratch entry when out of the tables, or when the host
+ *   has no memory left for a table)
+ */
+static cpu_insn_t* cpu_decode_one(cpu_t *cpu, word_t ip)
+{
+	cpu_page_t  *page;
+	cpu_insn_t  *insn;
+	const cmd_t *cmd;
+	byte_t      opcode;
+	int         ret;
+
+
+	page = (ip < cpu->nr_decoded) ? cpu_page(cpu, ip) : NULL;
+	insn = (page != NULL) ? &page->insns[ip & (DECODE_PAGE - 1)] : &cpu->scratch;
+
+	/*
+	 *   Commands run from X pages only; checked here once, as
+	 *   decoded commands go when their pages lose X
+	 */
+	if (!cpu_code_fetchable(cpu, ip, 1))
+	{
+		cpu->flags.error = 1;
+		return NULL;
+	}
+
+	ret = cpu_mem_read_byte(cpu, ip, &opcode);
+	if (ret == -1)
+	{
+		return NULL;
+	}
+
+	cmd = &commands[opcode];
+	if (cmd->length == 0)
+	{
+		cmd = &cmd_trap;
+	}
+
+	if (!cpu_code_fetchable(cpu, ip, cmd->length))
+	{
+		cpu->flags.error = 1;
+		return NULL;
+	}
+
+	insn->opcode = opcode;
+	insn->length = cmd->length;
+	insn->mode   = 0;
+	insn->op1    = 0;
+	insn->op2    = 0;
+
+	/*
+	 *   Operands are fetched under X like the opcode, not under R
+	 */
+	ret = 0;
+	if (cmd->length > ISA_LENGTH_HALT)
+	{
+		ret += cpu_mem_read_byte(cpu, ip + 1, &insn->mode);
+		ret += mem_load_u32(&cpu->arena, ip + 1 + 1, &insn->op1);
+	}
+
+	if (cmd->length > ISA_LENGTH_JUMP)
+	{
+		ret += mem_load_u32(&cpu->arena, ip + 1 + 1 + 4, &insn->op2);
+	}
+
+	if (ret < 0)
+	{
+		cpu->flags.error = 1;
+		return NULL;
+	}
+
+	/*
+	 *   Pick the executor specialized for the addressing mode.
+	 *   Register operands are validated here once, so executors
+	 *   index the register file without checks.
+	 */
+	insn->handler = (insn->mode < NR_MODES) ? cmd->handlers[insn->mode] : ISA_H_bad_mode;
+
+	/*
+	 *   So are memory operands, which are absolute addresses: a
+	 *   command with one past the end of the memory faults like an
+	 *   undefined opcode, before it changes anything, and executors
+	 *   access memory without checks
+	 */
+	if (insn->handler != ISA_H_bad_mode &&
+	    ((cmd->length > ISA_LENGTH_HALT && ISA_OP1_IS_MEM(insn->mode) &&
+	      insn->op1 > cpu->arena.size - WORD_SIZE) ||
+	     (cmd->length > ISA_LENGTH_JUMP && ISA_OP2_IS_MEM(insn->mode) &&
+	      insn->op2 > cpu->arena.size - WORD_SIZE)))
+	{
+		insn->handler = ISA_H_trap;
+	}
+
+	if (cmd->length > ISA_LENGTH_HALT && ISA_OP1_IS_REG(insn->mode) &&
+	    insn->op1 >= NR_REGISTERS)
+	{
+		insn->handler = ISA_H_bad_mode;
+	}
+
+	if (cmd->length > ISA_LENGTH_JUMP && ISA_OP2_IS_REG(insn->mode) &&
+	    (insn->op2 >= NR_REGISTERS || insn->op2 == ISA_REG_IP))
+	{
+		insn->handler = ISA_H_bad_mode;
+	}
+
+	insn->fused = insn->handler;
+	insn->exec  = executors[insn->handler];
+
+	if (insn != &cpu->scratch)
+	{
+		insn->valid = 1;
+		cpu->stats.decoded++;
+
+		if (ip < cpu->code_lo)
+		{
+			cpu->code_lo = ip;
+		}
+
+		if (ip + insn->length > cpu->code_hi)
+		{
+			cpu->code_hi = ip + insn->length;
+		}
+
+		cpu_code_track(cpu, ip, ip + insn->length);
+	}
+
+	return insn;
+}
+
+/*
+ *   Can the handler start a superinstruction?
+ */
+static int cpu_fusable(byte_t handler)
+{
+	word_t i;
+
+
+	for (i = 0; i < NR_FUSIONS; i++)
+	{
+		if (fusions[i].first == handler)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *   Turn the command into a superinstruction if it pairs
+ *   with the one following it
+ */
+static void cpu_fuse(cpu_t *cpu, cpu_insn_t *insn, const cpu_insn_t *next)
+{
+	word_t i;
+
+
+	/*
+	 *   The threaded engine refreshes IP in the register file on
+	 *   dispatch only, so the second command of a pair would see
+	 *   the IP of the first: commands naming IP are left alone
+	 */
+	if ((ISA_OP1_IS_REG(next->mode) && next->op1 == ISA_REG_IP) ||
+	    (ISA_OP2_IS_REG(next->mode) && next->op2 == ISA_REG_IP))
+	{
+		return;
+	}
+
+	for (i = 0; i < NR_FUSIONS; i++)
+	{
+		if (fusions[i].first == insn->handler && fusions[i].second == next->handler)
+		{
+			insn->fused = fusions[i].fused;
+			insn->exec  = executors[insn->fused];
+			cpu->stats.fused++;
+			return;
+		}
+	}
+}
+
+/*
+ *   Fetch the predecoded command at the address, decoding it
+ *   first if needed.
+ *
+ *   A freshly decoded command that may start a superinstruction
+ *   gets the next command decoded as well. The next command keeps
+ *   its own entry, so blocks entered through it run it alone.
+ */
+static const cpu_insn_t* cpu_decode(cpu_t *cpu, word_t ip)
+{
+	cpu_insn_t *first;
+	cpu_insn_t *insn;
+	cpu_insn_t *next;
+	word_t     addr;
+	int        fresh;
+
+
+	first = (ip < cpu->nr_decoded) ? cpu_insn_at(cpu, ip) : NULL;
+	if (first != NULL && first->valid)
+	{
+		return first;
+	}
+
+	first = cpu_decode_one(cpu, ip);
+	if (first == NULL || first == &cpu->scratch || !cpu->fusion)
+	{
+		return first;
+	}
+
+	/*
+	 *   Runs of fusable commands (mov, cmp, mov, ...) are decoded
+	 *   ahead in one go. Lookahead stays clear of the end of memory
+	 *   so it never raises guest errors.
+	 */
+	insn = first;
+	for (;;)
+	{
+		addr = ip + insn->length;
+		if (!cpu_fusable(insn->handler) || addr + CMD_MAX_LENGTH > cpu->nr_decoded)
+		{
+			break;
+		}
+
+		next = (cpu_page(cpu, addr) != NULL) ? cpu_insn_at(cpu, addr) : NULL;
+		if (next == NULL)
+		{
+			break;
+		}
+
+		fresh = !next->valid;
+		if (fresh && cpu_decode_one(cpu, addr) == NULL)
+		{
+			break;
+		}
+
+		cpu_fuse(cpu, insn, next);
+
+		if (!fresh)
+		{
+			break;
+		}
+
+		insn = next;
+		ip   = addr;
+	}
+
+	return first;
+}
+
+/*
+ *   Drop every predecoded command and translated block
+ */
+static void cpu_code_flush(cpu_t *cpu)
+{
+	cpu_decoded_clear(cpu, cpu->code_lo, cpu->code_hi);
+
+	cpu->code_lo = cpu->nr_decoded;
+	cpu->code_hi = 0;
+
+	cpu_block_flush(cpu);
+}
+
+/*
+ *   Check a memory operand: the word lies in memory, on pages with
+ *   the attributes
+ */
+static int cpu_verify_operand(cpu_t *cpu, word_t addr, int attrs)
+{
+	int all;
+	int any;
+
+
+	if (addr > cpu->nr_decoded - WORD_SIZE)
+	{
+		return 0;
+	}
+
+	if (mem_get_attrs(cpu->mem, addr, WORD_SIZE, &all, &any) == -1 || (all & attrs) != attrs)
+	{
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ *   Check a command of the code loaded to [lo, hi): it is defined,
+ *   its mode and registers are accepted, it lies in the code, its
+ *   memory operands lie in memory it may access (a source on
+ *   readable pages, a destination on readable and writable ones)
+ *   and an immediate branch target lies in the code
+ */
+static int cpu_verify_one(cpu_t *cpu, const cpu_insn_t *insn, word_t ip, word_t lo, word_t hi)
+{
+	if (insn->handler == ISA_H_trap || insn->handler == ISA_H_bad_mode)
+	{
+		return 0;
+	}
+
+	if (ip + insn->length > hi)
+	{
+		return 0;
+	}
+
+	if (insn->length > ISA_LENGTH_HALT && ISA_OP1_IS_MEM(insn->mode) &&
+	    !cpu_verify_operand(cpu, insn->op1, MEM_ATTR_R))
+	{
+		return 0;
+	}
+
+	if (insn->length > ISA_LENGTH_JUMP && ISA_OP2_IS_MEM(insn->mode) &&
+	    !cpu_verify_operand(cpu, insn->op2, MEM_ATTR_R | MEM_ATTR_W))
+	{
+		return 0;
+	}
+
+	if (insn->length == ISA_LENGTH_JUMP && insn->mode == MODE_IMMEDIATE &&
+	    (insn->op1 < lo || insn->op1 >= hi))
+	{
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ *   Successors of the command at the address: the next command
+ *   unless the path ends there, and the target of an immediate
+ *   branch (`none` where there is no such successor)
+ */
+static void cpu_code_next(const cpu_insn_t *insn, word_t ip, word_t none, word_t next[2])
+{
+	next[0] = none;
+	next[1] = none;
+	if (insn->handler != ISA_H_halt && insn->handler != ISA_H_trap &&
+	    insn->handler != ISA_H_jump_reg && insn->handler != ISA_H_jump_mem &&
+	    insn->handler != ISA_H_jump_imm)
+	{
+		next[0] = ip + insn->length;
+	}
+
+	if (insn->length == ISA_LENGTH_JUMP && insn->mode == MODE_IMMEDIATE)
+	{
+		next[1] = insn->op1;
+	}
+}
+
+/*
+ *   Check the command at the address, of the code loaded to
+ *   [lo, hi), and mark it. Returns it, NULL if it failed.
+ */
+static const cpu_insn_t* cpu_verify_mark(cpu_t *cpu, word_t ip, word_t lo, word_t hi)
+{
+	const cpu_insn_t *insn;
+	cpu_page_t       *page;
+
+
+	/*
+	 *   Decoding stays clear of the end of memory and of pages
+	 *   commands may not run from, so it never raises guest errors
+	 */
+	if (ip + CMD_MAX_LENGTH > cpu->nr_decoded || !cpu_code_fetchable(cpu, ip, CMD_MAX_LENGTH))
+	{
+		return NULL;
+	}
+
+	/*
+	 *   A command decoded to the scratch entry has no mark to hold
+	 */
+	insn = cpu_decode(cpu, ip);
+	page = cpu->pages[ip >> DECODE_SHIFT];
+	if (insn == NULL || page == NULL || !cpu_verify_one(cpu, insn, ip, lo, hi))
+	{
+		return NULL;
+	}
+
+	page->verified[ip & (DECODE_PAGE - 1)] = 1;
+	cpu->stats.verified++;
+
+	if (ip < cpu->verified_lo)
+	{
+		cpu->verified_lo = ip;
+	}
+
+	if (ip + insn->length > cpu->verified_hi)
+	{
+		cpu->verified_hi = ip + insn->length;
+	}
+
+	return insn;
+}
+
+/*
+ *   Drop every verification mark, and the blocks built while they
+ *   held
+ */
+static void cpu_verify_drop(cpu_t *cpu)
+{
+	if (cpu->verified_lo < cpu->verified_hi)
+	{
+		cpu_verified_clear(cpu, cpu->verified_lo, cpu->verified_hi);
+		cpu->verified_lo = cpu->nr_decoded;
+		cpu->verified_hi = 0;
+		cpu_block_flush(cpu);
+	}
+}
+
+/*
+ *   Verify the code loaded to [addr, addr + size). Commands are
+ *   followed from the load address along both ways of every branch
+ *   with a known target, and those passing the checks are marked;
+ *   a failing command stops its path. Blocks made of marked
+ *   commands only run on the threaded engine without the load and
+ *   store checks. Rewritten code loses its marks, and so does all
+ *   code when pages lose R or W (cpu_protect()).
+ */
+static void cpu_verify(cpu_t *cpu, word_t addr, word_t size)
+{
+	const cpu_insn_t *insn;
+	word_t           *work;
+	byte_t           *seen;
+	word_t           nr_work;
+	word_t           end;
+	word_t           ip;
+	word_t           next[2];
+	word_t           i;
+
+
+	if (addr >= cpu->nr_decoded || size == 0)
+	{
+		return;
+	}
+
+	end  = (size < cpu->nr_decoded - addr) ? addr + size : cpu->nr_decoded;
+	work = (word_t *)malloc((end - addr) * sizeof(word_t));
+	seen = (byte_t *)calloc(end - addr, sizeof(byte_t));
+	if (work == NULL || seen == NULL)
+	{
+		free(work);
+		free(seen);
+		return;
+	}
+
+	work[0] = addr;
+	seen[0] = 1;
+	nr_work = 1;
+	while (nr_work > 0)
+	{
+		ip   = work[--nr_work];
+		insn = cpu_verify_mark(cpu, ip, addr, end);
+		if (insn == NULL)
+		{
+			continue;
+		}
+
+		cpu_code_next(insn, ip, end, next);
+		for (i = 0; i < 2; i++)
+		{
+			if (next[i] < end && !seen[next[i] - addr])
+			{
+				seen[next[i] - addr] = 1;
+				work[nr_work++] = next[i];
+			}
+		}
+	}
+
+	free(work);
+	free(seen);
+}
+
+/*
+ *   Handlers ending a basic block: branches and everything
+ *   that stops the run
+ */
+#define BLOCK_END(mode, am, name, ...) [ISA_H_##name##_##mode] = 1,
+#define BLOCK_END_JUMP(name, opcode, cond) ISA_JUMP_MODES(BLOCK_END, name)
+
+static const byte_t block_ends[NR_HANDLERS] =
+{
+	[ISA_H_trap] = 1,
+	[ISA_H_halt] = 1,
+	ISA_JUMP_OPS(BLOCK_END_JUMP)
+};
+
+static word_t cpu_block_hash(word_t ip)
+{
+	return (ip ^ (ip >> 10)) & (BLOCK_HASH - 1);
+}
+
+/*
+ *   Block cache, allocated when the first block is translated so that
+ *   CPUs that never run cost nothing for it
+ */
+static int cpu_block_alloc(cpu_t *cpu)
+{
+	cpu->blocks = (cpu_block_t *)malloc(BLOCK_CACHE * sizeof(cpu_block_t));
+	cpu->pool   = (cpu_insn_t *)malloc(BLOCK_POOL * sizeof(cpu_insn_t));
+	cpu->bucket = (cpu_block_t **)calloc(BLOCK_HASH, sizeof(cpu_block_t *));
+	if (cpu->blocks == NULL || cpu->pool == NULL || cpu->bucket == NULL)
+	{
+		free(cpu->blocks);
+		free(cpu->pool);
+		free(cpu->bucket);
+		cpu->blocks = NULL;
+		cpu->pool   = NULL;
+		cpu->bucket = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *   Translate the basic block starting at the address
+ */
+static cpu_block_t* cpu_block_translate(cpu_t *cpu, word_t ip)
+{
+	const cpu_insn_t *insn;
+	cpu_block_t      *block;
+	cpu_insn_t       *op;
+	word_t           addr;
+	word_t           i;
+
+
+	if (cpu->blocks == NULL && cpu_block_alloc(cpu) == -1)
+	{
+		return NULL;
+	}
+
+	if (cpu->nr_blocks == BLOCK_CACHE || cpu->nr_pool + BLOCK_MAX_OPS > BLOCK_POOL)
+	{
+		cpu_block_flush(cpu);
+	}
+
+	block = &cpu->blocks[cpu->nr_blocks];
+	block->entry   = ip;
+	block->ops     = &cpu->pool[cpu->nr_pool];
+	block->nr_ops  = 0;
+	block->succ[0] = NULL;
+	block->succ[1] = NULL;
+	block->native  = NULL;
+	block->trace   = NULL;
+	block->hits    = 0;
+	block->runs    = 0;
+	block->tier    = cpu->tier_start;
+	block->jitted  = 0;
+	block->traced  = 0;
+	block->verified = 1;
+
+	/*
+	 *   Commands past the first one are decoded ahead of execution,
+	 *   so they stay clear of the end of memory and never raise
+	 *   guest errors
+	 */
+	addr = ip;
+	while (block->nr_ops < BLOCK_MAX_OPS)
+	{
+		if (block->nr_ops > 0 && addr + CMD_MAX_LENGTH > cpu->nr_decoded)
+		{
+			break;
+		}
+
+		insn = cpu_decode(cpu, addr);
+		if (insn == NULL)
+		{
+			break;
+		}
+
+		op  = &block->ops[block->nr_ops++];
+		*op = *insn;
+		op->span = (op->fused != op->handler) ? 2 : 1;
+
+		if (!cpu_verified_at(cpu, addr))
+		{
+			block->verified = 0;
+		}
+
+		addr += insn->length;
+		if (block_ends[insn->handler])
+		{
+			break;
+		}
+	}
+
+	if (block->nr_ops == 0)
+	{
+		return NULL;
+	}
+
+	/*
+	 *   A superinstruction needs its second command in the block
+	 */
+	for (i = 0; i < block->nr_ops; i++)
+	{
+		op = &block->ops[i];
+		if (op->span == 2 && i + 1 == block->nr_ops)
+		{
+			op->fused = op->handler;
+			op->exec  = executors[op->handler];
+			op->span  = 1;
+		}
+	}
+
+	block->end = addr;
+	block->next = cpu->bucket[cpu_block_hash(ip)];
+	cpu->bucket[cpu_block_hash(ip)] = block;
+
+	cpu->nr_blocks++;
+	cpu->nr_pool += block->nr_ops;
+
+	if (ip < cpu->block_lo)
+	{
+		cpu->block_lo = ip;
+	}
+
+	if (addr > cpu->block_hi)
+	{
+		cpu->block_hi = addr;
+	}
+
+	cpu->stats.blocks++;
+
+	return block;
+}
+
+/*
+ *   Find (or translate) the block at the address and chain the
+ *   block run before it to it
+ */
+static cpu_block_t* cpu_block_link(cpu_t *cpu, cpu_block_t *from, word_t ip)
+{
+	cpu_block_t *block;
+
+
+	/*
+	 *   Blocks dropped since the last lookup can not be chained
+	 */
+	if (cpu->flushed)
+	{
+		cpu->flushed = 0;
+		from = NULL;
+	}
+
+	block = (cpu->bucket != NULL) ? cpu->bucket[cpu_block_hash(ip)] : NULL;
+	for (; block != NULL; block = block->next)
+	{
+		if (block->entry == ip)
+		{
+			break;
+		}
+	}
+
+	if (block == NULL)
+	{
+		block = cpu_block_translate(cpu, ip);
+		if (block == NULL)
+		{
+			return NULL;
+		}
+
+		if (cpu->flushed)
+		{
+			cpu->flushed = 0;
+			return block;
+		}
+	}
+
+	if (from != NULL)
+	{
+		from->succ[(from->succ[0] == NULL) ? 0 : 1] = block;
+	}
+
+	return block;
+}
+
+/*
+ *   Block to run after the given one, with IP at the address
+ */
+static inline cpu_block_t* cpu_block_chain(cpu_t *cpu, cpu_block_t *from, word_t ip)
+{
+	if (from != NULL && !cpu->flushed)
+	{
+		if (from->succ[0] != NULL && from->succ[0]->entry == ip)
+		{
+			return from->succ[0];
+		}
+
+		if (from->succ[1] != NULL && from->succ[1]->entry == ip)
+		{
+			return from->succ[1];
+		}
+	}
+
+	return cpu_block_link(cpu, from, ip);
+}
+
+/*
+ *   Run engines. All of them run translated blocks; a command
+ *   storing to memory may drop the block being run, in which case
+ *   the rest of the block is left for a fresh lookup.
+ *
+ *   Engines take the commands they run off the budget and return 1
+ *   at the first block boundary where it is used up or a stop was
+ *   requested; the guest state is complete there, so the next run
+ *   goes on from it. A command that faults is not counted.
+ */
+static inline int cpu_yield(cpu_t *cpu)
+{
+	/*
+	 *   A stop request is taken by the check that sees it, so one
+	 *   made after the last check of a run stops the next run
+	 */
+	if (__atomic_load_n(&cpu->stop, __ATOMIC_RELAXED) && __atomic_exchange_n(&cpu->stop, 0, __ATOMIC_RELAXED))
+	{
+		return 1;
+	}
+
+	return cpu->budget <= 0;
+}
+
+/*
+ *   Commands of the block run before the one at the address, where
+ *   a command faulted (blocks are straight-line code, and the fault
+ *   may be in the second command of a superinstruction)
+ */
+static word_t cpu_block_done(const cpu_block_t *block, word_t ip)
+{
+	word_t addr;
+	word_t i;
+
+
+	addr = block->entry;
+	for (i = 0; i < block->nr_ops && addr < ip; i++)
+	{
+		addr += block->ops[i].length;
+	}
+
+	return i;
+}
+
+static int cpu_block_interpret(cpu_t *cpu, const cpu_block_t *block)
+{
+	const cpu_insn_t *insn;
+	const cpu_insn_t *last;
+
+
+	insn = block->ops;
+	last = block->ops + block->nr_ops;
+	do
+	{
+		/*
+		 *   Superinstructions run both of their commands
+		 */
+		if (insn->exec(cpu, insn) == -1)
+		{
+			cpu->budget -= cpu_block_done(block, cpu->regs[ISA_REG_IP]);
+			return -1;
+		}
+
+		insn += insn->span;
+	} while (insn < last && !cpu->flushed);
+
+	cpu->budget -= insn - block->ops;
+
+	return 0;
+}
+
+static int cpu_run_portable(cpu_t *cpu)
+{
+	cpu_block_t *block;
+
+
+	block = NULL;
+	while (!cpu->flags.halt)
+	{
+		if (cpu_yield(cpu))
+		{
+			return 1;
+		}
+
+		block = cpu_block_chain(cpu, block, cpu->regs[ISA_REG_IP]);
+		if (block == NULL)
+		{
+			cpu->flags.error = 1;
+			return -1;
+		}
+
+		if (cpu_block_interpret(cpu, block) == -1)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *   Memory access for native code
+ */
+static long cpu_jit_load(void *ctx, word_t addr)
+{
+	cpu_t  *cpu = (cpu_t *)ctx;
+	word_t word;
+
+
+	if (cpu_mem_read_word(cpu, addr, &word) == -1)
+	{
+		cpu->flags.error = 1;
+		return -1;
+	}
+
+	return word;
+}
+
+static int cpu_jit_store(void *ctx, word_t addr, word_t word)
+{
+	cpu_t *cpu = (cpu_t *)ctx;
+
+
+	if (cpu_mem_write_word(cpu, addr, word) == -1)
+	{
+		cpu->flags.error = 1;
+		return -1;
+	}
 
-	case MODE_REGISTER_REGISTER:
-		cpu_reg_read(cpu, op1, &reg);
-		cpu_reg_read(cpu, op2, &aux);
-		aux = reg - aux;
-		cpu_reg_write(cpu, op2, aux);
-		break;
+	/*
+	 *   The store dropped translated code, possibly the one
+	 *   running: native code returns to the engine
+	 */
+	return cpu->flushed ? 1 : 0;
+}
+
+/*
+ *   Load for ahead-of-time code, from pages the CPU watches
+ */
+static int cpu_aot_load(void *ctx, word_t addr, word_t *word)
+{
+	cpu_t *cpu = (cpu_t *)ctx;
+
+
+	return cpu_mem_read_word(cpu, addr, word);
+}
+
+/*
+ *   Store for ahead-of-time code
+ */
+static int cpu_aot_store(void *ctx, word_t addr, word_t word)
+{
+	cpu_t *cpu = (cpu_t *)ctx;
+
+
+	if (cpu_mem_write_word(cpu, addr, word) == -1)
+	{
+		cpu->flags.error = 1;
+		return -1;
+	}
+
+	/*
+	 *   The store dropped the module: its code returns to the engine
+	 */
+	return cpu->aot_live ? 0 : 1;
+}
+
+/*
+ *   Compile the block to native code. A full code buffer is
+ *   emptied together with the block cache.
+ */
+static void cpu_block_compile(cpu_t *cpu, cpu_block_t *block)
+{
+	jit_insn_t insns[BLOCK_MAX_OPS];
+	word_t     addr;
+	word_t     i;
+
+
+	block->jitted = 1;
 
-	case MODE_MEMORY_REGISTER:
-		ret = cpu_mem_read_word(cpu, op1, &aux);
-		if (ret == -1)
+	addr = block->entry;
+	for (i = 0; i < block->nr_ops; i++)
+	{
+		insns[i].addr    = addr;
+		insns[i].op1     = block->ops[i].op1;
+		insns[i].op2     = block->ops[i].op2;
+		insns[i].handler = block->ops[i].handler;
+		insns[i].mode    = block->ops[i].mode;
+		insns[i].length  = block->ops[i].length;
+		addr += block->ops[i].length;
+	}
+
+	if (jit_compile(cpu->jit, insns, block->nr_ops, &block->native) == -1)
+	{
+		cpu_block_flush(cpu);
+		return;
+	}
+
+	if (block->native != NULL)
+	{
+		cpu->stats.native++;
+	}
+}
+
+/*
+ *   Handlers a trace may hold
+ */
+#define TRACE_OP(mode, am, name, ...) [ISA_H_##name##_##mode] = 1,
+#define TRACE_BINARY(name, opcode, class, expr, fault) ISA_BINARY_MODES(TRACE_OP, name)
+
+static const byte_t trace_ops[NR_HANDLERS] =
+{
+	ISA_BINARY_OPS(TRACE_BINARY)
+	[ISA_H_jump_imm] = 1,
+	[ISA_H_jg_imm]   = 1,
+	[ISA_H_je_imm]   = 1
+};
+
+/*
+ *   Run the loop starting at the block one command at a time,
+ *   recording the path it takes until it comes back to the block,
+ *   and compile the path to a native loop. Recording gives up on
+ *   commands a trace can not hold and on paths too long; the loop
+ *   is not traced again then.
+ */
+static int cpu_trace_record(cpu_t *cpu, cpu_block_t *head)
+{
+	jit_insn_t       insns[JIT_TRACE_MAX];
+	const cpu_insn_t *insn;
+	word_t           nr;
+	word_t           ip;
+
+
+	head->traced = 1;
+
+	ip = head->entry;
+	nr = 0;
+	for (;;)
+	{
+		insn = cpu_decode(cpu, ip);
+		if (insn == NULL)
 		{
 			cpu->flags.error = 1;
-			return;
+			return -1;
 		}
-		cpu_reg_read(cpu, op2, &reg);
-		reg = aux - reg;
-		cpu_reg_write(cpu, op2, reg);
-		break;
 
-	case MODE_IMMEDIATE_MEMORY:
-		ret = cpu_mem_read_word(cpu, op2, &aux);
-		if (ret == -1)
+		if (executors[insn->handler](cpu, insn) == -1)
 		{
-			cpu->flags.error = 1;
-			return;
+			return -1;
+		}
+
+		cpu->budget--;
+
+		/*
+		 *   A store dropping code drops the loop head as well
+		 */
+		if (cpu->flushed || cpu->flags.halt || !trace_ops[insn->handler] || nr == JIT_TRACE_MAX)
+		{
+			return 0;
 		}
-		aux = op1 - aux;
 
-		ret = cpu_mem_write_word(cpu, op2, aux);
-		if (ret == -1)
+		insns[nr].addr    = ip;
+		insns[nr].op1     = insn->op1;
+		insns[nr].op2     = insn->op2;
+		insns[nr].handler = insn->handler;
+		insns[nr].mode    = insn->mode;
+		insns[nr].length  = insn->length;
+		insns[nr].taken   = (cpu->regs[ISA_REG_IP] != ip + insn->length);
+		nr++;
+
+		ip = cpu->regs[ISA_REG_IP];
+		if (ip == head->entry)
 		{
-			cpu->flags.error = 1;
-			return;
+			break;
 		}
-		break;
+	}
 
-	case MODE_IMMEDIATE_REGISTER:
-		cpu_reg_read(cpu, op2, &reg);
-		reg = op1 - reg;
-		cpu_reg_write(cpu, op2, reg);
-		break;
+	if (jit_compile_trace(cpu->jit, insns, nr, &head->trace) == -1)
+	{
+		cpu_block_flush(cpu);
+		return 0;
+	}
 
-	default:
-		cpu->flags.error = 1;
-		break;
-	} /* switch */
+	if (head->trace != NULL)
+	{
+		cpu->stats.traces++;
+	}
+
+	return 0;
+}
+
+/*
+ *   Create the native code generator
+ */
+static int cpu_jit_create(cpu_t *cpu)
+{
+	jit_env_t env;
+
+
+	if (cpu->jit != NULL)
+	{
+		return 0;
+	}
+
+	env.ctx     = cpu;
+	env.regs    = cpu->regs;
+	env.cmp     = cpu->flags.cmp;
+	env.error   = &cpu->flags.error;
+	env.budget  = &cpu->budget;
+	env.load    = cpu_jit_load;
+	env.store   = cpu_jit_store;
+
+	cpu->jit = jit_init(&env);
+
+	return (cpu->jit != NULL) ? 0 : -1;
+}
+
+/*
+ *   Count a run of the block on its tier and promote it once its
+ *   runs cross the threshold of the next tier. The promotion takes
+ *   effect the next time the block is entered.
+ */
+static void cpu_tier_promote(cpu_t *cpu, cpu_block_t *block)
+{
+	while (block->tier < cpu->tier_top && block->runs >= cpu->thresholds[block->tier + 1])
+	{
+		if (block->tier + 1 == CPU_TIER_NATIVE && cpu_jit_create(cpu) == -1)
+		{
+			cpu->tier_top = CPU_TIER_THREADED;
+			break;
+		}
+
+		block->tier++;
+		cpu->tier_stats.promoted[block->tier]++;
+	}
+}
 
-	cpu->registers.ip.data += (1 + 1 + 4 + 4);
+static inline void cpu_tier_count(cpu_t *cpu, cpu_block_t *block)
+{
+	cpu->tier_stats.runs[block->tier]++;
+	block->runs++;
+
+	if (block->tier < cpu->tier_top && block->runs >= cpu->thresholds[block->tier + 1])
+	{
+		cpu_tier_promote(cpu, block);
+	}
 }
 
-static void jump(cpu_t *cpu)
+#ifdef CPU_HAVE_THREADED
+
+/*
+ *   Threaded-code engine: the instruction pointer, flags and
+ *   registers live in locals for the whole run and every command
+ *   jumps straight to the handler of the next one in the block
+ *   through a table of label addresses. The IP slot of the local
+ *   register file is refreshed on dispatch so commands reading IP
+ *   see the current value.
+ *
+ *   The handlers are expanded twice: with the load and store checks,
+ *   and without them for blocks the verifier passed. Each block runs
+ *   on the table of its kind.
+ */
+#define T_DISPATCH()                                           \
+	regs[ISA_REG_IP] = ip;                                 \
+	goto *table[insn->fused];
+
+#define T_NEXT()                                               \
+	insn += insn->span;                                    \
+	if (insn == last)                                      \
+	{                                                      \
+		goto chain;                                    \
+	}                                                      \
+	T_DISPATCH();
+
+/*
+ *   Commands storing to memory leave the block if it was dropped
+ */
+#define T_STORED_reg_mem()      if (cpu->flushed) { goto chain; }
+#define T_STORED_reg_reg()
+#define T_STORED_mem_reg()
+#define T_STORED_imm_mem()      if (cpu->flushed) { goto chain; }
+#define T_STORED_imm_reg()
+
+#define ISA_IP                  ip
+#define ISA_REG_GET(code, v)    (v) = regs[code]
+#define ISA_REG_SET(code, v)    regs[code] = (v)
+#define ISA_MEM_GET(addr, v)                                   \
+	if (cpu_mem_read_word(cpu, (addr), &(v)) == -1)        \
+	{                                                      \
+		goto fault;                                    \
+	}
+#define ISA_MEM_SET(addr, v)                                   \
+	if (cpu_mem_write_word(cpu, (addr), (v)) == -1)        \
+	{                                                      \
+		goto fault;                                    \
+	}
+#define ISA_COMPARE(a, b)                                      \
+	cmp_a = (a);                                           \
+	cmp_b = (b)
+#define ISA_EQU                 ISA_FLAG_EQU(cmp_a, cmp_b)
+#define ISA_GREATER             ISA_FLAG_GREATER(cmp_a, cmp_b)
+#define ISA_ERROR()             cpu->flags.error = 1
+#define ISA_NEXT                (insn + 1)
+
+#define T_L(x)                  L_##x /* Handler labels of the checked set */
+
+#define T_BINARY_MODE(mode, am, name, class, expr, fault)                   \
+	T_L(name##_##mode):                                                 \
+	ISA_BODY_##class(mode, expr, fault)                                 \
+	T_STORED_##mode();                                                  \
+	T_NEXT();
+#define T_BINARY(name, opcode, class, expr, fault)                          \
+	ISA_BINARY_MODES(T_BINARY_MODE, name, class, expr, fault)
+
+#define T_JUMP_MODE(mode, am, name, cond)                                   \
+	T_L(name##_##mode):                                                 \
+	ISA_BODY_JUMP(mode, cond)                                           \
+	goto chain;
+#define T_JUMP(name, opcode, cond)                                          \
+	ISA_JUMP_MODES(T_JUMP_MODE, name, cond)
+
+#define T_CMP_BRANCH(branch, cond, mode)                                    \
+	T_L(cmp_##mode##_##branch):                                         \
+	ISA_BODY_CMP_BRANCH(mode, cond)                                     \
+	goto chain;
+#define T_CMP_BRANCHES(mode, am, ...)                                       \
+	ISA_CMP_BRANCHES(T_CMP_BRANCH, mode)
+
+#define T_MOVI_MODE(mode, am, name, class, expr, fault)                     \
+	T_L(movi_##name##_##mode):                                          \
+	ISA_BODY_MOVI(mode, class, expr, fault)                             \
+	T_STORED_##mode();                                                  \
+	T_NEXT();
+#define T_MOVI(name, opcode, class, expr, fault)                            \
+	ISA_BINARY_MODES(T_MOVI_MODE, name, class, expr, fault)
+
+#define T_LABEL(mode, am, name, ...) [ISA_H_##name##_##mode] = &&T_L(name##_##mode),
+#define T_BINARY_LABELS(name, opcode, class, expr, fault) ISA_BINARY_MODES(T_LABEL, name)
+#define T_JUMP_LABELS(name, opcode, cond) ISA_JUMP_MODES(T_LABEL, name)
+#define T_CMP_BRANCH_LABEL(branch, cond, mode) [ISA_H_cmp_##mode##_##branch] = &&T_L(cmp_##mode##_##branch),
+#define T_CMP_BRANCH_LABELS(mode, am, ...) ISA_CMP_BRANCHES(T_CMP_BRANCH_LABEL, mode)
+#define T_MOVI_LABEL(mode, am, name, ...) [ISA_H_movi_##name##_##mode] = &&T_L(movi_##name##_##mode),
+#define T_MOVI_LABELS(name, opcode, class, expr, fault) ISA_BINARY_MODES(T_MOVI_LABEL, name)
+
+static int cpu_run_threaded(cpu_t *cpu)
 {
+	static void *labels[NR_HANDLERS] =
+	{
+		[ISA_H_bad_mode] = &&L_bad_mode,
+		[ISA_H_trap]     = &&L_trap,
+		[ISA_H_halt]     = &&L_halt,
+		ISA_BINARY_OPS(T_BINARY_LABELS)
+		ISA_JUMP_OPS(T_JUMP_LABELS)
+		ISA_BINARY_MODES(T_CMP_BRANCH_LABELS, cmp)
+		ISA_BINARY_OPS(T_MOVI_LABELS)
+	};
+#undef  T_L
+#define T_L(x)                  V_##x /* Handler labels of the unchecked set */
+	static void *verified[NR_HANDLERS] =
+	{
+		[ISA_H_bad_mode] = &&L_bad_mode,
+		[ISA_H_trap]     = &&L_trap,
+		[ISA_H_halt]     = &&L_halt,
+		ISA_BINARY_OPS(T_BINARY_LABELS)
+		ISA_JUMP_OPS(T_JUMP_LABELS)
+		ISA_BINARY_MODES(T_CMP_BRANCH_LABELS, cmp)
+		ISA_BINARY_OPS(T_MOVI_LABELS)
+	};
+#undef  T_L
+#define T_L(x)                  L_##x
+	void *const      *table;
+	const cpu_insn_t *insn;
+	const cpu_insn_t *last;
+	cpu_block_t      *block;
+	word_t regs[NR_REGISTERS];
+	word_t ip;
+	word_t cmp_a;
+	word_t cmp_b;
 	int    ret;
-	byte_t am;
-	word_t op1;
-	word_t aux;
-	word_t reg;
 
 
-	if (cpu == NULL)
+	if (cpu->flags.halt)
 	{
-		return;
+		return 0;
+	}
+
+	/*
+	 *   Pull the CPU state into locals
+	 */
+	memcpy(regs, cpu->regs, sizeof(regs));
+	ip      = cpu->regs[ISA_REG_IP];
+	cmp_a   = cpu->flags.cmp[0];
+	cmp_b   = cpu->flags.cmp[1];
+	ret     = 0;
+	block   = NULL;
+
+chain:
+	/*
+	 *   The block left may have been cut short by a store
+	 */
+	if (block != NULL)
+	{
+		cpu->budget -= (insn < last) ? (insn - block->ops) + insn->span : block->nr_ops;
+	}
+
+	if (cpu_yield(cpu))
+	{
+		ret = 1;
+		goto out;
+	}
+
+	block = cpu_block_chain(cpu, block, ip);
+	if (block == NULL)
+	{
+		goto fault;
+	}
+
+	/*
+	 *   Run for the tiered engine: it takes blocks of other tiers
+	 *   back, the others are counted
+	 */
+	if (cpu->tiered)
+	{
+		if (block->tier != CPU_TIER_THREADED)
+		{
+			goto out;
+		}
+
+		cpu_tier_count(cpu, block);
+	}
+
+	insn  = block->ops;
+	last  = block->ops + block->nr_ops;
+	table = block->verified ? verified : labels;
+	T_DISPATCH();
+
+	ISA_BINARY_OPS(T_BINARY)
+	ISA_JUMP_OPS(T_JUMP)
+	ISA_BINARY_MODES(T_CMP_BRANCHES, cmp)
+	ISA_BINARY_OPS(T_MOVI)
+
+	/*
+	 *   Unchecked set: the verifier proved every memory operand
+	 *   readable, and every destination writable. Stores still drop
+	 *   the code they overwrite.
+	 */
+#undef  T_L
+#define T_L(x)                  V_##x
+#undef  ISA_MEM_GET
+#define ISA_MEM_GET(addr, v)                                   \
+	(v) = mem_peek_u32(&cpu->arena, (addr))
+#undef  ISA_MEM_SET
+#define ISA_MEM_SET(addr, v)                                   \
+	{                                                      \
+		cpu_code_overwrite(cpu, (addr));               \
+		mem_poke_u32(&cpu->arena, (addr), (v));        \
+	}
+
+	ISA_BINARY_OPS(T_BINARY)
+	ISA_JUMP_OPS(T_JUMP)
+	ISA_BINARY_MODES(T_CMP_BRANCHES, cmp)
+	ISA_BINARY_OPS(T_MOVI)
+
+L_bad_mode:
+	cpu->flags.error = 1;
+	ip += insn->length;
+	T_NEXT();
+
+L_halt:
+	cpu->budget -= (insn - block->ops) + 1;
+	cpu->flags.halt = 1;
+	goto out;
+
+fault:
+L_trap:
+	if (block != NULL)
+	{
+		cpu->budget -= cpu_block_done(block, ip);
+	}
+	cpu->flags.error = 1;
+	ret = -1;
+
+out:
+	/*
+	 *   Write the locals back to the CPU state
+	 */
+	regs[ISA_REG_IP] = ip;
+	memcpy(cpu->regs, regs, sizeof(regs));
+	cpu->flags.cmp[0] = cmp_a;
+	cpu->flags.cmp[1] = cmp_b;
+
+	return ret;
+}
+
+#undef ISA_IP
+#undef ISA_REG_GET
+#undef ISA_REG_SET
+#undef ISA_MEM_GET
+#undef ISA_MEM_SET
+#undef ISA_COMPARE
+#undef ISA_EQU
+#undef ISA_GREATER
+#undef ISA_ERROR
+#undef ISA_NEXT
+
+#undef T_STORED_reg_mem
+#undef T_STORED_reg_reg
+#undef T_STORED_mem_reg
+#undef T_STORED_imm_mem
+#undef T_STORED_imm_reg
+#undef T_L
+
+#endif /* CPU_HAVE_THREADED */
+
+/*
+ *   Tiered engine. Blocks start on the interpreter and move up to
+ *   the threaded engine and to native code as their runs cross the
+ *   tier thresholds. Runs are counted on every block entry, loop
+ *   back-edges included, so a loop in progress switches tiers at
+ *   its next back-edge instead of on the next cpu_run(); between
+ *   blocks the whole guest state is in the CPU structure, which is
+ *   all the replacement takes. Backward branches
+ *   into native blocks are counted again to find loops worth a
+ *   trace. The native code engine is this engine with every block
+ *   on the native tier from the start.
+ */
+static int cpu_run_tiered(cpu_t *cpu)
+{
+	cpu_block_t *block;
+	cpu_block_t *prev;
+	int         back;
+	int         last;
+	int         tier;
+	int         ret;
+
+
+	block = NULL;
+	back  = 0;
+	last  = cpu->tier_start;
+	while (!cpu->flags.halt)
+	{
+		if (cpu_yield(cpu))
+		{
+			return 1;
+		}
+
+		prev  = block;
+		block = cpu_block_chain(cpu, block, cpu->regs[ISA_REG_IP]);
+		if (block == NULL)
+		{
+			cpu->flags.error = 1;
+			return -1;
+		}
+
+		if (prev != NULL && block->entry < prev->end)
+		{
+			back = 1;
+		}
+
+		tier = block->tier;
+		if (tier != last)
+		{
+			cpu->tier_stats.switches++;
+		}
+		last = tier;
+
+#ifdef CPU_HAVE_THREADED
+		if (tier == CPU_TIER_THREADED)
+		{
+			/*
+			 *   Runs up to a block of another tier
+			 */
+			if (cpu_run_threaded(cpu) == -1)
+			{
+				return -1;
+			}
+
+			block = NULL;
+			back  = 0;
+			continue;
+		}
+#endif
+
+		cpu_tier_count(cpu, block);
+
+		if (tier != CPU_TIER_NATIVE)
+		{
+			back = 0;
+			if (cpu_block_interpret(cpu, block) == -1)
+			{
+				return -1;
+			}
+			continue;
+		}
+
+		if (block->trace != NULL)
+		{
+			if (block->trace() == -1)
+			{
+				return -1;
+			}
+
+			block = NULL;
+			back  = 0;
+			continue;
+		}
+
+		if (back && !block->traced && ++block->hits >= TRACE_HOT)
+		{
+			if (cpu_trace_record(cpu, block) == -1)
+			{
+				return -1;
+			}
+
+			block = NULL;
+			back  = 0;
+			continue;
+		}
+
+		if (!block->jitted)
+		{
+			cpu_block_compile(cpu, block);
+			if (cpu->flushed)
+			{
+				block = NULL;
+				back  = 0;
+				continue;
+			}
+		}
+
+		back = 0;
+		if (block->native != NULL)
+		{
+			ret = block->native();
+			if (ret == -1)
+			{
+				return -1;
+			}
+
+			/*
+			 *   Native code may have left from any block
+			 *   chained to this one
+			 */
+			block = NULL;
+			back  = (ret == 1);
+		}
+		else if (cpu_block_interpret(cpu, block) == -1)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *   Ahead-of-time engine. Blocks of the attached module run as
+ *   native functions, going on with each other directly; the code
+ *   outside the module runs on the interpreter, and all of it does
+ *   once a store into the module's code dropped it.
+ */
+static int cpu_run_aot(cpu_t *cpu)
+{
+	cpu_block_t *block;
+	aot_code_t  code;
+
+
+	block = NULL;
+	while (!cpu->flags.halt)
+	{
+		if (cpu_yield(cpu))
+		{
+			return 1;
+		}
+
+		code = cpu->aot_live ? aot_lookup(cpu->aot, cpu->regs[ISA_REG_IP]) : NULL;
+		if (code != NULL)
+		{
+			if (code(&cpu->aot_env) == -1)
+			{
+				return -1;
+			}
+
+			block = NULL;
+			continue;
+		}
+
+		block = cpu_block_chain(cpu, block, cpu->regs[ISA_REG_IP]);
+		if (block == NULL)
+		{
+			cpu->flags.error = 1;
+			return -1;
+		}
+
+		if (cpu_block_interpret(cpu, block) == -1)
+		{
+			return -1;
+		}
 	}
 
-	ret = cpu_mem_read_byte(cpu, cpu->registers.ip.data + 1, &am);
-	if (ret == -1)
-	{
-		cpu->flags.error = 1;
-		return;
-	}
+	return 0;
+}
+
+/*
+ *   Implementations (CPU)
+ */
+
+/*
+ *   State common to cpu_init() and cpu_init_at(), the side tables
+ *   (zero-filled) already in place
+ */
+static void cpu_setup(cpu_t *cpu, mem_t *mem, io_t *io)
+{
+	/*
+	 *   Initialize the CPU state structure
+	 */
+	cpu->mem  = mem;
+	cpu->io   = io;
+
+	/*
+	 *   Initialize flags, no compare made yet (neither equal
+	 *   nor greater)
+	 */
+	memset(&cpu->flags, 0, sizeof(cpu->flags));
+	cpu->flags.cmp[1] = 1;
+
+	/*
+	 *   Initialize registers
+	 */
+	memset(cpu->regs, 0, sizeof(cpu->regs));
+
+	/*
+	 *   Every predecoded entry invalid, nothing verified until code
+	 *   is loaded, stores look at nothing until code is cached and
+	 *   loads until pages are closed to them
+	 */
+	cpu->code_lo = cpu->nr_decoded;
+	cpu->code_hi = 0;
+	memset(&cpu->scratch, 0, sizeof(cpu->scratch));
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1, &op1);
-	if (ret == -1)
-	{
-		cpu->flags.error = 1;
-		return;
-	}
+	cpu->verified_lo = cpu->nr_decoded;
+	cpu->verified_hi = 0;
+	mem_get_arena(mem, &cpu->arena);
 
-	switch (am)
-	{
-	case MODE_REGISTER:
-		cpu_reg_read(cpu, op1, &reg);
-		cpu->registers.ip.data = reg;
-		break;
+	cpu->store_lo = cpu->nr_decoded;
+	cpu->store_hi = 0;
+	cpu->load_lo  = cpu->nr_decoded;
+	cpu->load_hi  = 0;
 
-	case MODE_MEMORY:
-		ret = cpu_mem_read_word(cpu, op1, &aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
+	cpu->fusion = 1;
 
-		cpu->registers.ip.data = aux;
-		break;
+	/*
+	 *   Block cache, empty and allocated on first use
+	 */
+	cpu->blocks = NULL;
+	cpu->pool   = NULL;
+	cpu->bucket = NULL;
+	cpu->jit    = NULL;
+	cpu_block_flush(cpu);
+	cpu->flushed = 0;
+	memset(&cpu->stats, 0, sizeof(cpu->stats));
 
-	case MODE_IMMEDIATE:
-		cpu->registers.ip.data = op1;
-		break;
+	/*
+	 *   Blocks earn their tier; the native code generator is
+	 *   created when the first block is promoted to it
+	 */
+	cpu->run        = cpu_run_tiered;
+	cpu->tiered     = 1;
+	cpu->tier_start = CPU_TIER_INTERP;
+	cpu->tier_top   = CPU_TIER_NATIVE;
+	cpu->thresholds[CPU_TIER_INTERP]   = 0;
+	cpu->thresholds[CPU_TIER_THREADED] = TIER_THREADED;
+	cpu->thresholds[CPU_TIER_NATIVE]   = TIER_NATIVE;
+	memset(&cpu->tier_stats, 0, sizeof(cpu->tier_stats));
+
+	cpu->budget = 0;
+	cpu->stop   = 0;
 
-	default:
-		cpu->flags.error = 1;
-		break;
-	} /* switch */
+	/*
+	 *   No ahead-of-time module until one is attached
+	 */
+	cpu->aot      = NULL;
+	cpu->aot_live = 0;
 }
 
-static void halt(cpu_t *cpu)
+cpu_t* cpu_init(mem_t *mem, io_t *io)
 {
-	if (cpu == NULL)
-	{
-		return;
-	}
-
-	cpu->flags.halt = 1;
+	return cpu_init_with(mem, io, CPU_ENGINE_TIERED);
 }
 
-static void mov(cpu_t *cpu)
+/*
+ *   cpu_init() running the engine given (see cpu_set_engine()). Fails
+ *   on an engine the host cannot run; CPU_ENGINE_AOT needs a module
+ *   attached first, so it can only be set afterwards.
+ */
+cpu_t* cpu_init_with(mem_t *mem, io_t *io, cpu_engine_t engine)
 {
-	int    ret;
-	byte_t am;
-	word_t op1;
-	word_t op2;
-	word_t aux;
-	word_t reg;
+	cpu_t  *cpu;
 
 
-	if (cpu == NULL)
+	if (mem == NULL || io == NULL)
 	{
-		return;
+		return NULL;
 	}
 
-	ret = cpu_mem_read_byte(cpu, cpu->registers.ip.data + 1, &am);
-	if (ret == -1)
+	cpu = (cpu_t *)malloc(sizeof(*cpu));
+	if (cpu == NULL)
 	{
-		cpu->flags.error = 1;
-		return;
+		return NULL;
 	}
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1, &op1);
-	if (ret == -1)
+	/*
+	 *   One side table pointer per page of memory, one watch entry
+	 *   per run of it
+	 */
+	cpu->nr_decoded = mem_size(mem);
+	cpu->pages      = (cpu_page_t **)cpu_table_alloc((cpu->nr_decoded >> DECODE_SHIFT) + 1, sizeof(cpu_page_t *));
+	cpu->watch      = (byte_t *)cpu_table_alloc((cpu->nr_decoded >> WATCH_SHIFT) + 1, sizeof(byte_t));
+	if (cpu->pages == NULL || cpu->watch == NULL)
 	{
-		cpu->flags.error = 1;
-		return;
+		cpu_table_free(cpu->watch, (cpu->nr_decoded >> WATCH_SHIFT) + 1, sizeof(byte_t));
+		cpu_table_free(cpu->pages, (cpu->nr_decoded >> DECODE_SHIFT) + 1, sizeof(cpu_page_t *));
+		free(cpu);
+		return NULL;
 	}
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1 + 4, &op2);
-	if (ret == -1)
+	cpu->embedded = 0;
+	cpu_setup(cpu, mem, io);
+	if (cpu_set_engine(cpu, engine) == -1)
 	{
-		cpu->flags.error = 1;
-		return;
+		cpu_free(cpu);
+		return NULL;
 	}
 
-	switch (am)
-	{
-	case MODE_REGISTER_MEMORY:
-		cpu_reg_read(cpu, op1, &aux);
+	return cpu;
+}
 
-		ret = cpu_mem_write_word(cpu, op2, aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		break;
+/*
+ *   Bytes cpu_init_at() needs for a memory of `size` bytes, a whole
+ *   number of cache lines. The side tables are not part of it: the
+ *   CPU allocates one per page of memory holding code, as the code is
+ *   decoded (a cpu_page_t, about 6 KiB for 256 bytes of memory).
+ */
+size_t cpu_footprint(word_t size)
+{
+	return CACHE_ALIGN(sizeof(cpu_t)) +
+	       CACHE_ALIGN(((size_t)(size >> DECODE_SHIFT) + 1) * sizeof(cpu_page_t *)) +
+	       CACHE_ALIGN(((size_t)(size >> WATCH_SHIFT) + 1) * sizeof(byte_t));
+}
 
-	case MODE_REGISTER_REGISTER:
-		cpu_reg_read(cpu, op1, &reg);
-		cpu_reg_write(cpu, op2, reg);
-		break;
+/*
+ *   CPU in a block of the caller's: cpu_footprint(mem_size(mem))
+ *   zero-filled bytes at `p`, aligned to a cache line. The directories
+ *   of the side tables follow the state structure. cpu_free() leaves
+ *   the block to the caller; the side tables, the block cache and the
+ *   code generators it creates on demand are its own.
+ */
+cpu_t* cpu_init_at(void *p, mem_t *mem, io_t *io)
+{
+	cpu_t  *cpu;
+	byte_t *at;
 
-	case MODE_MEMORY_REGISTER:
-		ret = cpu_mem_read_word(cpu, op1, &aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		cpu_reg_write(cpu, op2, aux);
-		break;
 
-	case MODE_IMMEDIATE_MEMORY:
-		aux = op1;
+	if (p == NULL || (uintptr_t)p % CACHE_LINE != 0 || mem == NULL || io == NULL)
+	{
+		return NULL;
+	}
 
-		ret = cpu_mem_write_word(cpu, op2, aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		break;
+	cpu = (cpu_t *)p;
+	at  = (byte_t *)p + CACHE_ALIGN(sizeof(cpu_t));
 
-	case MODE_IMMEDIATE_REGISTER:
-		cpu_reg_write(cpu, op2, op1);
-		break;
+	cpu->nr_decoded = mem_size(mem);
+	cpu->pages      = (cpu_page_t **)at;
+	at += CACHE_ALIGN(((size_t)(cpu->nr_decoded >> DECODE_SHIFT) + 1) * sizeof(cpu_page_t *));
+	cpu->watch      = at;
 
-	default:
-		cpu->flags.error = 1;
-		break;
-	} /* switch */
+	cpu->embedded = 1;
+	cpu_setup(cpu, mem, io);
 
-	cpu->registers.ip.data += (1 + 1 + 4 + 4);
+	return cpu;
 }
 
-static void cmp(cpu_t *cpu)
+int cpu_free(cpu_t *cpu)
 {
-	int    ret;
-	byte_t am;
-	word_t op1;
-	word_t op2;
-	word_t aux;
-	word_t reg;
+	word_t i;
 
 
 	if (cpu == NULL)
 	{
-		return;
+		return -1;
 	}
 
-	ret = cpu_mem_read_byte(cpu, cpu->registers.ip.data + 1, &am);
-	if (ret == -1)
+	/*
+	 *   Free CPU state structure items
+	 */
+	for (i = 0; i <= cpu->nr_decoded >> DECODE_SHIFT; i++)
 	{
-		cpu->flags.error = 1;
-		return;
+		free(cpu->pages[i]);
 	}
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1, &op1);
-	if (ret == -1)
+	if (!cpu->embedded)
 	{
-		cpu->flags.error = 1;
-		return;
+		cpu_table_free(cpu->pages, (cpu->nr_decoded >> DECODE_SHIFT) + 1, sizeof(cpu_page_t *));
+		cpu_table_free(cpu->watch, (cpu->nr_decoded >> WATCH_SHIFT) + 1, sizeof(byte_t));
 	}
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1 + 4, &op2);
-	if (ret == -1)
+	free(cpu->blocks);
+	free(cpu->pool);
+	free(cpu->bucket);
+	if (cpu->jit != NULL)
 	{
-		cpu->flags.error = 1;
-		return;
+		jit_free(cpu->jit);
 	}
 
-	switch (am)
+	if (cpu->aot != NULL)
 	{
-	case MODE_REGISTER_MEMORY:
-		cpu_reg_read(cpu, op1, &reg);
-
-		ret = cpu_mem_read_word(cpu, op2, &aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-
-		if (reg == aux)
-		{
-			cpu->flags.equ     = 1;
-			cpu->flags.greater = 0;
-		}
-		else if (reg < aux)
-		{
-			cpu->flags.equ     = 0;
-			cpu->flags.greater = 0;
-		}
-		else
-		{
-			cpu->flags.equ     = 0;
-			cpu->flags.greater = 1;
-		}
-		break;
+		aot_free(cpu->aot);
+	}
 
-	case MODE_REGISTER_REGISTER:
-		cpu_reg_read(cpu, op1, &reg);
-		cpu_reg_read(cpu, op2, &aux);
+	if (!cpu->embedded)
+	{
+		free(cpu);
+	}
 
-		if (reg == aux)
-		{
-			cpu->flags.equ     = 1;
-			cpu->flags.greater = 0;
-		}
-		else if (reg < aux)
-		{
-			cpu->flags.equ     = 0;
-			cpu->flags.greater = 0;
-		}
-		else
-		{
-			cpu->flags.equ     = 0;
-			cpu->flags.greater = 1;
-		}
+	return 0;
+}
 
-		break;
+int cpu_set_engine(cpu_t *cpu, cpu_engine_t engine)
+{
+	byte_t start;
 
-	case MODE_MEMORY_REGISTER:
-		ret = cpu_mem_read_word(cpu, op1, &aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		cpu_reg_read(cpu, op2, &reg);
 
-		if (reg == aux)
-		{
-			cpu->flags.equ     = 1;
-			cpu->flags.greater = 0;
-		}
-		else if (aux < reg)
-		{
-			cpu->flags.equ     = 0;
-			cpu->flags.greater = 0;
-		}
-		else
-		{
-			cpu->flags.equ     = 0;
-			cpu->flags.greater = 1;
-		}
+	if (cpu == NULL)
+	{
+		return -1;
+	}
 
+	start = CPU_TIER_INTERP;
+	switch (engine)
+	{
+	case CPU_ENGINE_PORTABLE:
+		cpu->run = cpu_run_portable;
 		break;
 
-	case MODE_IMMEDIATE_MEMORY:
-		ret = cpu_mem_read_word(cpu, op2, &aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
+#ifdef CPU_HAVE_THREADED
+	case CPU_ENGINE_THREADED:
+		cpu->run = cpu_run_threaded;
+		break;
+#endif
 
-		if (op1 == aux)
-		{
-			cpu->flags.equ     = 1;
-			cpu->flags.greater = 0;
-		}
-		else if (op1 < aux)
-		{
-			cpu->flags.equ     = 0;
-			cpu->flags.greater = 0;
-		}
-		else
+	case CPU_ENGINE_JIT:
+		if (cpu_jit_create(cpu) == -1)
 		{
-			cpu->flags.equ     = 0;
-			cpu->flags.greater = 1;
+			return -1;
 		}
 
+		cpu->run = cpu_run_tiered;
+		start    = CPU_TIER_NATIVE;
 		break;
 
-	case MODE_IMMEDIATE_REGISTER:
-		cpu_reg_read(cpu, op2, &reg);
+	case CPU_ENGINE_TIERED:
+		cpu->run = cpu_run_tiered;
+		break;
 
-		if (op1 == reg)
-		{
-			cpu->flags.equ     = 1;
-			cpu->flags.greater = 0;
-		}
-		else if (op1 < reg)
-		{
-			cpu->flags.equ     = 0;
-			cpu->flags.greater = 0;
-		}
-		else
+	case CPU_ENGINE_AOT:
+		if (cpu->aot == NULL)
 		{
-			cpu->flags.equ     = 0;
-			cpu->flags.greater = 1;
+			return -1;
 		}
 
+		cpu->run = cpu_run_aot;
 		break;
 
 	default:
-		cpu->flags.error = 1;
-		break;
+		return -1;
 	} /* switch */
 
-	cpu->registers.ip.data += (1 + 1 + 4 + 4);
+	cpu->tiered = (engine == CPU_ENGINE_TIERED);
+
+	/*
+	 *   Blocks start over on the tier of the new engine
+	 */
+	if (start != cpu->tier_start)
+	{
+		cpu->tier_start = start;
+		cpu_block_flush(cpu);
+	}
+
+	return 0;
 }
 
-static void jg(cpu_t *cpu)
+int cpu_set_fusion(cpu_t *cpu, int enable)
 {
 	if (cpu == NULL)
 	{
-		return;
+		return -1;
+	}
+
+	/*
+	 *   Commands decoded so far follow the old setting
+	 */
+	cpu->fusion = (enable != 0);
+	cpu_code_flush(cpu);
+
+	return 0;
+}
+
+int cpu_poweron(cpu_t *cpu)
+{
+	if (cpu == NULL)
+	{
+		return -1;
 	}
 
-	if (cpu->flags.greater == 0)
+	/*
+	 *   Reset flags and register contents
+	 */
+	memset(&cpu->flags, 0, sizeof(cpu->flags));
+	memset(cpu->regs, 0, sizeof(cpu->regs));
+	cpu->flags.cmp[1] = 1;
+
+	return 0;
+}
+
+/*
+ *   Copy the code to memory in one block and verify it
+ */
+int cpu_load_code(cpu_t *cpu, word_t addr, byte_t *code, word_t size)
+{
+	if (cpu == NULL || code == NULL)
 	{
-		cpu->registers.ip.data += (1 + 1 + 4);
-		return;
+		return -1;
 	}
-	else
+
+	if (mem_write_block(cpu->mem, addr, code, size) == -1)
 	{
-		jump(cpu);
+		return -1;
 	}
+
+	cpu_code_invalidate(cpu, addr, size);
+	cpu_verify(cpu, addr, size);
+
+	return 0;
 }
 
-static void je(cpu_t *cpu)
+/*
+ *   Take the code already written to memory at the address (by
+ *   mem_write_block() or asm_assemble_to(), say) as loaded there
+ */
+int cpu_load_memory(cpu_t *cpu, word_t addr, word_t size)
 {
 	if (cpu == NULL)
 	{
-		return;
+		return -1;
 	}
 
-	if (cpu->flags.equ == 0)
+	if (size > cpu->nr_decoded || addr > cpu->nr_decoded - size)
 	{
-		cpu->registers.ip.data += (1 + 1 + 4);
-		return;
+		return -1;
+	}
+
+	cpu_code_invalidate(cpu, addr, size);
+	cpu_verify(cpu, addr, size);
+
+	return 0;
+}
+
+/*
+ *   Load code with the verifier results cpu_get_verified() gave for
+ *   the same code at the same address, instead of following the code
+ *   again. Each marked command is checked again on its own, so
+ *   results that do not hold (for memory with other attributes, say)
+ *   only lose marks.
+ */
+int cpu_load_verified(cpu_t *cpu, word_t addr, byte_t *code, word_t size, const byte_t *verified)
+{
+	word_t end;
+	word_t i;
+
+
+	if (cpu == NULL || code == NULL || verified == NULL)
+	{
+		return -1;
+	}
+
+	if (mem_write_block(cpu->mem, addr, code, size) == -1)
+	{
+		return -1;
 	}
-	else
+
+	cpu_code_invalidate(cpu, addr, size);
+
+	/*
+	 *   Verified commands lie in the loaded code
+	 */
+	end = (size < cpu->nr_decoded - addr) ? addr + size : cpu->nr_decoded;
+	for (i = addr; i < end; i++)
 	{
-		jump(cpu);
+		if (verified[i - addr])
+		{
+			cpu_verify_mark(cpu, i, addr, end);
+		}
 	}
+
+	cpu_code_track(cpu, addr, addr + size);
+
+	return 0;
 }
 
-static void my_mul(cpu_t *cpu)
+/*
+ *   Verifier results for [addr, addr + size), one byte per address
+ */
+int cpu_get_verified(cpu_t *cpu, word_t addr, word_t size, byte_t *verified)
 {
-	int    ret;
-	byte_t am;
-	word_t op1;
-	word_t op2;
-	word_t reg;
-	word_t aux;
+	word_t i;
 
 
-	if (cpu == NULL)
+	if (cpu == NULL || verified == NULL)
 	{
-		return;
+		return -1;
 	}
 
-	ret = cpu_mem_read_byte(cpu, cpu->registers.ip.data + 1, &am);
-	if (ret == -1)
+	for (i = 0; i < size; i++)
 	{
-		cpu->flags.error = 1;
-		return;
+		verified[i] = (addr + i < cpu->nr_decoded) ? cpu_verified_at(cpu, addr + i) : 0;
 	}
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1, &op1);
-	if (ret == -1)
+	return 0;
+}
+
+/*
+ *   Write C source for the code loaded to [addr, addr + size): the
+ *   commands reached from the load address, one function per block
+ *   (aot.c). Build it with aot_compile() and attach the result.
+ */
+int cpu_aot_emit(cpu_t *cpu, word_t addr, word_t size, const char *path)
+{
+	const cpu_insn_t *insn;
+	aot_insn_t       *insns;
+	word_t           *work;
+	byte_t           *seen;
+	word_t           nr_work;
+	word_t           nr;
+	word_t           end;
+	word_t           ip;
+	word_t           next[2];
+	word_t           i;
+	int              ret;
+
+
+	if (cpu == NULL || path == NULL || addr >= cpu->nr_decoded || size == 0)
 	{
-		cpu->flags.error = 1;
-		return;
+		return -1;
 	}
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1 + 4, &op2);
-	if (ret == -1)
+	end   = (size < cpu->nr_decoded - addr) ? addr + size : cpu->nr_decoded;
+	work  = (word_t *)malloc((end - addr) * sizeof(word_t));
+	seen  = (byte_t *)calloc(end - addr, sizeof(byte_t));
+	insns = (aot_insn_t *)malloc((end - addr) * sizeof(aot_insn_t));
+	if (work == NULL || seen == NULL || insns == NULL)
 	{
-		cpu->flags.error = 1;
-		return;
+		free(work);
+		free(seen);
+		free(insns);
+		return -1;
 	}
 
-	switch (am)
+	/*
+	 *   Follow the code the way the verifier does; seen marks
+	 *   addresses queued (1) and commands taken (2)
+	 */
+	work[0] = addr;
+	seen[0] = 1;
+	nr_work = 1;
+	while (nr_work > 0)
 	{
-	case MODE_REGISTER_MEMORY:
-		ret = cpu_mem_read_word(cpu, op2, &aux);
-		if (ret == -1)
+		ip = work[--nr_work];
+		if (ip + CMD_MAX_LENGTH > cpu->nr_decoded || !cpu_code_fetchable(cpu, ip, CMD_MAX_LENGTH))
 		{
-			cpu->flags.error = 1;
-			return;
+			continue;
 		}
-		cpu_reg_read(cpu, op1, &reg);
-
-		aux = reg * aux;
 
-		ret = cpu_mem_write_word(cpu, op2, aux);
-		if (ret == -1)
+		insn = cpu_decode(cpu, ip);
+		if (insn == NULL || ip + insn->length > end)
 		{
-			cpu->flags.error = 1;
-			return;
+			continue;
 		}
-		break;
 
-	case MODE_REGISTER_REGISTER:
-		cpu_reg_read(cpu, op1, &reg);
-		cpu_reg_read(cpu, op2, &aux);
-		aux = reg * aux;
-		cpu_reg_write(cpu, op2, aux);
-		break;
+		seen[ip - addr] = 2;
 
-	case MODE_MEMORY_REGISTER:
-		ret = cpu_mem_read_word(cpu, op1, &aux);
-		if (ret == -1)
+		cpu_code_next(insn, ip, end, next);
+		for (i = 0; i < 2; i++)
 		{
-			cpu->flags.error = 1;
-			return;
+			if (next[i] >= addr && next[i] < end && !seen[next[i] - addr])
+			{
+				seen[next[i] - addr] = 1;
+				work[nr_work++] = next[i];
+			}
 		}
-		cpu_reg_read(cpu, op2, &reg);
-		reg = aux * reg;
-		cpu_reg_write(cpu, op2, reg);
-		break;
+	}
 
-	case MODE_IMMEDIATE_MEMORY:
-		ret = cpu_mem_read_word(cpu, op2, &aux);
-		if (ret == -1)
+	/*
+	 *   Commands in address order. Overlapping ones (a branch into
+	 *   the middle of a command) are left to the interpreter.
+	 */
+	nr = 0;
+	for (ip = addr; ip < end; ip++)
+	{
+		if (seen[ip - addr] != 2)
 		{
-			cpu->flags.error = 1;
-			return;
+			continue;
 		}
-		aux = op1 * aux;
 
-		ret = cpu_mem_write_word(cpu, op2, aux);
-		if (ret == -1)
+		insn = cpu_decode(cpu, ip);
+		if (insn == NULL || (nr > 0 && ip < insns[nr - 1].addr + insns[nr - 1].length))
 		{
-			cpu->flags.error = 1;
-			return;
+			continue;
 		}
-		break;
 
-	case MODE_IMMEDIATE_REGISTER:
-		cpu_reg_read(cpu, op2, &reg);
-		reg = op1 * reg;
-		cpu_reg_write(cpu, op2, reg);
-		break;
+		insns[nr].addr    = ip;
+		insns[nr].op1     = insn->op1;
+		insns[nr].op2     = insn->op2;
+		insns[nr].handler = insn->handler;
+		insns[nr].length  = insn->length;
+		nr++;
+	}
 
-	default:
-		cpu->flags.error = 1;
-		break;
-	} /* switch */
+	ret = aot_emit(path, insns, nr, addr, cpu->arena.bytes + addr, end - addr, cpu->nr_decoded);
 
-	cpu->registers.ip.data += (1 + 1 + 4 + 4);
+	free(work);
+	free(seen);
+	free(insns);
+
+	return ret;
 }
 
-static void my_div(cpu_t *cpu)
+/*
+ *   Attach a module built from cpu_aot_emit() output, replacing the
+ *   one attached. The module must have been made from the code in
+ *   memory now, for a memory of this size; it is run by the CPU_ENGINE_AOT engine until that
+ *   code is written to.
+ */
+int cpu_aot_attach(cpu_t *cpu, const char *so)
 {
-	int    ret;
-	byte_t am;
-	word_t op1;
-	word_t op2;
-	word_t reg;
-	word_t aux;
+	const byte_t *image;
+	aot_t        *aot;
+	word_t       addr;
+	word_t       size;
+	word_t       memory;
 
 
 	if (cpu == NULL)
 	{
-		return;
+		return -1;
 	}
 
-	ret = cpu_mem_read_byte(cpu, cpu->registers.ip.data + 1, &am);
-	if (ret == -1)
+	aot = aot_load(so);
+	if (aot == NULL)
 	{
-		cpu->flags.error = 1;
-		return;
+		return -1;
 	}
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1, &op1);
-	if (ret == -1)
+	if (aot_image(aot, &addr, &size, &image, &memory) == -1 || memory != cpu->nr_decoded ||
+	    addr >= cpu->nr_decoded || size > cpu->nr_decoded - addr || !cpu_code_fetchable(cpu, addr, size) ||
+	    memcmp(cpu->arena.bytes + addr, image, size) != 0)
 	{
-		cpu->flags.error = 1;
-		return;
+		aot_free(aot);
+		return -1;
 	}
 
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data + 1 + 1 + 4, &op2);
-	if (ret == -1)
+	if (cpu->aot != NULL)
 	{
-		cpu->flags.error = 1;
-		return;
+		aot_free(cpu->aot);
 	}
 
-	switch (am)
-	{
-	case MODE_REGISTER_MEMORY:
-		ret = cpu_mem_read_word(cpu, op2, &aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		cpu_reg_read(cpu, op1, &reg);
-
-		aux = reg / aux;
-
-		ret = cpu_mem_write_word(cpu, op2, aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		break;
+	cpu->aot      = aot;
+	cpu->aot_lo   = addr;
+	cpu->aot_hi   = addr + size;
+	cpu->aot_live = 1;
+	cpu_code_track(cpu, cpu->aot_lo, cpu->aot_hi);
+
+	cpu->aot_env.regs    = cpu->regs;
+	cpu->aot_env.cmp     = cpu->flags.cmp;
+	cpu->aot_env.error   = &cpu->flags.error;
+	cpu->aot_env.halt    = &cpu->flags.halt;
+	cpu->aot_env.budget  = &cpu->budget;
+	cpu->aot_env.stop    = &cpu->stop;
+	cpu->aot_env.bytes   = cpu->arena.bytes;
+	cpu->aot_env.ctx     = cpu;
+	cpu->aot_env.store   = cpu_aot_store;
+	cpu->aot_env.load_lo = &cpu->load_lo;
+	cpu->aot_env.load_hi = &cpu->load_hi;
+	cpu->aot_env.load    = cpu_aot_load;
 
-	case MODE_REGISTER_REGISTER:
-		cpu_reg_read(cpu, op1, &reg);
-		cpu_reg_read(cpu, op2, &aux);
-		aux = reg / aux;
-		cpu_reg_write(cpu, op2, aux);
-		break;
+	return 0;
+}
 
-	case MODE_MEMORY_REGISTER:
-		ret = cpu_mem_read_word(cpu, op1, &aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		cpu_reg_read(cpu, op2, &reg);
-		reg = aux / reg;
-		cpu_reg_write(cpu, op2, reg);
-		break;
+/*
+ *   Run with the given budget. Returns what the engine returned;
+ *   a stop request ends one run.
+ */
+static int cpu_run_for(cpu_t *cpu, long budget, word_t *executed)
+{
+	int ret;
 
-	case MODE_IMMEDIATE_MEMORY:
-		ret = cpu_mem_read_word(cpu, op2, &aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		aux = op1 / aux;
 
-		ret = cpu_mem_write_word(cpu, op2, aux);
-		if (ret == -1)
-		{
-			cpu->flags.error = 1;
-			return;
-		}
-		break;
+	if (cpu == NULL)
+	{
+		return -1;
+	}
 
-	case MODE_IMMEDIATE_REGISTER:
-		cpu_reg_read(cpu, op2, &reg);
-		reg = op1 / reg;
-		cpu_reg_write(cpu, op2, reg);
-		break;
+	cpu->budget = budget;
+	ret = cpu->run(cpu);
 
-	default:
-		cpu->flags.error = 1;
-		break;
-	} /* switch */
+	if (executed != NULL)
+	{
+		*executed = (word_t)(budget - cpu->budget);
+	}
 
-	cpu->registers.ip.data += (1 + 1 + 4 + 4);
+	return ret;
 }
 
 /*
- *   Implementations (CPU)
+ *   Run until halt. Returns 0, 1 when stopped by cpu_request_stop(),
+ *   -1 on error.
  */
-
-cpu_t* cpu_init(mem_t *mem, io_t *io)
+int cpu_run(cpu_t *cpu)
 {
-	cpu_t  *cpu;
-	word_t rc;
+	return cpu_run_for(cpu, LONG_MAX, NULL);
+}
 
+/*
+ *   Run until about `max` commands are done. The budget is checked
+ *   between blocks and loop iterations, so the run may go up to one
+ *   of them past it. Returns 0 on
+ *   halt, 1 when the budget was used up or a stop was requested
+ *   (the next run goes on from there), -1 on error. `executed`, if
+ *   given, gets the number of commands run.
+ */
+int cpu_run_budget(cpu_t *cpu, word_t max, word_t *executed)
+{
+	return cpu_run_for(cpu, (long)max, executed);
+}
 
-	if (mem == NULL || io == NULL)
+/*
+ *   Make the run in progress (or the next one) return 1 at its
+ *   next block boundary. Safe to call from any thread or from a
+ *   signal handler.
+ */
+int cpu_request_stop(cpu_t *cpu)
+{
+	if (cpu == NULL)
 	{
-		return NULL;
+		return -1;
 	}
 
-	cpu = (cpu_t *)malloc(sizeof(*cpu));
+	__atomic_store_n(&cpu->stop, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int cpu_next_command(cpu_t *cpu)
+{
+	const cpu_insn_t *insn;
+
+
 	if (cpu == NULL)
 	{
-		return NULL;
+		return -1;
 	}
 
 	/*
-	 *   Initialize the CPU state structure
-	 */
-	cpu->mem  = mem;
-	cpu->io   = io;
-
-	/*
-	 *   Initialize flags
-	 */
-	memset(&cpu->flags, 0, sizeof(cpu->flags));
-
-	/*
-	 *   Initialize registers
+	 *   Fetch the (predecoded) command
 	 */
-	memset(&cpu->registers, 0, sizeof(cpu->registers));
+	insn = cpu_decode(cpu, cpu->regs[ISA_REG_IP]);
+	if (insn == NULL)
+	{
+		cpu->flags.error = 1;
+		return -1;
+	}
 
 	/*
-	 *   Assign register codes
+	 *   Execute the command alone, even if it starts a
+	 *   superinstruction. Undefined opcodes land in the
+	 *   trap executor.
 	 */
-	cpu->registers.ip.code = 0x00;
-	cpu->registers.sp.code = 0x01;
-	for (rc = 0x00; rc < 0x10; rc++)
-	{
-		cpu->registers.g[rc].code = 0x02 + rc;
-	}
+	return executors[insn->handler](cpu, insn);
+}
 
-	cpu->cmd_tbl = (cmd_t *)malloc(sizeof(cmd_t) * NR_COMMANDS);
-	if (cpu->cmd_tbl == NULL)
+int cpu_invalidate(cpu_t *cpu, word_t addr, word_t size)
+{
+	if (cpu == NULL)
 	{
-		free(cpu);
-		return NULL;
+		return -1;
 	}
 
-	cpu->nr_cmds = NR_COMMANDS;
+	cpu_code_invalidate(cpu, addr, size);
 
-	cpu->cmd_tbl[0].opcode = 0x01;
-	cpu->cmd_tbl[0].exec   = add;
-
-	cpu->cmd_tbl[1].opcode = 0x02;
-	cpu->cmd_tbl[1].exec   = sub;
+	return 0;
+}
 
-	cpu->cmd_tbl[2].opcode = 0x03;
-	cpu->cmd_tbl[2].exec   = jump;
+/*
+ *   Set the attributes of guest pages (see mem_protect()). Code cached
+ *   from pages losing X, or gaining W it did not have, is dropped;
+ *   stores to pages losing W, and loads from pages losing R, fail
+ *   from then on. Pages losing R or W void every verification mark,
+ *   as any command may have an operand on them.
+ */
+int cpu_protect(cpu_t *cpu, word_t addr, word_t size, int attrs)
+{
+	int all;
+	int any;
+	int ret;
 
-	cpu->cmd_tbl[3].opcode = 0x04;
-	cpu->cmd_tbl[3].exec   = halt;
 
-	cpu->cmd_tbl[4].opcode = 0x05;
-	cpu->cmd_tbl[4].exec   = mov;
+	if (cpu == NULL || mem_get_attrs(cpu->mem, addr, size, &all, &any) == -1)
+	{
+		return -1;
+	}
 
-	cpu->cmd_tbl[5].opcode = 0x06;
-	cpu->cmd_tbl[5].exec   = cmp;
+	ret = mem_protect(cpu->mem, addr, size, attrs);
+	if (ret == -1)
+	{
+		return -1;
+	}
 
-	cpu->cmd_tbl[6].opcode = 0x07;
-	cpu->cmd_tbl[6].exec   = jg;
+	if (!(attrs & MEM_ATTR_X) || ((attrs & MEM_ATTR_W) && !(all & MEM_ATTR_W)))
+	{
+		cpu_code_invalidate(cpu, addr, size);
+	}
 
-	cpu->cmd_tbl[7].opcode = 0x08;
-	cpu->cmd_tbl[7].exec   = je;
+	if (!(attrs & MEM_ATTR_W))
+	{
+		cpu_code_watch(cpu, addr, addr + size, WATCH_CLOSED);
+	}
 
-	cpu->cmd_tbl[8].opcode = 0x09;
-	cpu->cmd_tbl[8].exec   = my_mul;
+	if (!(attrs & MEM_ATTR_R))
+	{
+		cpu_code_watch(cpu, addr, addr + size, WATCH_UNREAD);
+	}
 
-	cpu->cmd_tbl[9].opcode = 0x0a;
-	cpu->cmd_tbl[9].exec   = my_div;
+	if ((attrs & (MEM_ATTR_R | MEM_ATTR_W)) != (MEM_ATTR_R | MEM_ATTR_W))
+	{
+		cpu_verify_drop(cpu);
+	}
 
-	return cpu;
+	return 0;
 }
 
-int cpu_free(cpu_t *cpu)
+int cpu_get_stats(cpu_t *cpu, cpu_stats_t *stats)
 {
-	if (cpu == NULL)
+	if (cpu == NULL || stats == NULL)
 	{
 		return -1;
 	}
 
-	/*
-	 *   Free CPU state structure items
-	 */
-	/* TODO */
-
-	free(cpu);
+	*stats = cpu->stats;
 
 	return 0;
 }
 
-int cpu_poweron(cpu_t *cpu)
+int cpu_set_tier_thresholds(cpu_t *cpu, word_t threaded, word_t native)
 {
-	if (cpu == NULL)
+	if (cpu == NULL || threaded > native)
 	{
 		return -1;
 	}
 
+	cpu->thresholds[CPU_TIER_THREADED] = threaded;
+	cpu->thresholds[CPU_TIER_NATIVE]   = native;
+
 	return 0;
 }
 
-int cpu_load_code(cpu_t *cpu, word_t addr, byte_t *code, word_t size)
+int cpu_get_tier_stats(cpu_t *cpu, cpu_tier_stats_t *stats)
 {
-	word_t i;
-
-
-	for (i = 0; i < size; i++)
+	if (cpu == NULL || stats == NULL)
 	{
-		cpu_mem_write_byte(cpu, addr + i, code[i]);
+		return -1;
 	}
 
+	*stats = cpu->tier_stats;
+
 	return 0;
 }
 
-int cpu_run(cpu_t *cpu)
+int cpu_get_ip(cpu_t *cpu, word_t *ip)
 {
-	int ret;
-
-
 	if (cpu == NULL)
 	{
 		return -1;
 	}
 
-	while (!cpu->flags.halt)
-	{
-		ret = cpu_next_command(cpu);
-		if (ret == -1)
-		{
-			return -1;
-		}
-	}
-
-	cpu->flags.halt = 1;
+	*ip = cpu->regs[ISA_REG_IP];
 
 	return 0;
 }
 
-int cpu_next_command(cpu_t *cpu)
+/*
+ *   Bytes of memory the CPU addresses
+ */
+int cpu_get_mem_size(cpu_t *cpu, word_t *size)
 {
-	int        i;
-	mem_word_t word;
-	byte_t     opcode;
-	int        ret;
-
-
-	if (cpu == NULL)
+	if (cpu == NULL || size == NULL)
 	{
 		return -1;
 	}
 
-	/*
-	 *   Fetch a command (opcode) from memory
-	 */
-	ret = cpu_mem_read_word(cpu, cpu->registers.ip.data, &word.w);
-	if (ret == -1)
+	*size = cpu->nr_decoded;
+
+	return 0;
+}
+
+int cpu_get_state(cpu_t *cpu, cpu_state_t *state)
+{
+	if (cpu == NULL || state == NULL)
 	{
-		cpu->flags.error = 1;
 		return -1;
 	}
 
-	opcode = word.bytes[0];
+	memcpy(state->regs, cpu->regs, sizeof(state->regs));
+	state->cmp[0] = cpu->flags.cmp[0];
+	state->cmp[1] = cpu->flags.cmp[1];
+	state->halt   = cpu->flags.halt;
+	state->error  = cpu->flags.error;
 
-	/*
-	 *   Find opcode's executer
-	 */
-	for (i = 0; i < cpu->nr_cmds; i++)
-	{
-		if (cpu->cmd_tbl[i].opcode == opcode)
-		{
-			break;
-		}
-	}
+	return 0;
+}
 
-	/*
-	 *   Command with the opcode was not found...
-	 */
-	if (i == cpu->nr_cmds)
+/*
+ *   Load the state; the next run goes on from it
+ */
+int cpu_set_state(cpu_t *cpu, const cpu_state_t *state)
+{
+	if (cpu == NULL || state == NULL)
 	{
-		cpu->flags.error = 1;
 		return -1;
 	}
 
-	/*
-	 *   Execute the command
-	 */
-	cpu->cmd_tbl[i].exec(cpu);
+	memcpy(cpu->regs, state->regs, sizeof(cpu->regs));
+	cpu->flags.cmp[0] = state->cmp[0];
+	cpu->flags.cmp[1] = state->cmp[1];
+	cpu->flags.halt   = state->halt;
+	cpu->flags.error  = state->error;
 
 	return 0;
 }
 
-int cpu_get_ip(cpu_t *cpu, word_t *ip)
+/*
+ *   Decode the command at the address (from the predecoded tables
+ *   when it is there). Returns -1 when it runs past memory.
+ */
+int cpu_get_command(cpu_t *cpu, word_t addr, cpu_command_t *cmd)
 {
-	if (cpu == NULL)
+	const cpu_insn_t *insn;
+
+
+	if (cpu == NULL || cmd == NULL)
+	{
+		return -1;
+	}
+
+	insn = cpu_decode(cpu, addr);
+	if (insn == NULL)
 	{
 		return -1;
 	}
 
-	*ip = cpu->registers.ip.data;
+	cmd->op1     = insn->op1;
+	cmd->op2     = insn->op2;
+	cmd->handler = insn->handler;
+	cmd->mode    = insn->mode;
+	cmd->length  = insn->length;
 
 	return 0;
 }
@@ -1281,13 +3115,13 @@ int cpu_dump(cpu_t *cpu)
 	printf("Flags:\n");
 	printf("\tHALT   : 0x%02x\n", cpu->flags.halt);
 	printf("\tERROR  : 0x%02x\n", cpu->flags.error);
-	printf("\tEQU    : 0x%02x\n", cpu->flags.equ);
-	printf("\tGREATER: 0x%02x\n", cpu->flags.greater);
+	printf("\tEQU    : 0x%02x\n", ISA_FLAG_EQU(cpu->flags.cmp[0], cpu->flags.cmp[1]));
+	printf("\tGREATER: 0x%02x\n", ISA_FLAG_GREATER(cpu->flags.cmp[0], cpu->flags.cmp[1]));
 	printf("Registers:\n");
-	printf("\tIP: 0x%08x\n", cpu->registers.ip.data);
+	printf("\tIP: 0x%08x\n", cpu->regs[ISA_REG_IP]);
 	for (r = 0x0; r < 0x10; r++)
 	{
-		printf("\tg%d: 0x%08x\n", r, cpu->registers.g[r].data);
+		printf("\tg%d: 0x%08x\n", r, cpu->regs[ISA_REG_G0 + r]);
 	}
 
 	return 0;
@@ -12,7 +12,8 @@
 /*
  *   Constants
  */
-#define NR_COMMANDS 10
+#define NR_OPCODES 256 /* Opcodes are one byte wide */
+#define CPU_NR_REGS 18 /* Register codes: IP, SP, g0 - g15 */
 
 /*
  *   Types
@@ -20,16 +21,100 @@
 typedef struct _cpu_t cpu_t;
 typedef struct _cmd_t cmd_t;
 
+typedef enum
+{
+	CPU_ENGINE_PORTABLE, /* One executor call per command           */
+	CPU_ENGINE_THREADED, /* Computed goto dispatch (GCC compilers) */
+	CPU_ENGINE_JIT,      /* Native code (x86-64 Linux hosts)       */
+	CPU_ENGINE_TIERED,   /* Each block on the tier its use earns   */
+	CPU_ENGINE_AOT       /* Attached ahead-of-time module          */
+} cpu_engine_t;
+
+/*
+ *   Tiers of the tiered engine, slowest to start first
+ */
+typedef enum
+{
+	CPU_TIER_INTERP,     /* One executor call per command          */
+	CPU_TIER_THREADED,   /* Threaded-code engine                   */
+	CPU_TIER_NATIVE,     /* Native code and traces                 */
+	NR_CPU_TIERS
+} cpu_tier_t;
+
+typedef struct _cpu_stats_t
+{
+	word_t decoded; /* Commands decoded into the predecoded tables  */
+	word_t fused;   /* Of them, turned into superinstructions       */
+	word_t blocks;  /* Basic blocks translated                      */
+	word_t flushes; /* Times the block cache was emptied            */
+	word_t native;  /* Blocks compiled to native code               */
+	word_t traces;  /* Hot loops compiled to native traces          */
+	word_t verified;/* Commands proven safe when loaded            */
+} cpu_stats_t;
+
+typedef struct _cpu_tier_stats_t
+{
+	word_t promoted[NR_CPU_TIERS]; /* Blocks promoted to the tier              */
+	word_t runs[NR_CPU_TIERS];     /* Block runs started on the tier           */
+	word_t switches;               /* Runs moved to another tier mid-way (OSR) */
+} cpu_tier_stats_t;
+
+/*
+ *   Architectural state, for moving a run between CPUs
+ */
+typedef struct _cpu_state_t
+{
+	word_t regs[CPU_NR_REGS]; /* Registers indexed by register code */
+	word_t cmp[2];            /* Operands of the last compare       */
+	byte_t halt;              /* Halt flag                          */
+	byte_t error;             /* Error flag                         */
+} cpu_state_t;
+
+/*
+ *   Decoded command, for engines living outside the CPU. The
+ *   handler is an isa.h handler identifier; superinstructions
+ *   are never handed out.
+ */
+typedef struct _cpu_command_t
+{
+	word_t op1;     /* First operand            */
+	word_t op2;     /* Second operand           */
+	byte_t handler; /* Handler identifier       */
+	byte_t mode;    /* Addressing mode          */
+	byte_t length;  /* Command length in bytes  */
+} cpu_command_t;
+
 /*
  *   Prototypes (CPU interface)
  */
 cpu_t* cpu_init        (mem_t *mem, io_t *io);
+cpu_t* cpu_init_with   (mem_t *mem, io_t *io, cpu_engine_t engine);
+cpu_t* cpu_init_at     (void *p, mem_t *mem, io_t *io);
+size_t cpu_footprint   (word_t size);
 int    cpu_free        (cpu_t *cpu);
+int    cpu_set_engine  (cpu_t *cpu, cpu_engine_t engine);
+int    cpu_set_fusion  (cpu_t *cpu, int enable);
 int    cpu_poweron     (cpu_t *cpu);
 int    cpu_load_code   (cpu_t *cpu, word_t addr, byte_t *code, word_t size);
+int    cpu_load_verified(cpu_t *cpu, word_t addr, byte_t *code, word_t size, const byte_t *verified);
+int    cpu_load_memory (cpu_t *cpu, word_t addr, word_t size);
+int    cpu_get_verified(cpu_t *cpu, word_t addr, word_t size, byte_t *verified);
+int    cpu_aot_emit    (cpu_t *cpu, word_t addr, word_t size, const char *path);
+int    cpu_aot_attach  (cpu_t *cpu, const char *so);
 int    cpu_run         (cpu_t *cpu);
+int    cpu_run_budget  (cpu_t *cpu, word_t max, word_t *executed);
+int    cpu_request_stop(cpu_t *cpu);
 int    cpu_next_command(cpu_t *cpu);
+int    cpu_invalidate  (cpu_t *cpu, word_t addr, word_t size);
+int    cpu_protect     (cpu_t *cpu, word_t addr, word_t size, int attrs);
+int    cpu_get_stats   (cpu_t *cpu, cpu_stats_t *stats);
+int    cpu_set_tier_thresholds(cpu_t *cpu, word_t threaded, word_t native);
+int    cpu_get_tier_stats(cpu_t *cpu, cpu_tier_stats_t *stats);
 int    cpu_get_ip      (cpu_t *cpu, word_t *ip);
+int    cpu_get_mem_size(cpu_t *cpu, word_t *size);
+int    cpu_get_state   (cpu_t *cpu, cpu_state_t *state);
+int    cpu_set_state   (cpu_t *cpu, const cpu_state_t *state);
+int    cpu_get_command (cpu_t *cpu, word_t addr, cpu_command_t *cmd);
 int    cpu_dump        (cpu_t *cpu);
 
 #endif /* __CPU_H__ */
@@ -4,6 +4,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "io.h"
 
 /*
@@ -12,6 +13,7 @@
 struct _io_t
 {
 	word_t a;
+	int    embedded; /* Lives in a block of the caller's (io_init_at) */
 };
 
 /*
@@ -34,6 +36,40 @@ io_t* io_init(void)
 	 *   Initialize IO state structure
 	 */
 	/* TODO */
+	io->embedded = 0;
+
+	return io;
+}
+
+/*
+ *   Bytes io_init_at() needs, a whole number of cache lines
+ */
+size_t io_footprint(void)
+{
+	return CACHE_ALIGN(sizeof(io_t));
+}
+
+/*
+ *   IO in a block of the caller's: io_footprint() bytes at `p`,
+ *   aligned to a cache line. io_free() leaves the block to the caller.
+ */
+io_t* io_init_at(void *p)
+{
+	io_t *io;
+
+
+	if (p == NULL || (uintptr_t)p % CACHE_LINE != 0)
+	{
+		return NULL;
+	}
+
+	io = (io_t *)p;
+
+	/*
+	 *   Initialize IO state structure
+	 */
+	io->a        = 0;
+	io->embedded = 1;
 
 	return io;
 }
@@ -50,7 +86,10 @@ int io_free(io_t *io)
 	 */
 	/* TODO */
 
-	free(io);
+	if (!io->embedded)
+	{
+		free(io);
+	}
 
 	return 0;
 }
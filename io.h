@@ -5,6 +5,7 @@
 /*
  *   Includes
  */
+#include <stddef.h>
 #include "types.h"
 
 /*
@@ -16,6 +17,8 @@ typedef struct _io_t io_t;
  *   Prototypes
  */
 io_t* io_init (void);
+io_t* io_init_at(void *p);
+size_t io_footprint(void);
 int   io_free (io_t *io);
 int   io_read (io_t *io, void *buf, word_t size);
 int   io_write(io_t *io, void *buf, word_t size);
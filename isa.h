@@ -0,0 +1,256 @@
+
+#ifndef __ISA_H__
+#define __ISA_H__
+
+/*
+ *   Includes
+ */
+#include "types.h"
+
+/*
+ *   Instruction set tables. Every engine expands these to get one
+ *   handler per (command, addressing mode) pair, so the semantics
+ *   of a command are written down exactly once.
+ */
+
+/*
+ *   Two-operand commands: name, opcode, class, result of the
+ *   operation on the first (a) and second (b) operands and the
+ *   condition that faults the command.
+ *
+ *   ALU - the result is stored to the second operand
+ *   MOV - the first operand is stored to the second one
+ *   CMP - the operands are compared, flags are set
+ */
+#define ISA_BINARY_OPS(X)                                      \
+	X(add, 0x01, ALU, a + b, 0     )                       \
+	X(sub, 0x02, ALU, a - b, 0     )                       \
+	X(mov, 0x05, MOV, a,     0     )                       \
+	X(cmp, 0x06, CMP, a,     0     )                       \
+	X(mul, 0x09, ALU, a * b, 0     )                       \
+	X(div, 0x0a, ALU, a / b, b == 0)
+
+/*
+ *   Branch commands: name, opcode, branch condition
+ */
+#define ISA_JUMP_OPS(X)                                        \
+	X(jump, 0x03, 1          )                             \
+	X(jg,   0x07, ISA_GREATER)                             \
+	X(je,   0x08, ISA_EQU    )
+
+#define ISA_HALT_OPCODE 0x04
+
+/*
+ *   Addressing modes accepted by two-operand and branch commands
+ */
+#define ISA_BINARY_MODES(X, ...)                               \
+	X(reg_mem, MODE_REGISTER_MEMORY,    __VA_ARGS__)       \
+	X(reg_reg, MODE_REGISTER_REGISTER,  __VA_ARGS__)       \
+	X(mem_reg, MODE_MEMORY_REGISTER,    __VA_ARGS__)       \
+	X(imm_mem, MODE_IMMEDIATE_MEMORY,   __VA_ARGS__)       \
+	X(imm_reg, MODE_IMMEDIATE_REGISTER, __VA_ARGS__)
+
+#define ISA_JUMP_MODES(X, ...)                                 \
+	X(reg, MODE_REGISTER,  __VA_ARGS__)                    \
+	X(mem, MODE_MEMORY,    __VA_ARGS__)                    \
+	X(imm, MODE_IMMEDIATE, __VA_ARGS__)
+
+#define NR_MODES (MODE_IMMEDIATE_REGISTER + 1)
+
+#define ISA_OP1_IS_REG(am) ((am) == MODE_REGISTER ||                    \
+			    (am) == MODE_REGISTER_MEMORY ||             \
+			    (am) == MODE_REGISTER_REGISTER)
+#define ISA_OP2_IS_REG(am) ((am) == MODE_REGISTER_REGISTER ||           \
+			    (am) == MODE_MEMORY_REGISTER ||             \
+			    (am) == MODE_IMMEDIATE_REGISTER)
+#define ISA_OP1_IS_MEM(am) ((am) == MODE_MEMORY ||                      \
+			    (am) == MODE_MEMORY_REGISTER)
+#define ISA_OP2_IS_MEM(am) ((am) == MODE_REGISTER_MEMORY ||             \
+			    (am) == MODE_IMMEDIATE_MEMORY)
+
+/*
+ *   Condition flags are not stored. A compare records its two
+ *   operands and a branch derives the flag it tests from them, so
+ *   compares cost two register moves. Flags of a richer set (sign,
+ *   carry, overflow of a - b) are derived the same way, and commands
+ *   that do not set flags are not slowed down by them.
+ */
+#define ISA_FLAG_EQU(a, b)     ((a) == (b))
+#define ISA_FLAG_GREATER(a, b) ((a) > (b))
+
+/*
+ *   Register codes. The register file is indexed by them directly;
+ *   IP may be read like any register but is only changed by branches.
+ */
+#define ISA_REG_IP   0x00                 /* Instruction pointer */
+#define ISA_REG_SP   0x01                 /* Stack pointer       */
+#define ISA_REG_G0   0x02                 /* g0 - g15            */
+#define NR_REGISTERS (ISA_REG_G0 + 0x10)
+
+#define ISA_LENGTH_BINARY (1 + 1 + 4 + 4) /* Opcode, mode, two operands */
+#define ISA_LENGTH_JUMP   (1 + 1 + 4)     /* Opcode, mode, one operand  */
+#define ISA_LENGTH_HALT   (1)             /* Opcode                     */
+
+/*
+ *   Handler identifiers
+ */
+#define ISA_HANDLER_ID(mode, am, name, ...) ISA_H_##name##_##mode,
+#define ISA_BINARY_IDS(name, opcode, class, expr, fault) ISA_BINARY_MODES(ISA_HANDLER_ID, name)
+#define ISA_JUMP_IDS(name, opcode, cond) ISA_JUMP_MODES(ISA_HANDLER_ID, name)
+
+/*
+ *   Superinstructions: pairs of commands run by one handler
+ *
+ *   cmp_<mode>_<branch> - cmp followed by jg/je with an immediate target
+ *   movi_<name>_<mode>  - mov $imm gN followed by any two-operand command
+ */
+#define ISA_CMP_BRANCHES(X, ...)                               \
+	X(jg, ISA_GREATER, __VA_ARGS__)                        \
+	X(je, ISA_EQU,     __VA_ARGS__)
+
+#define ISA_CMP_BRANCH_ID(branch, cond, mode) ISA_H_cmp_##mode##_##branch,
+#define ISA_CMP_BRANCH_IDS(mode, am, ...) ISA_CMP_BRANCHES(ISA_CMP_BRANCH_ID, mode)
+#define ISA_MOVI_ID(mode, am, name, ...) ISA_H_movi_##name##_##mode,
+#define ISA_MOVI_IDS(name, opcode, class, expr, fault) ISA_BINARY_MODES(ISA_MOVI_ID, name)
+
+typedef enum
+{
+	ISA_H_bad_mode, /* Addressing mode or register not accepted    */
+	ISA_H_trap,     /* Undefined opcode                            */
+	ISA_H_halt,
+	ISA_BINARY_OPS(ISA_BINARY_IDS)
+	ISA_JUMP_OPS(ISA_JUMP_IDS)
+	ISA_BINARY_MODES(ISA_CMP_BRANCH_IDS, cmp)
+	ISA_BINARY_OPS(ISA_MOVI_IDS)
+	NR_HANDLERS
+} isa_handler_t;
+
+/*
+ *   Command bodies. The engine expanding them provides the state
+ *   accessors below and names the command being executed `insn`
+ *   (fields op1, op2 and length):
+ *
+ *   ISA_IP                 - instruction pointer (lvalue)
+ *   ISA_REG_GET(code, v)   - read register into v
+ *   ISA_REG_SET(code, v)   - write v to register
+ *   ISA_MEM_GET(addr, v)   - read memory word into v
+ *   ISA_MEM_SET(addr, v)   - write v to memory word
+ *   ISA_COMPARE(a, b)      - record the operands of a compare
+ *   ISA_EQU, ISA_GREATER   - flag values (ISA_FLAG_* of the recorded operands)
+ *   ISA_ERROR()            - raise the error flag
+ *   ISA_NEXT               - the command following `insn` (superinstructions)
+ */
+
+/*
+ *   First operand (a), second operand (b), destination (d) and
+ *   branch target (t) per addressing mode
+ */
+#define ISA_A_reg_mem(v) ISA_REG_GET(insn->op1, v)
+#define ISA_A_reg_reg(v) ISA_REG_GET(insn->op1, v)
+#define ISA_A_mem_reg(v) ISA_MEM_GET(insn->op1, v)
+#define ISA_A_imm_mem(v) (v) = insn->op1
+#define ISA_A_imm_reg(v) (v) = insn->op1
+
+#define ISA_B_reg_mem(v) ISA_MEM_GET(insn->op2, v)
+#define ISA_B_reg_reg(v) ISA_REG_GET(insn->op2, v)
+#define ISA_B_mem_reg(v) ISA_REG_GET(insn->op2, v)
+#define ISA_B_imm_mem(v) ISA_MEM_GET(insn->op2, v)
+#define ISA_B_imm_reg(v) ISA_REG_GET(insn->op2, v)
+
+#define ISA_D_reg_mem(v) ISA_MEM_SET(insn->op2, v)
+#define ISA_D_reg_reg(v) ISA_REG_SET(insn->op2, v)
+#define ISA_D_mem_reg(v) ISA_REG_SET(insn->op2, v)
+#define ISA_D_imm_mem(v) ISA_MEM_SET(insn->op2, v)
+#define ISA_D_imm_reg(v) ISA_REG_SET(insn->op2, v)
+
+#define ISA_T_reg(v)     ISA_REG_GET(insn->op1, v)
+#define ISA_T_mem(v)     ISA_MEM_GET(insn->op1, v)
+#define ISA_T_imm(v)     (v) = insn->op1
+
+#define ISA_BODY_ALU(mode, expr, fault)                        \
+	{                                                      \
+		word_t a;                                      \
+		word_t b;                                      \
+		                                               \
+		ISA_A_##mode(a);                               \
+		ISA_B_##mode(b);                               \
+		if (fault)                                     \
+		{                                              \
+			ISA_ERROR();                           \
+		}                                              \
+		else                                           \
+		{                                              \
+			ISA_D_##mode(expr);                    \
+		}                                              \
+		ISA_IP += insn->length;                        \
+	}
+
+#define ISA_BODY_MOV(mode, expr, fault)                        \
+	{                                                      \
+		word_t a;                                      \
+		                                               \
+		ISA_A_##mode(a);                               \
+		ISA_D_##mode(expr);                            \
+		ISA_IP += insn->length;                        \
+	}
+
+#define ISA_BODY_CMP(mode, expr, fault)                        \
+	{                                                      \
+		word_t a;                                      \
+		word_t b;                                      \
+		                                               \
+		ISA_A_##mode(a);                               \
+		ISA_B_##mode(b);                               \
+		ISA_COMPARE(a, b);                             \
+		ISA_IP += insn->length;                        \
+	}
+
+#define ISA_BODY_JUMP(mode, cond)                              \
+	if (cond)                                              \
+	{                                                      \
+		word_t t;                                      \
+		                                               \
+		ISA_T_##mode(t);                               \
+		ISA_IP = t;                                    \
+	}                                                      \
+	else                                                   \
+	{                                                      \
+		ISA_IP += insn->length;                        \
+	}
+
+/*
+ *   Superinstruction bodies. The second command of the pair is
+ *   ISA_NEXT; the pair always starts at ISA_IP.
+ */
+#define ISA_BODY_CMP_BRANCH(mode, cond)                        \
+	{                                                      \
+		const cpu_insn_t *next_ = ISA_NEXT;            \
+		word_t           a;                            \
+		word_t           b;                            \
+		                                               \
+		ISA_A_##mode(a);                               \
+		ISA_B_##mode(b);                               \
+		ISA_COMPARE(a, b);                             \
+		if (cond)                                      \
+		{                                              \
+			ISA_IP = next_->op1;                   \
+		}                                              \
+		else                                           \
+		{                                              \
+			ISA_IP += insn->length + next_->length;\
+		}                                              \
+	}
+
+#define ISA_BODY_MOVI(mode, class, expr, fault)                \
+	{                                                      \
+		const cpu_insn_t *next_ = ISA_NEXT;            \
+		                                               \
+		ISA_BODY_MOV(imm_reg, a, 0)                    \
+		{                                              \
+			const cpu_insn_t *insn = next_;        \
+			                                       \
+			ISA_BODY_##class(mode, expr, fault)    \
+		}                                              \
+	}
+
+#endif /* __ISA_H__ */
@@ -0,0 +1,1692 @@
+
+/*
+ *   Includes
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "types.h"
+#include "isa.h"
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+
+/*
+ *   Constants
+ */
+#define JIT_CODE_SIZE (1 << 20) /* Bytes of native code kept at most         */
+#define JIT_ENTRIES   1024      /* Compiled blocks kept at most              */
+#define JIT_EXITS     4096      /* Block exits waiting to be chained         */
+#define JIT_CACHED    5         /* Guest registers kept on the host (traces) */
+#define JIT_SLICE     65536     /* Commands a trace runs before returning    */
+
+/*
+ *   Host registers
+ */
+#define R_EAX 0
+#define R_ECX 1
+#define R_EDX 2
+#define R_EBX 3
+#define R_EBP 5
+#define R_R10 10
+#define R_R12 12
+#define R_R13 13
+#define R_R14 14
+#define R_R15 15
+
+/*
+ *   Condition codes (second byte of the two-byte jcc)
+ */
+#define CC_E  0x84
+#define CC_NE 0x85
+#define CC_BE 0x86
+#define CC_A  0x87
+#define CC_NS 0x89
+#define CC_G  0x8f
+
+/*
+ *   Budget updates (ModRM reg field of 81 /r)
+ */
+#define JIT_ADD 0
+#define JIT_SUB 5
+
+/*
+ *   Types
+ */
+typedef struct _jit_entry_t
+{
+	word_t addr;         /* Guest address of the block          */
+	byte_t *body;        /* Native code following the prologue  */
+} jit_entry_t;
+
+typedef struct _jit_exit_t
+{
+	word_t target;       /* Guest address the exit leaves to    */
+	byte_t *site;        /* rel32 of the jump to patch          */
+} jit_exit_t;
+
+struct _jit_t
+{
+	jit_env_t   env;
+	byte_t      *code;                 /* Code buffer, executable view       */
+	byte_t      *rw;                   /* The same pages, writable view      */
+	byte_t      *pc;                   /* Emission point                     */
+	byte_t      *limit;                /* End of the buffer                  */
+	int         overflow;              /* Emission ran out of buffer         */
+	int         dry;                   /* Emission discarded (analysis)      */
+	byte_t      *ok;                   /* Shared epilogue returning 0        */
+	byte_t      *fault;                /* Shared epilogue returning -1       */
+	byte_t      *back;                 /* Shared epilogue returning 1        */
+	byte_t      *t_ok;                 /* Trace epilogue returning 0         */
+	byte_t      *t_fault;              /* Trace epilogue returning -1        */
+	jit_entry_t entries[JIT_ENTRIES];  /* Compiled blocks                    */
+	word_t      nr_entries;
+	jit_exit_t  exits[JIT_EXITS];      /* Exits not chained yet              */
+	word_t      nr_exits;
+	word_t      count;                 /* Commands of the block in native code */
+	word_t      done;                  /* Of them, before the one compiled     */
+};
+
+/*
+ *   Compile-time view of the guest registers while a trace is
+ *   compiled. A register known to hold a constant may not have it
+ *   in its host register yet; it is written there only when needed.
+ */
+typedef struct _jit_state_t
+{
+	byte_t cst[NR_REGISTERS];            /* Value known at compile time */
+	word_t val[NR_REGISTERS];
+} jit_state_t;
+
+typedef struct _jit_trace_t
+{
+	const jit_insn_t *insns;
+	word_t           nr;
+	signed char      host[NR_REGISTERS];   /* Host register keeping it, -1 if none */
+	byte_t           written[NR_REGISTERS];/* Changed by the trace                 */
+	byte_t           keep[JIT_TRACE_MAX];  /* cmp whose flags are read later       */
+	jit_state_t      st;
+	int              eflags;               /* Host flags hold the last cmp         */
+	int              pending;              /* ...and the guest flags are not set   */
+	word_t           at;                   /* Command being compiled               */
+} jit_trace_t;
+
+/*
+ *   What a handler does, whatever its addressing mode
+ */
+#define JIT_KIND(name, ...) JIT_K_##name,
+
+typedef enum
+{
+	JIT_K_none,     /* Left to the interpreter */
+	ISA_BINARY_OPS(JIT_KIND)
+	ISA_JUMP_OPS(JIT_KIND)
+} jit_kind_t;
+
+#define JIT_KIND_ENTRY(mode, am, name, ...) [ISA_H_##name##_##mode] = JIT_K_##name,
+#define JIT_BINARY_KINDS(name, opcode, class, expr, fault) ISA_BINARY_MODES(JIT_KIND_ENTRY, name)
+#define JIT_JUMP_KINDS(name, opcode, cond) ISA_JUMP_MODES(JIT_KIND_ENTRY, name)
+
+static const byte_t kinds[NR_HANDLERS] =
+{
+	ISA_BINARY_OPS(JIT_BINARY_KINDS)
+	ISA_JUMP_OPS(JIT_JUMP_KINDS)
+};
+
+/*
+ *   Emission
+ */
+static void jit_byte(jit_t *jit, byte_t b)
+{
+	if (jit->dry)
+	{
+		return;
+	}
+
+	if (jit->pc >= jit->limit)
+	{
+		jit->overflow = 1;
+		return;
+	}
+
+	jit->rw[jit->pc++ - jit->code] = b;
+}
+
+static void jit_bytes(jit_t *jit, const void *bytes, word_t size)
+{
+	word_t i;
+
+
+	for (i = 0; i < size; i++)
+	{
+		jit_byte(jit, ((const byte_t *)bytes)[i]);
+	}
+}
+
+static void jit_word(jit_t *jit, word_t w)
+{
+	jit_bytes(jit, &w, sizeof(w));
+}
+
+static void jit_ptr(jit_t *jit, const void *p)
+{
+	jit_bytes(jit, &p, sizeof(p));
+}
+
+/*
+ *   Point the rel32 at `site` to `target`
+ */
+static void jit_patch(jit_t *jit, byte_t *site, const byte_t *target)
+{
+	int rel;
+
+
+	rel = (int)(target - (site + 4));
+	memcpy(jit->rw + (site - jit->code), &rel, sizeof(rel));
+}
+
+/*
+ *   jmp/jcc rel32 to a known address
+ */
+static void jit_jmp(jit_t *jit, const byte_t *target)
+{
+	jit_byte(jit, 0xe9);
+	jit_word(jit, (word_t)(target - (jit->pc + 4)));
+}
+
+static void jit_jcc(jit_t *jit, byte_t cc, const byte_t *target)
+{
+	jit_byte(jit, 0x0f);
+	jit_byte(jit, cc);
+	jit_word(jit, (word_t)(target - (jit->pc + 4)));
+}
+
+/*
+ *   jcc rel32 forward; returns the rel32 to bind
+ */
+static byte_t* jit_jcc_fwd(jit_t *jit, byte_t cc)
+{
+	byte_t *site;
+
+
+	jit_byte(jit, 0x0f);
+	jit_byte(jit, cc);
+	site = jit->pc;
+	jit_word(jit, 0);
+
+	return site;
+}
+
+static byte_t* jit_jmp_fwd(jit_t *jit)
+{
+	byte_t *site;
+
+
+	jit_byte(jit, 0xe9);
+	site = jit->pc;
+	jit_word(jit, 0);
+
+	return site;
+}
+
+static void jit_bind(jit_t *jit, byte_t *site)
+{
+	if (!jit->overflow && !jit->dry)
+	{
+		jit_patch(jit, site, jit->pc);
+	}
+}
+
+/*
+ *   Displacements from the register file (rbx)
+ */
+static int jit_disp_reg(word_t code)
+{
+	return (int)(code * sizeof(word_t));
+}
+
+static int jit_disp_flag(jit_t *jit, byte_t *flag)
+{
+	return (int)(flag - (byte_t *)jit->env.regs);
+}
+
+static int jit_disp_cmp(jit_t *jit, int i)
+{
+	return (int)((byte_t *)&jit->env.cmp[i] - (byte_t *)jit->env.regs);
+}
+
+/*
+ *   op r32, [rbx + disp32] and friends
+ */
+static void jit_rbx_op(jit_t *jit, byte_t opcode, int r, int disp)
+{
+	if (r >= 8)
+	{
+		jit_byte(jit, 0x44);                    /* REX.R */
+	}
+
+	jit_byte(jit, opcode);
+	jit_byte(jit, 0x80 | ((r & 7) << 3) | R_EBX);
+	jit_word(jit, (word_t)disp);
+}
+
+/*
+ *   Guest flags. The operands of cmp (eax, ecx) are recorded as
+ *   they are; host flags of a cmp whose operands are gone are
+ *   recorded as an equivalent pair, (1, 0) for above, (0, 1) for
+ *   below and (0, 0) for equal. Host flags are left alone.
+ */
+static void jit_cmp_store(jit_t *jit)
+{
+	jit_rbx_op(jit, 0x89, R_EAX, jit_disp_cmp(jit, 0));
+	jit_rbx_op(jit, 0x89, R_ECX, jit_disp_cmp(jit, 1));
+}
+
+static void jit_cmp_spill(jit_t *jit)
+{
+	jit_bytes(jit, "\x0f\x97\xc0", 3);      /* seta al        */
+	jit_bytes(jit, "\x0f\xb6\xc0", 3);      /* movzx eax, al  */
+	jit_rbx_op(jit, 0x89, R_EAX, jit_disp_cmp(jit, 0));
+	jit_bytes(jit, "\x0f\x92\xc0", 3);      /* setb al        */
+	jit_bytes(jit, "\x0f\xb6\xc0", 3);      /* movzx eax, al  */
+	jit_rbx_op(jit, 0x89, R_EAX, jit_disp_cmp(jit, 1));
+}
+
+/*
+ *   Host flags of the recorded compare (clobbers eax)
+ */
+static void jit_cmp_load(jit_t *jit)
+{
+	jit_rbx_op(jit, 0x8b, R_EAX, jit_disp_cmp(jit, 0));
+	jit_rbx_op(jit, 0x3b, R_EAX, jit_disp_cmp(jit, 1));
+}
+
+/*
+ *   add/sub qword [budget], n
+ */
+static void jit_budget(jit_t *jit, int op, word_t n)
+{
+	jit_byte(jit, 0x48);                    /* REX.W */
+	jit_rbx_op(jit, 0x81, op, (int)((byte_t *)jit->env.budget - (byte_t *)jit->env.regs));
+	jit_word(jit, n);
+}
+
+/*
+ *   Traces run on a slice of the budget held in r10, at most
+ *   JIT_SLICE commands, so they come back to the engine (which
+ *   looks for stop requests) often enough. Taking the slice
+ *   clobbers ecx.
+ */
+static void jit_budget_take(jit_t *jit)
+{
+	int disp = (int)((byte_t *)jit->env.budget - (byte_t *)jit->env.regs);
+
+
+	jit_byte(jit, 0x4c);                    /* mov r10, [budget] */
+	jit_rbx_op(jit, 0x8b, R_R10 & 7, disp);
+	jit_byte(jit, 0xb9);                    /* mov ecx, JIT_SLICE */
+	jit_word(jit, JIT_SLICE);
+	jit_bytes(jit, "\x49\x39\xca", 3);      /* cmp r10, rcx       */
+	jit_bytes(jit, "\x4c\x0f\x4f\xd1", 4);  /* cmovg r10, rcx     */
+	jit_byte(jit, 0x4c);                    /* sub [budget], r10  */
+	jit_rbx_op(jit, 0x29, R_R10 & 7, disp);
+}
+
+static void jit_budget_give(jit_t *jit)
+{
+	jit_byte(jit, 0x4c);                    /* add [budget], r10  */
+	jit_rbx_op(jit, 0x01, R_R10 & 7, (int)((byte_t *)jit->env.budget - (byte_t *)jit->env.regs));
+}
+
+static void jit_budget_sub(jit_t *jit, word_t n)
+{
+	jit_bytes(jit, "\x49\x81\xea", 3);      /* sub r10, imm32     */
+	jit_word(jit, n);
+}
+
+static void jit_set_ip(jit_t *jit, word_t ip)
+{
+	/*
+	 *   mov dword [rbx + IP], imm32
+	 */
+	jit_rbx_op(jit, 0xc7, 0, jit_disp_reg(ISA_REG_IP));
+	jit_word(jit, ip);
+}
+
+static void jit_call(jit_t *jit, const void *fn)
+{
+	/*
+	 *   mov rdi, ctx; mov rax, fn; call rax
+	 */
+	jit_byte(jit, 0x48);
+	jit_byte(jit, 0xbf);
+	jit_ptr(jit, jit->env.ctx);
+	jit_byte(jit, 0x48);
+	jit_byte(jit, 0xb8);
+	jit_ptr(jit, fn);
+	jit_byte(jit, 0xff);
+	jit_byte(jit, 0xd0);
+}
+
+/*
+ *   Leave with IP at the command, giving back the budget taken for
+ *   it and the commands following it
+ */
+static void jit_fault(jit_t *jit, word_t ip)
+{
+	jit_budget(jit, JIT_ADD, jit->count - jit->done);
+	jit_set_ip(jit, ip);
+	jit_jmp(jit, jit->fault);
+}
+
+/*
+ *   Leave the command at `from` to a constant guest address,
+ *   straight into its native code if it is compiled, otherwise to
+ *   the caller. Exits to blocks compiled later are patched then.
+ *   Backward branches always return to the caller, which counts
+ *   them to find loops worth a trace.
+ */
+static void jit_exit(jit_t *jit, word_t target, word_t from)
+{
+	word_t i;
+
+
+	jit_set_ip(jit, target);
+
+	if (target <= from)
+	{
+		jit_jmp(jit, jit->back);
+		return;
+	}
+
+	for (i = 0; i < jit->nr_entries; i++)
+	{
+		if (jit->entries[i].addr == target)
+		{
+			jit_jmp(jit, jit->entries[i].body);
+			return;
+		}
+	}
+
+	jit_jmp(jit, jit->ok);
+
+	if (jit->nr_exits < JIT_EXITS && !jit->overflow)
+	{
+		jit->exits[jit->nr_exits].target = target;
+		jit->exits[jit->nr_exits].site   = jit->pc - 4;
+		jit->nr_exits++;
+	}
+}
+
+/*
+ *   Operand of the given kind to eax/ecx
+ */
+static void jit_get_reg(jit_t *jit, int r, word_t code, const jit_insn_t *insn)
+{
+	if (code == ISA_REG_IP)
+	{
+		/*
+		 *   IP reads as the address of the command
+		 */
+		jit_byte(jit, 0xb8 + r);
+		jit_word(jit, insn->addr);
+	}
+	else
+	{
+		jit_rbx_op(jit, 0x8b, r, jit_disp_reg(code));
+	}
+}
+
+static void jit_get_imm(jit_t *jit, int r, word_t v)
+{
+	jit_byte(jit, 0xb8 + r);
+	jit_word(jit, v);
+}
+
+static void jit_get_mem(jit_t *jit, word_t addr, const jit_insn_t *insn)
+{
+	byte_t *site;
+
+
+	/*
+	 *   eax = load(ctx, addr), leave on fault
+	 */
+	jit_byte(jit, 0xbe);
+	jit_word(jit, addr);
+	jit_call(jit, jit->env.load);
+	jit_bytes(jit, "\x48\x85\xc0", 3);      /* test rax, rax */
+	site = jit_jcc_fwd(jit, CC_NS);
+	jit_fault(jit, insn->addr);
+	jit_bind(jit, site);
+}
+
+static void jit_set_mem(jit_t *jit, word_t addr, const jit_insn_t *insn)
+{
+	byte_t *done;
+	byte_t *flushed;
+
+
+	/*
+	 *   store(ctx, addr, eax). Leave on fault, and to the caller
+	 *   if the store dropped translated code.
+	 */
+	jit_bytes(jit, "\x89\xc2", 2);          /* mov edx, eax  */
+	jit_byte(jit, 0xbe);
+	jit_word(jit, addr);
+	jit_call(jit, jit->env.store);
+	jit_bytes(jit, "\x85\xc0", 2);          /* test eax, eax */
+	done    = jit_jcc_fwd(jit, CC_E);
+	flushed = jit_jcc_fwd(jit, CC_NS);
+	jit_fault(jit, insn->addr);
+	jit_bind(jit, flushed);
+	if (jit->count > jit->done + 1)
+	{
+		jit_budget(jit, JIT_ADD, jit->count - jit->done - 1);
+	}
+	jit_set_ip(jit, insn->addr + insn->length);
+	jit_jmp(jit, jit->ok);
+	jit_bind(jit, done);
+}
+
+/*
+ *   Two-operand commands
+ */
+static void jit_binary(jit_t *jit, const jit_insn_t *insn, byte_t kind)
+{
+	byte_t *site;
+
+
+	/*
+	 *   First operand to eax, second one to ecx. At most one of
+	 *   them is in memory; it is loaded first since the load
+	 *   clobbers the scratch registers.
+	 */
+	switch (insn->mode)
+	{
+	case MODE_REGISTER_MEMORY:
+	case MODE_IMMEDIATE_MEMORY:
+		if (kind != JIT_K_mov)
+		{
+			jit_get_mem(jit, insn->op2, insn);
+			jit_bytes(jit, "\x89\xc1", 2);  /* mov ecx, eax */
+		}
+
+		if (insn->mode == MODE_REGISTER_MEMORY)
+		{
+			jit_get_reg(jit, R_EAX, insn->op1, insn);
+		}
+		else
+		{
+			jit_get_imm(jit, R_EAX, insn->op1);
+		}
+		break;
+
+	case MODE_MEMORY_REGISTER:
+		jit_get_mem(jit, insn->op1, insn);
+		jit_get_reg(jit, R_ECX, insn->op2, insn);
+		break;
+
+	case MODE_REGISTER_REGISTER:
+		jit_get_reg(jit, R_EAX, insn->op1, insn);
+		jit_get_reg(jit, R_ECX, insn->op2, insn);
+		break;
+
+	default: /* MODE_IMMEDIATE_REGISTER */
+		jit_get_imm(jit, R_EAX, insn->op1);
+		jit_get_reg(jit, R_ECX, insn->op2, insn);
+		break;
+	} /* switch */
+
+	site = NULL;
+	switch (kind)
+	{
+	case JIT_K_add:
+		jit_bytes(jit, "\x01\xc8", 2);          /* add eax, ecx  */
+		break;
+
+	case JIT_K_sub:
+		jit_bytes(jit, "\x29\xc8", 2);          /* sub eax, ecx  */
+		break;
+
+	case JIT_K_mul:
+		jit_bytes(jit, "\x0f\xaf\xc1", 3);      /* imul eax, ecx */
+		break;
+
+	case JIT_K_div:
+		/*
+		 *   Division by zero raises the error flag and
+		 *   leaves the destination alone
+		 */
+		jit_bytes(jit, "\x85\xc9", 2);          /* test ecx, ecx */
+		jit_bytes(jit, "\x75\x0c", 2);          /* jne +12       */
+		jit_rbx_op(jit, 0xc6, 0, jit_disp_flag(jit, jit->env.error));
+		jit_byte(jit, 1);
+		site = jit_jmp_fwd(jit);
+		jit_bytes(jit, "\x31\xd2", 2);          /* xor edx, edx  */
+		jit_bytes(jit, "\xf7\xf1", 2);          /* div ecx       */
+		break;
+
+	case JIT_K_cmp:
+		jit_bytes(jit, "\x39\xc8", 2);          /* cmp eax, ecx  */
+		jit_cmp_store(jit);
+		return;
+	} /* switch */
+
+	/*
+	 *   Result to the second operand
+	 */
+	if (ISA_OP2_IS_REG(insn->mode))
+	{
+		jit_rbx_op(jit, 0x89, R_EAX, jit_disp_reg(insn->op2));
+	}
+	else
+	{
+		jit_set_mem(jit, insn->op2, insn);
+	}
+
+	if (site != NULL)
+	{
+		jit_bind(jit, site);
+	}
+}
+
+/*
+ *   Branch target to IP, back to the caller
+ */
+static void jit_leave_indirect(jit_t *jit, const jit_insn_t *insn)
+{
+	if (insn->mode == MODE_REGISTER)
+	{
+		jit_get_reg(jit, R_EAX, insn->op1, insn);
+	}
+	else
+	{
+		jit_get_mem(jit, insn->op1, insn);
+	}
+
+	jit_rbx_op(jit, 0x89, R_EAX, jit_disp_reg(ISA_REG_IP));
+	jit_jmp(jit, jit->ok);
+}
+
+/*
+ *   Branch commands. They end the block. A conditional branch
+ *   right after cmp tests the host flags cmp left behind.
+ */
+static void jit_branch(jit_t *jit, const jit_insn_t *insn, byte_t kind, int flags_live)
+{
+	byte_t *site;
+
+
+	site = NULL;
+	if (kind != JIT_K_jump)
+	{
+		if (!flags_live)
+		{
+			jit_cmp_load(jit);
+		}
+
+		site = jit_jcc_fwd(jit, (kind == JIT_K_je) ? CC_NE : CC_BE);
+	}
+
+	if (insn->mode == MODE_IMMEDIATE)
+	{
+		jit_exit(jit, insn->op1, insn->addr);
+	}
+	else
+	{
+		jit_leave_indirect(jit, insn);
+	}
+
+	if (site != NULL)
+	{
+		jit_bind(jit, site);
+		jit_exit(jit, insn->addr + insn->length, insn->addr);
+	}
+}
+
+/*
+ *   Traces
+ *
+ *   A trace is the path a hot loop took, from its head back to it.
+ *   Branches on the path become guards leaving the trace when they
+ *   go the other way. The first iteration is compiled apart from
+ *   the loop, so the loop starts out knowing the constants every
+ *   iteration leaves behind. The guest registers used most live in
+ *   callee-saved host registers until the trace is left.
+ */
+static const byte_t cached[JIT_CACHED] = { R_EBP, R_R12, R_R13, R_R14, R_R15 };
+
+/*
+ *   mov r32, r32 and mov r32, imm32 on any host register
+ */
+static void jit_mov_rr(jit_t *jit, int dst, int src)
+{
+	if (dst == src)
+	{
+		return;
+	}
+
+	if (dst >= 8 || src >= 8)
+	{
+		jit_byte(jit, 0x40 | ((dst >> 3) << 2) | (src >> 3));
+	}
+
+	jit_byte(jit, 0x8b);
+	jit_byte(jit, 0xc0 | ((dst & 7) << 3) | (src & 7));
+}
+
+static void jit_mov_ri(jit_t *jit, int dst, word_t v)
+{
+	if (dst >= 8)
+	{
+		jit_byte(jit, 0x41);
+	}
+
+	jit_byte(jit, 0xb8 + (dst & 7));
+	jit_word(jit, v);
+}
+
+static int jit_trace_mem(const jit_insn_t *insn)
+{
+	return insn->mode == MODE_REGISTER_MEMORY ||
+	       insn->mode == MODE_MEMORY_REGISTER ||
+	       insn->mode == MODE_IMMEDIATE_MEMORY;
+}
+
+/*
+ *   Value of the guest register if it is known at compile time
+ */
+static int jit_trace_known(const jit_trace_t *t, word_t code, const jit_insn_t *insn, word_t *v)
+{
+	if (code == ISA_REG_IP)
+	{
+		*v = insn->addr;
+		return 1;
+	}
+
+	if (t->st.cst[code])
+	{
+		*v = t->st.val[code];
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ *   Guest register to eax/ecx
+ */
+static void jit_trace_get(jit_t *jit, jit_trace_t *t, int r, word_t code, const jit_insn_t *insn)
+{
+	word_t v;
+
+
+	if (jit_trace_known(t, code, insn, &v))
+	{
+		jit_mov_ri(jit, r, v);
+	}
+	else if (t->host[code] >= 0)
+	{
+		jit_mov_rr(jit, r, t->host[code]);
+	}
+	else
+	{
+		jit_rbx_op(jit, 0x8b, r, jit_disp_reg(code));
+	}
+}
+
+/*
+ *   eax to a guest register
+ */
+static void jit_trace_set(jit_t *jit, jit_trace_t *t, word_t code)
+{
+	if (t->host[code] >= 0)
+	{
+		jit_mov_rr(jit, t->host[code], R_EAX);
+	}
+	else
+	{
+		jit_rbx_op(jit, 0x89, R_EAX, jit_disp_reg(code));
+	}
+
+	t->st.cst[code] = 0;
+}
+
+/*
+ *   Constant to a guest register. Registers kept on the host get
+ *   it only when it is needed; reloading the value a register is
+ *   known to hold costs nothing.
+ */
+static void jit_trace_set_const(jit_t *jit, jit_trace_t *t, word_t code, word_t v)
+{
+	if (t->st.cst[code] && t->st.val[code] == v)
+	{
+		return;
+	}
+
+	if (t->host[code] < 0)
+	{
+		/*
+		 *   mov dword [rbx + reg], imm32
+		 */
+		jit_rbx_op(jit, 0xc7, 0, jit_disp_reg(code));
+		jit_word(jit, v);
+	}
+
+	t->st.cst[code] = 1;
+	t->st.val[code] = v;
+}
+
+/*
+ *   Constant still waiting in a host register written to it
+ */
+static void jit_trace_settle(jit_t *jit, jit_trace_t *t, word_t code)
+{
+	if (t->st.cst[code] && t->host[code] >= 0)
+	{
+		jit_mov_ri(jit, t->host[code], t->st.val[code]);
+	}
+
+	t->st.cst[code] = 0;
+}
+
+/*
+ *   Leave the trace with IP at `ip`, `done` commands into the
+ *   iteration. Flags still held by the host and registers kept on
+ *   the host are written back first.
+ */
+static void jit_trace_exit(jit_t *jit, jit_trace_t *t, word_t ip, word_t done, int fault)
+{
+	word_t code;
+
+
+	if (t->pending)
+	{
+		jit_cmp_spill(jit);
+	}
+
+	if (done > 0)
+	{
+		jit_budget_sub(jit, done);
+	}
+	jit_budget_give(jit);
+
+	for (code = 0; code < NR_REGISTERS; code++)
+	{
+		if (t->host[code] < 0 || !t->written[code])
+		{
+			continue;
+		}
+
+		if (t->st.cst[code])
+		{
+			jit_rbx_op(jit, 0xc7, 0, jit_disp_reg(code));
+			jit_word(jit, t->st.val[code]);
+		}
+		else
+		{
+			jit_rbx_op(jit, 0x89, t->host[code], jit_disp_reg(code));
+		}
+	}
+
+	jit_set_ip(jit, ip);
+	jit_jmp(jit, fault ? jit->t_fault : jit->t_ok);
+}
+
+/*
+ *   Helper call from a trace: the slice goes back to the budget
+ *   around it, r10 is not preserved
+ */
+static void jit_trace_call(jit_t *jit, const void *fn)
+{
+	jit_budget_give(jit);
+	jit_call(jit, fn);
+	jit_budget_take(jit);
+}
+
+static void jit_trace_get_mem(jit_t *jit, jit_trace_t *t, word_t addr, const jit_insn_t *insn)
+{
+	byte_t *site;
+
+
+	jit_byte(jit, 0xbe);
+	jit_word(jit, addr);
+	jit_trace_call(jit, jit->env.load);
+	jit_bytes(jit, "\x48\x85\xc0", 3);      /* test rax, rax */
+	site = jit_jcc_fwd(jit, CC_NS);
+	jit_trace_exit(jit, t, insn->addr, t->at, 1);
+	jit_bind(jit, site);
+}
+
+static void jit_trace_set_mem(jit_t *jit, jit_trace_t *t, word_t addr, const jit_insn_t *insn)
+{
+	byte_t *done;
+	byte_t *flushed;
+
+
+	jit_bytes(jit, "\x89\xc2", 2);          /* mov edx, eax  */
+	jit_byte(jit, 0xbe);
+	jit_word(jit, addr);
+	jit_trace_call(jit, jit->env.store);
+	jit_bytes(jit, "\x85\xc0", 2);          /* test eax, eax */
+	done    = jit_jcc_fwd(jit, CC_E);
+	flushed = jit_jcc_fwd(jit, CC_NS);
+	jit_trace_exit(jit, t, insn->addr, t->at, 1);
+	jit_bind(jit, flushed);
+	jit_trace_exit(jit, t, insn->addr + insn->length, t->at + 1, 0);
+	jit_bind(jit, done);
+}
+
+/*
+ *   Two-operand commands. Register operands known at compile time
+ *   are folded.
+ */
+static void jit_trace_binary(jit_t *jit, jit_trace_t *t, word_t i, byte_t kind)
+{
+	const jit_insn_t *insn = &t->insns[i];
+	byte_t           *site;
+	word_t           a;
+	word_t           b;
+	int              ka;
+	int              kb;
+
+
+	ka = 0;
+	kb = 0;
+	a  = insn->op1;
+	b  = 0;
+	switch (insn->mode)
+	{
+	case MODE_IMMEDIATE_MEMORY:
+	case MODE_IMMEDIATE_REGISTER:
+		ka = 1;
+		break;
+
+	case MODE_REGISTER_MEMORY:
+	case MODE_REGISTER_REGISTER:
+		ka = jit_trace_known(t, insn->op1, insn, &a);
+		break;
+	} /* switch */
+
+	if (ISA_OP2_IS_REG(insn->mode))
+	{
+		kb = jit_trace_known(t, insn->op2, insn, &b);
+	}
+
+	if (ISA_OP2_IS_REG(insn->mode) && ka && (kb || kind == JIT_K_mov) && kind != JIT_K_cmp)
+	{
+		switch (kind)
+		{
+		case JIT_K_add:
+			a = a + b;
+			break;
+
+		case JIT_K_sub:
+			a = a - b;
+			break;
+
+		case JIT_K_mul:
+			a = a * b;
+			break;
+
+		case JIT_K_div:
+			if (b == 0)
+			{
+				jit_rbx_op(jit, 0xc6, 0, jit_disp_flag(jit, jit->env.error));
+				jit_byte(jit, 1);
+				return;
+			}
+
+			a = a / b;
+			break;
+		} /* switch */
+
+		jit_trace_set_const(jit, t, insn->op2, a);
+		return;
+	}
+
+	/*
+	 *   Register to register moves skip the scratch registers
+	 */
+	if (kind == JIT_K_mov && insn->mode == MODE_REGISTER_REGISTER &&
+	    t->host[insn->op1] >= 0 && t->host[insn->op2] >= 0)
+	{
+		jit_mov_rr(jit, t->host[insn->op2], t->host[insn->op1]);
+		t->st.cst[insn->op2] = 0;
+		return;
+	}
+
+	/*
+	 *   Division may leave the destination alone
+	 */
+	if (kind == JIT_K_div && ISA_OP2_IS_REG(insn->mode))
+	{
+		jit_trace_settle(jit, t, insn->op2);
+	}
+
+	/*
+	 *   First operand to eax, second one to ecx, memory first
+	 */
+	switch (insn->mode)
+	{
+	case MODE_REGISTER_MEMORY:
+	case MODE_IMMEDIATE_MEMORY:
+		if (kind != JIT_K_mov)
+		{
+			jit_trace_get_mem(jit, t, insn->op2, insn);
+			jit_bytes(jit, "\x89\xc1", 2);  /* mov ecx, eax */
+		}
+
+		if (insn->mode == MODE_REGISTER_MEMORY)
+		{
+			jit_trace_get(jit, t, R_EAX, insn->op1, insn);
+		}
+		else
+		{
+			jit_mov_ri(jit, R_EAX, insn->op1);
+		}
+		break;
+
+	case MODE_MEMORY_REGISTER:
+		jit_trace_get_mem(jit, t, insn->op1, insn);
+		if (kind != JIT_K_mov)
+		{
+			jit_trace_get(jit, t, R_ECX, insn->op2, insn);
+		}
+		break;
+
+	case MODE_REGISTER_REGISTER:
+		jit_trace_get(jit, t, R_EAX, insn->op1, insn);
+		if (kind != JIT_K_mov)
+		{
+			jit_trace_get(jit, t, R_ECX, insn->op2, insn);
+		}
+		break;
+
+	default: /* MODE_IMMEDIATE_REGISTER */
+		jit_mov_ri(jit, R_EAX, insn->op1);
+		if (kind != JIT_K_mov)
+		{
+			jit_trace_get(jit, t, R_ECX, insn->op2, insn);
+		}
+		break;
+	} /* switch */
+
+	site = NULL;
+	switch (kind)
+	{
+	case JIT_K_add:
+		jit_bytes(jit, "\x01\xc8", 2);          /* add eax, ecx  */
+		break;
+
+	case JIT_K_sub:
+		jit_bytes(jit, "\x29\xc8", 2);          /* sub eax, ecx  */
+		break;
+
+	case JIT_K_mul:
+		jit_bytes(jit, "\x0f\xaf\xc1", 3);      /* imul eax, ecx */
+		break;
+
+	case JIT_K_div:
+		jit_bytes(jit, "\x85\xc9", 2);          /* test ecx, ecx */
+		jit_bytes(jit, "\x75\x0c", 2);          /* jne +12       */
+		jit_rbx_op(jit, 0xc6, 0, jit_disp_flag(jit, jit->env.error));
+		jit_byte(jit, 1);
+		site = jit_jmp_fwd(jit);
+		jit_bytes(jit, "\x31\xd2", 2);          /* xor edx, edx  */
+		jit_bytes(jit, "\xf7\xf1", 2);          /* div ecx       */
+		break;
+
+	case JIT_K_cmp:
+		/*
+		 *   The guest flags are set only if something but the
+		 *   branch right after reads them
+		 */
+		jit_bytes(jit, "\x39\xc8", 2);          /* cmp eax, ecx  */
+		t->eflags  = 1;
+		t->pending = 1;
+		if (t->keep[i])
+		{
+			jit_cmp_store(jit);
+			t->pending = 0;
+		}
+		return;
+	} /* switch */
+
+	if (ISA_OP2_IS_REG(insn->mode))
+	{
+		jit_trace_set(jit, t, insn->op2);
+	}
+	else
+	{
+		jit_trace_set_mem(jit, t, insn->op2, insn);
+	}
+
+	if (site != NULL)
+	{
+		jit_bind(jit, site);
+	}
+}
+
+/*
+ *   Conditional branch: stay on the recorded path or leave
+ */
+static void jit_trace_guard(jit_t *jit, jit_trace_t *t, const jit_insn_t *insn, byte_t kind)
+{
+	byte_t *site;
+	byte_t stay;
+
+
+	if (!t->eflags)
+	{
+		jit_cmp_load(jit);
+	}
+
+	if (kind == JIT_K_je)
+	{
+		stay = insn->taken ? CC_E : CC_NE;
+	}
+	else
+	{
+		stay = insn->taken ? CC_A : CC_BE;
+	}
+
+	site = jit_jcc_fwd(jit, stay);
+	jit_trace_exit(jit, t, insn->taken ? insn->addr + insn->length : insn->op1, t->at + 1, 0);
+	jit_bind(jit, site);
+}
+
+static void jit_trace_insn(jit_t *jit, jit_trace_t *t, word_t i)
+{
+	const jit_insn_t *insn = &t->insns[i];
+	byte_t           kind;
+
+
+	kind = kinds[insn->handler];
+	if (kind == JIT_K_jump)
+	{
+		/*
+		 *   The path goes on at the target
+		 */
+		return;
+	}
+
+	if (kind == JIT_K_je || kind == JIT_K_jg)
+	{
+		jit_trace_guard(jit, t, insn, kind);
+		return;
+	}
+
+	/*
+	 *   Host flags of an earlier cmp are lost from here on; if
+	 *   its guest flags were not set, nothing reads them anymore
+	 */
+	t->eflags  = 0;
+	t->pending = 0;
+	jit_trace_binary(jit, t, i, kind);
+}
+
+/*
+ *   Mark every cmp whose flags are read by something other than
+ *   the branch right after it: a later branch or any exit taken
+ *   before the next cmp, going around the loop
+ */
+static void jit_trace_flags(jit_trace_t *t)
+{
+	const jit_insn_t *insn;
+	word_t           i;
+	word_t           j;
+	word_t           n;
+	byte_t           kind;
+
+
+	for (i = 0; i < t->nr; i++)
+	{
+		t->keep[i] = 0;
+		if (kinds[t->insns[i].handler] != JIT_K_cmp)
+		{
+			continue;
+		}
+
+		j = i + 1;
+		if (j < t->nr && (kinds[t->insns[j].handler] == JIT_K_je || kinds[t->insns[j].handler] == JIT_K_jg))
+		{
+			j++;
+		}
+
+		for (n = 0; n < t->nr; n++, j++)
+		{
+			insn = &t->insns[j % t->nr];
+			kind = kinds[insn->handler];
+			if (kind == JIT_K_cmp)
+			{
+				break;
+			}
+
+			if (kind == JIT_K_je || kind == JIT_K_jg || jit_trace_mem(insn))
+			{
+				t->keep[i] = 1;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ *   Keep at the loop head only the constants known in `head` and
+ *   `end` alike; returns nonzero if `head` changed
+ */
+static int jit_trace_meet(jit_state_t *head, const jit_state_t *end)
+{
+	word_t code;
+	int    changed;
+
+
+	changed = 0;
+	for (code = 0; code < NR_REGISTERS; code++)
+	{
+		if (head->cst[code] && (!end->cst[code] || end->val[code] != head->val[code]))
+		{
+			head->cst[code] = 0;
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+/*
+ *   Bring the registers to the state the loop head expects
+ */
+static void jit_trace_join(jit_t *jit, jit_trace_t *t, const jit_state_t *head)
+{
+	word_t code;
+
+
+	for (code = 0; code < NR_REGISTERS; code++)
+	{
+		if (!head->cst[code])
+		{
+			jit_trace_settle(jit, t, code);
+		}
+	}
+
+	t->st      = *head;
+	t->eflags  = 0;
+	t->pending = 0;
+}
+
+static void jit_trace_pass(jit_t *jit, jit_trace_t *t)
+{
+	word_t i;
+
+
+	for (i = 0; i < t->nr; i++)
+	{
+		t->at = i;
+		jit_trace_insn(jit, t, i);
+	}
+}
+
+/*
+ *   End of an iteration, back at the loop head: take it off the
+ *   slice and leave once the slice is used up. Otherwise go on to
+ *   the next iteration, at `loop` if given (one taken branch per
+ *   iteration), else right after.
+ */
+static void jit_trace_yield(jit_t *jit, jit_trace_t *t, const byte_t *loop)
+{
+	byte_t *stay;
+
+
+	jit_budget_sub(jit, t->nr);
+	stay = NULL;
+	if (loop != NULL)
+	{
+		jit_jcc(jit, CC_G, loop);
+	}
+	else
+	{
+		stay = jit_jcc_fwd(jit, CC_G);
+	}
+
+	jit_trace_exit(jit, t, t->insns[0].addr, 0, 0);
+
+	if (stay != NULL)
+	{
+		jit_bind(jit, stay);
+	}
+}
+
+/*
+ *   Implementation
+ */
+
+/*
+ *   The code buffer is never writable and executable at once: its
+ *   pages are mapped twice, executable where the code runs and
+ *   writable where it is emitted and patched, so neither needs an
+ *   mprotect() per compilation
+ */
+jit_t* jit_init(const jit_env_t *env)
+{
+	jit_t *jit;
+	int   fd;
+
+
+	if (env == NULL)
+	{
+		return NULL;
+	}
+
+	jit = (jit_t *)malloc(sizeof(*jit));
+	if (jit == NULL)
+	{
+		return NULL;
+	}
+
+	fd = (int)syscall(SYS_memfd_create, "jit", MFD_CLOEXEC);
+	if (fd == -1 || ftruncate(fd, JIT_CODE_SIZE) == -1)
+	{
+		if (fd != -1)
+		{
+			close(fd);
+		}
+
+		free(jit);
+		return NULL;
+	}
+
+	jit->code = (byte_t *)mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+	jit->rw   = (byte_t *)mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (jit->code == MAP_FAILED || jit->rw == MAP_FAILED)
+	{
+		if (jit->code != MAP_FAILED)
+		{
+			munmap(jit->code, JIT_CODE_SIZE);
+		}
+
+		if (jit->rw != MAP_FAILED)
+		{
+			munmap(jit->rw, JIT_CODE_SIZE);
+		}
+
+		free(jit);
+		return NULL;
+	}
+
+	jit->env   = *env;
+	jit->limit = jit->code + JIT_CODE_SIZE;
+
+	jit_reset(jit);
+
+	return jit;
+}
+
+int jit_free(jit_t *jit)
+{
+	if (jit == NULL)
+	{
+		return -1;
+	}
+
+	munmap(jit->code, JIT_CODE_SIZE);
+	munmap(jit->rw, JIT_CODE_SIZE);
+	free(jit);
+
+	return 0;
+}
+
+int jit_reset(jit_t *jit)
+{
+	if (jit == NULL)
+	{
+		return -1;
+	}
+
+	/*
+	 *   Code may still be running (a store helper dropping it);
+	 *   it is only overwritten by the next compilation.
+	 */
+	jit->pc         = jit->code;
+	jit->overflow   = 0;
+	jit->dry        = 0;
+	jit->nr_entries = 0;
+	jit->nr_exits   = 0;
+
+	/*
+	 *   Shared epilogues: the prologue pushed rbx
+	 */
+	jit->ok = jit->pc;
+	jit_bytes(jit, "\x31\xc0\x5b\xc3", 4);                 /* xor eax, eax; pop rbx; ret */
+	jit->fault = jit->pc;
+	jit_bytes(jit, "\xb8\xff\xff\xff\xff\x5b\xc3", 7);     /* mov eax, -1; pop rbx; ret  */
+	jit->back = jit->pc;
+	jit_bytes(jit, "\xb8\x01\x00\x00\x00\x5b\xc3", 7);     /* mov eax, 1; pop rbx; ret   */
+
+	/*
+	 *   Trace epilogues: the prologue pushed rbx, rbp, r12-r15 and
+	 *   aligned the stack
+	 */
+	jit->t_ok = jit->pc;
+	jit_bytes(jit, "\x31\xc0", 2);                             /* xor eax, eax   */
+	jit_bytes(jit, "\x48\x83\xc4\x08", 4);                     /* add rsp, 8     */
+	jit_bytes(jit, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5d\x5b\xc3", 11);
+	jit->t_fault = jit->pc;
+	jit_bytes(jit, "\xb8\xff\xff\xff\xff", 5);                 /* mov eax, -1    */
+	jit_bytes(jit, "\x48\x83\xc4\x08", 4);                     /* add rsp, 8     */
+	jit_bytes(jit, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5d\x5b\xc3", 11);
+
+	return 0;
+}
+
+int jit_compile(jit_t *jit, const jit_insn_t *insns, word_t nr, jit_code_t *code)
+{
+	byte_t *start;
+	byte_t *body;
+	word_t nr_exits;
+	word_t i;
+	byte_t kind;
+	int    flags_live;
+
+
+	if (jit == NULL || code == NULL)
+	{
+		return -1;
+	}
+
+	*code = NULL;
+
+	/*
+	 *   Blocks starting with a command left to the interpreter
+	 *   get no native code
+	 */
+	if (nr == 0 || kinds[insns[0].handler] == JIT_K_none)
+	{
+		return 0;
+	}
+
+	if (jit->nr_entries == JIT_ENTRIES)
+	{
+		return -1;
+	}
+
+	start    = jit->pc;
+	nr_exits = jit->nr_exits;
+
+	/*
+	 *   Prologue: push rbx; mov rbx, regs. Chained blocks jump
+	 *   past it, straight to the body.
+	 */
+	jit_byte(jit, 0x53);
+	jit_byte(jit, 0x48);
+	jit_byte(jit, 0xbb);
+	jit_ptr(jit, jit->env.regs);
+	body = jit->pc;
+
+	jit->entries[jit->nr_entries].addr = insns[0].addr;
+	jit->entries[jit->nr_entries].body = body;
+	jit->nr_entries++;
+
+	/*
+	 *   The commands in native code are taken off the budget on
+	 *   entry; exits leaving some of them undone give them back
+	 */
+	for (jit->count = 0; jit->count < nr; jit->count++)
+	{
+		kind = kinds[insns[jit->count].handler];
+		if (kind == JIT_K_none)
+		{
+			break;
+		}
+
+		if (kind == JIT_K_jump || kind == JIT_K_jg || kind == JIT_K_je)
+		{
+			jit->count++;
+			break;
+		}
+	}
+
+	jit_budget(jit, JIT_SUB, jit->count);
+
+	flags_live = 0;
+	for (i = 0; i < nr; i++)
+	{
+		jit->done = i;
+		kind = kinds[insns[i].handler];
+		if (kind == JIT_K_none)
+		{
+			break;
+		}
+
+		if (kind == JIT_K_jump || kind == JIT_K_jg || kind == JIT_K_je)
+		{
+			jit_branch(jit, &insns[i], kind, flags_live);
+			break;
+		}
+
+		jit_binary(jit, &insns[i], kind);
+		flags_live = (kind == JIT_K_cmp);
+	}
+
+	/*
+	 *   Commands left over run in the interpreter
+	 */
+	if (i == nr || kinds[insns[i].handler] == JIT_K_none)
+	{
+		jit_exit(jit, insns[i - 1].addr + insns[i - 1].length, insns[i - 1].addr);
+	}
+
+	if (jit->overflow)
+	{
+		jit->pc         = start;
+		jit->overflow   = 0;
+		jit->nr_exits   = nr_exits;
+		jit->nr_entries--;
+		return -1;
+	}
+
+	/*
+	 *   Chain the exits waiting for this block
+	 */
+	for (i = 0; i < jit->nr_exits; i++)
+	{
+		if (jit->exits[i].target == insns[0].addr)
+		{
+			jit_patch(jit, jit->exits[i].site, body);
+			jit->exits[i] = jit->exits[--jit->nr_exits];
+			i--;
+		}
+	}
+
+	*code = (jit_code_t)start;
+
+	return 0;
+}
+
+int jit_compile_trace(jit_t *jit, const jit_insn_t *insns, word_t nr, jit_code_t *code)
+{
+	jit_trace_t t;
+	jit_state_t head;
+	word_t      uses[NR_REGISTERS];
+	byte_t      *start;
+	byte_t      *loop;
+	word_t      best;
+	word_t      i;
+	word_t      r;
+	byte_t      kind;
+
+
+	if (jit == NULL || code == NULL)
+	{
+		return -1;
+	}
+
+	*code = NULL;
+
+	/*
+	 *   Traces hold two-operand commands and branches to
+	 *   constant addresses only
+	 */
+	if (nr == 0 || nr > JIT_TRACE_MAX)
+	{
+		return 0;
+	}
+
+	memset(&t, 0, sizeof(t));
+	memset(uses, 0, sizeof(uses));
+	t.insns = insns;
+	t.nr    = nr;
+
+	for (i = 0; i < nr; i++)
+	{
+		kind = kinds[insns[i].handler];
+		if (kind == JIT_K_none)
+		{
+			return 0;
+		}
+
+		if (kind == JIT_K_jump || kind == JIT_K_je || kind == JIT_K_jg)
+		{
+			if (insns[i].mode != MODE_IMMEDIATE)
+			{
+				return 0;
+			}
+			continue;
+		}
+
+		if (ISA_OP1_IS_REG(insns[i].mode) && insns[i].op1 != ISA_REG_IP)
+		{
+			uses[insns[i].op1]++;
+		}
+
+		if (ISA_OP2_IS_REG(insns[i].mode))
+		{
+			uses[insns[i].op2]++;
+			t.written[insns[i].op2] |= (kind != JIT_K_cmp);
+		}
+	}
+
+	/*
+	 *   Host registers go to the guest registers used most
+	 */
+	memset(t.host, -1, sizeof(t.host));
+	for (r = 0; r < JIT_CACHED; r++)
+	{
+		best = 0;
+		for (i = 1; i < NR_REGISTERS; i++)
+		{
+			if (uses[i] > uses[best])
+			{
+				best = i;
+			}
+		}
+
+		if (uses[best] == 0)
+		{
+			break;
+		}
+
+		t.host[best] = cached[r];
+		uses[best]   = 0;
+	}
+
+	jit_trace_flags(&t);
+
+	/*
+	 *   Constants known at the loop head: those the first
+	 *   iteration leaves and every further one keeps
+	 */
+	jit->dry = 1;
+	jit_trace_pass(jit, &t);
+	head = t.st;
+	do
+	{
+		t.st      = head;
+		t.eflags  = 0;
+		t.pending = 0;
+		jit_trace_pass(jit, &t);
+	} while (jit_trace_meet(&head, &t.st));
+	jit->dry = 0;
+
+	/*
+	 *   Prologue: push rbx, rbp, r12-r15; sub rsp, 8 (calls need
+	 *   an aligned stack); mov rbx, regs; take a slice of the
+	 *   budget; load the kept registers
+	 */
+	start = jit->pc;
+	jit_bytes(jit, "\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57", 10);
+	jit_bytes(jit, "\x48\x83\xec\x08", 4);
+	jit_byte(jit, 0x48);
+	jit_byte(jit, 0xbb);
+	jit_ptr(jit, jit->env.regs);
+	jit_budget_take(jit);
+
+	for (i = 0; i < NR_REGISTERS; i++)
+	{
+		if (t.host[i] >= 0)
+		{
+			jit_rbx_op(jit, 0x8b, t.host[i], jit_disp_reg(i));
+		}
+	}
+
+	/*
+	 *   First iteration, then the loop
+	 */
+	memset(&t.st, 0, sizeof(t.st));
+	t.eflags  = 0;
+	t.pending = 0;
+	jit_trace_pass(jit, &t);
+	jit_trace_join(jit, &t, &head);
+	jit_trace_yield(jit, &t, NULL);
+
+	loop = jit->pc;
+	jit_trace_pass(jit, &t);
+	jit_trace_join(jit, &t, &head);
+	jit_trace_yield(jit, &t, loop);
+
+	if (jit->overflow)
+	{
+		jit->pc       = start;
+		jit->overflow = 0;
+		return -1;
+	}
+
+	*code = (jit_code_t)start;
+
+	return 0;
+}
+
+#else /* No native code generator for this host */
+
+jit_t* jit_init(const jit_env_t *env)
+{
+	return NULL;
+}
+
+int jit_free(jit_t *jit)
+{
+	return -1;
+}
+
+int jit_reset(jit_t *jit)
+{
+	return -1;
+}
+
+int jit_compile(jit_t *jit, const jit_insn_t *insns, word_t nr, jit_code_t *code)
+{
+	return -1;
+}
+
+int jit_compile_trace(jit_t *jit, const jit_insn_t *insns, word_t nr, jit_code_t *code)
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,70 @@
+
+#ifndef __JIT_H__
+#define __JIT_H__
+
+/*
+ *   Includes
+ */
+#include "types.h"
+
+/*
+ *   Constants
+ */
+#define JIT_TRACE_MAX 256 /* Commands in a trace at most */
+
+/*
+ *   Types
+ */
+typedef struct _jit_t jit_t;
+
+/*
+ *   Native code of a block or trace. Returns 0 with IP stored to
+ *   the register file, 1 when it left through a backward branch
+ *   (IP on the loop head), -1 when a command faulted (IP left on
+ *   it). The commands run are taken off the budget; a trace also
+ *   returns 0 at its loop head once the budget is used up, and
+ *   every so many commands anyway.
+ */
+typedef int (*jit_code_t)(void);
+
+/*
+ *   Command handed to the compiler
+ */
+typedef struct _jit_insn_t
+{
+	word_t addr;    /* Guest address of the command          */
+	word_t op1;     /* First operand                         */
+	word_t op2;     /* Second operand                        */
+	byte_t handler; /* Handler identifier (isa.h)            */
+	byte_t mode;    /* Addressing mode                       */
+	byte_t length;  /* Command length in bytes               */
+	byte_t taken;   /* Branch was taken when traced          */
+} jit_insn_t;
+
+/*
+ *   Guest state and services used by the generated code. The
+ *   flags and compare operands must lie within 2 GiB of the
+ *   register file.
+ */
+typedef struct _jit_env_t
+{
+	void   *ctx;                                       /* Passed to the helpers           */
+	word_t *regs;                                      /* Register file, by register code */
+	word_t *cmp;                                       /* Operands of the last compare    */
+	byte_t *error;                                     /* Error flag                      */
+	long   *budget;                                    /* Commands left to run            */
+	long   (*load) (void *ctx, word_t addr);           /* Word read, -1 on fault          */
+	int    (*store)(void *ctx, word_t addr, word_t w); /* 0, 1 if code was dropped,
+	                                                      -1 on fault                     */
+} jit_env_t;
+
+/*
+ *   Prototypes
+ */
+jit_t* jit_init   (const jit_env_t *env);
+int    jit_free   (jit_t *jit);
+int    jit_reset  (jit_t *jit);
+int    jit_compile(jit_t *jit, const jit_insn_t *insns, word_t nr, jit_code_t *code);
+int    jit_compile_trace(jit_t *jit, const jit_insn_t *insns, word_t nr, jit_code_t *code);
+
+#endif /* __JIT_H__ */
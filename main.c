@@ -9,6 +9,60 @@
 #include "cpu.h"
 #include "mem.h"
 #include "io.h"
+#include "aot.h"
+#include "cache.h"
+
+/*
+ *   Local utility functions
+ */
+
+/*
+ *   Page attributes from their letters ("rx", "rw", ...; "-" for
+ *   none). Returns -1 on anything else.
+ */
+static int attrs_parse(const char *s)
+{
+	int attrs;
+
+
+	attrs = 0;
+	for (; *s != '\0'; s++)
+	{
+		switch (*s)
+		{
+			case 'r': attrs |= MEM_ATTR_R; break;
+			case 'w': attrs |= MEM_ATTR_W; break;
+			case 'x': attrs |= MEM_ATTR_X; break;
+			case '-': break;
+			default:  return -1;
+		}
+	}
+
+	return attrs;
+}
+
+/*
+ *   Engine from its name. Returns the tiered engine on anything else.
+ */
+static cpu_engine_t engine_parse(const char *s)
+{
+	if (strcmp(s, "portable") == 0)
+	{
+		return CPU_ENGINE_PORTABLE;
+	}
+
+	if (strcmp(s, "threaded") == 0)
+	{
+		return CPU_ENGINE_THREADED;
+	}
+
+	if (strcmp(s, "jit") == 0)
+	{
+		return CPU_ENGINE_JIT;
+	}
+
+	return CPU_ENGINE_TIERED;
+}
 
 /*
  *   Program entry point
@@ -20,16 +74,40 @@ int main(int argc, char **argv)
 	io_t   *io;
 	int    ret;
 	char   cmd[32];
+	char   file[256];
 	word_t addr;
 	word_t size;
+	word_t code_size;
+	word_t memory_size;
+	int    memory_flags;
+	cpu_engine_t engine;
+	int    attrs;
+	mem_stats_t stats;
 	word_t buf;
 	word_t ip;
 	byte_t *code;
+	cache_t *cache;
+	char   *dir;
+
 
+	/*
+	 *   Memory size in bytes from $VM_MEM, if set; huge pages from
+	 *   $VM_HUGE ("thp" or "tlb"), if set. The memory prefers the
+	 *   NUMA node the VM starts on.
+	 */
+	memory_size = MEM_SIZE * WORD_SIZE;
+	if (getenv("VM_MEM") != NULL)
+	{
+		memory_size = (word_t)strtoul(getenv("VM_MEM"), NULL, 0);
+	}
 
-	asm_assemble("code.text", &code, &size);
+	memory_flags = MEM_NUMA_LOCAL;
+	if (getenv("VM_HUGE") != NULL)
+	{
+		memory_flags |= (strcmp(getenv("VM_HUGE"), "tlb") == 0) ? MEM_HUGE_TLB : MEM_HUGE_THP;
+	}
 
-	mem = mem_init();
+	mem = mem_init_with(memory_size, memory_flags);
 	if (mem == NULL)
 	{
 		printf("Unable to initialize memory\n");
@@ -44,7 +122,17 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	cpu = cpu_init(mem, io);
+	/*
+	 *   Engine from $VM_ENGINE ("portable", "threaded", "jit" or
+	 *   "tiered"), if set
+	 */
+	engine = CPU_ENGINE_TIERED;
+	if (getenv("VM_ENGINE") != NULL)
+	{
+		engine = engine_parse(getenv("VM_ENGINE"));
+	}
+
+	cpu = cpu_init_with(mem, io, engine);
 	if (cpu == NULL)
 	{
 		printf("Unable to initialize CPU\n");
@@ -65,9 +153,49 @@ int main(int argc, char **argv)
 		printf("OK\n\n\n");
 	}
 
-	cpu_load_code(cpu, 0, code, size);
+	/*
+	 *   Assembled code and its translations are kept across runs
+	 *   in $VM_CACHE, if set. Without a cache the code is assembled
+	 *   straight into memory.
+	 */
+	dir   = getenv("VM_CACHE");
+	cache = (dir != NULL) ? cache_open(dir) : NULL;
+	size  = 0;
+	if (cache != NULL && cache_assemble(cache, "code.text", &code, &size) == 0)
+	{
+		ret = cache_load(cache, cpu, 0, code, size);
+		if (ret == 0)
+		{
+			cpu_set_engine(cpu, CPU_ENGINE_AOT);
+		}
+		else if (ret == -1)
+		{
+			cpu_load_code(cpu, 0, code, size);
+		}
+
+		free(code);
+	}
+	else if (asm_assemble_to("code.text", mem_bytes(mem), mem_size(mem), &size) == 0)
+	{
+		cpu_load_memory(cpu, 0, size);
+	}
+	code_size = size;
 
-	free(code);
+	/*
+	 *   The pages of the code get the attributes in $VM_PROTECT
+	 *   ("rx", say), if set
+	 */
+	if (getenv("VM_PROTECT") != NULL && code_size > 0)
+	{
+		attrs = attrs_parse(getenv("VM_PROTECT"));
+		mem_get_stats(mem, &stats);
+		size  = (code_size + stats.page_size - 1) / stats.page_size * stats.page_size;
+		size  = (size < mem_size(mem)) ? size : mem_size(mem);
+		if (attrs == -1 || cpu_protect(cpu, 0, size, attrs) == -1)
+		{
+			printf("Unable to protect the code with %s\n", getenv("VM_PROTECT"));
+		}
+	}
 
 	/*
 	 *   Simple shell
@@ -103,7 +231,12 @@ int main(int argc, char **argv)
 			printf("Enter address (dec): ");
 			scanf("%d", &addr);
 
-			mem_read(mem, addr, &buf);
+			if (mem_read(mem, addr, &buf) == -1)
+			{
+				printf("ERROR: Address out of memory or not readable: [0x%08x]\n", addr);
+				continue;
+			}
+
 			printf("Memory value at 0x%08x: 0x%08x\n", addr, buf);
 		}
 		else if (strcmp(cmd, "write") == 0)
@@ -114,10 +247,54 @@ int main(int argc, char **argv)
 			printf("Enter value (hex): ");
 			scanf("%x", &buf);
 
-			mem_write(mem, addr, buf);
+			if (mem_write(mem, addr, buf) == -1)
+			{
+				printf("ERROR: Address out of memory or not writable: [0x%08x]\n", addr);
+				continue;
+			}
+
+			cpu_invalidate(cpu, addr, WORD_SIZE);
 
 			printf("0x%08x ---> [%#x]\n", buf, addr);
 		}
+		else if (strcmp(cmd, "map") == 0)
+		{
+			printf("Enter file name: ");
+			scanf("%255s", file);
+
+			printf("Enter address (dec): ");
+			scanf("%d", &addr);
+
+			if (mem_map_file(mem, addr, file, &size) == -1)
+			{
+				printf("ERROR: Unable to map %s at [0x%08x]\n", file, addr);
+				continue;
+			}
+
+			cpu_invalidate(cpu, addr, size);
+
+			printf("%s ---> [%#x], %u bytes\n", file, addr, size);
+		}
+		else if (strcmp(cmd, "protect") == 0)
+		{
+			printf("Enter address (dec): ");
+			scanf("%d", &addr);
+
+			printf("Enter size (dec): ");
+			scanf("%d", &size);
+
+			printf("Enter attributes (rwx): ");
+			scanf("%31s", cmd);
+
+			attrs = attrs_parse(cmd);
+			if (attrs == -1 || cpu_protect(cpu, addr, size, attrs) == -1)
+			{
+				printf("ERROR: Unable to protect [0x%08x], %u bytes\n", addr, size);
+				continue;
+			}
+
+			printf("[%#x], %u bytes ---> %s\n", addr, size, cmd);
+		}
 		else if (strcmp(cmd, "next") == 0)
 		{
 			cpu_get_ip(cpu, &ip);
@@ -150,6 +327,21 @@ int main(int argc, char **argv)
 				printf("IP: [0x%08x]\n", ip);
 			}
 		}
+		else if (strcmp(cmd, "aot") == 0)
+		{
+			printf("Compiling program to native code...");
+			if (cpu_aot_emit(cpu, 0, code_size, "code.aot.c") == -1 ||
+			    aot_compile("code.aot.c", "./code.aot.so") == -1 ||
+			    cpu_aot_attach(cpu, "./code.aot.so") == -1 ||
+			    cpu_set_engine(cpu, CPU_ENGINE_AOT) == -1)
+			{
+				printf("FAILED\n");
+			}
+			else
+			{
+				printf("OK\n");
+			}
+		}
 		else if (strcmp(cmd, "quit") == 0)
 		{
 			printf("Bye.\n");
@@ -161,8 +353,11 @@ int main(int argc, char **argv)
 			printf("\tdump  - Make a dump of memory\n");
 			printf("\tread  - Read some portion of memory\n");
 			printf("\twrite - Write some value to memory\n");
+			printf("\tmap   - Map a file into memory\n");
+			printf("\tprotect - Set page attributes (r, w, x) of memory\n");
 			printf("\tnext  - Execute next CPU instruction\n");
 			printf("\trun   - Execute program in memory\n");
+			printf("\taot   - Compile program to native code ahead of time\n");
 			printf("\tquit  - Quit the shell\n");
 			printf("\thelp  - This menu\n");
 		}
@@ -175,6 +370,7 @@ int main(int argc, char **argv)
 	io_free(io);
 	mem_free(mem);
 	cpu_free(cpu);
+	cache_close(cache);
 
 	return 0;
 }
@@ -4,35 +4,356 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#endif
 #include "types.h"
 #include "mem.h"
 
+/*
+ *   Constants
+ */
+#define MEM_HUGE_DEFAULT (2U << 20) /* Huge page size when the host does not tell */
+#define MEM_READABLE     (MEM_ATTR_R | MEM_ATTR_X) /* Pages the host maps readable */
+
 /*
  *   Types
  */
 struct _mem_t
 {
-	word_t *words;
+	mem_arena_t arena;    /* Guest bytes                                   */
+	int         mapped;   /* Mapped on pages of its own (mem_map())        */
+	byte_t      *data;    /* Start of the pages of the memory              */
+	size_t      data_size;/* Bytes of them                                 */
+	size_t      page;     /* Size of the pages the memory was mapped with  */
+	size_t      huge;     /* Huge page size it is aligned to, 0 if none    */
+	int         node;     /* NUMA node the memory prefers, -1 if none      */
+	byte_t      *attrs;   /* Attributes by page, NULL while all are RWX    */
+	int         embedded; /* Lives in a block of the caller's (mem_init_at) */
 };
 
+/*
+ *   Local utility functions
+ */
+
+/*
+ *   Size of the host's huge pages
+ */
+static size_t mem_huge_size(void)
+{
+	FILE          *file;
+	char          line[128];
+	unsigned long kb;
+
+
+	file = fopen("/proc/meminfo", "r");
+	if (file == NULL)
+	{
+		return MEM_HUGE_DEFAULT;
+	}
+
+	kb = 0;
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+		{
+			break;
+		}
+	}
+
+	fclose(file);
+
+	return (kb > 0) ? (size_t)kb << 10 : MEM_HUGE_DEFAULT;
+}
+
+/*
+ *   Map the memory on pages of its own, which page attributes and
+ *   file mappings need. Addresses are checked by the callers: the
+ *   accessors here, the CPU when it decodes a command.
+ *
+ *   Nothing is committed up front: pages are zero-filled by the host
+ *   on first touch, so an instance costs the pages it touched, not
+ *   the size it declared, and a page once touched costs no lookup.
+ *
+ *   With huge pages asked for, the pages of the memory are aligned
+ *   to a huge page: MEM_HUGE_TLB maps them from the host's huge page
+ *   pool, MEM_HUGE_THP (or MEM_HUGE_TLB with the pool empty) asks for
+ *   transparent huge pages. Either falls back to normal pages.
+ */
+static int mem_map(mem_t *mem, int flags)
+{
+	size_t page;
+	size_t align;
+	size_t data;
+	byte_t *p;
+	byte_t *start;
+	int    huge;
+
+
+	page  = (size_t)sysconf(_SC_PAGESIZE);
+	align = (flags & (MEM_HUGE_THP | MEM_HUGE_TLB)) ? mem_huge_size() : page;
+	data  = ((size_t)mem->arena.size + align - 1) / align * align;
+
+	/*
+	 *   Reserve enough to align the start, then trim
+	 */
+	p = (byte_t *)mmap(NULL, data + align - page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	start = (byte_t *)(((uintptr_t)p + align - 1) / align * align);
+	if (start > p)
+	{
+		munmap(p, start - p);
+	}
+
+	if (align > page + (start - p))
+	{
+		munmap(start + data, align - page - (start - p));
+	}
+
+	huge = 0;
+#ifdef MAP_HUGETLB
+	if (flags & MEM_HUGE_TLB)
+	{
+		huge = (mmap(start, data, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+		             -1, 0) != MAP_FAILED);
+	}
+#endif
+
+	/*
+	 *   A failed MAP_FIXED mapping may leave the range unmapped, so the
+	 *   normal pages are mapped afresh rather than unprotected
+	 */
+	if (!huge && mmap(start, data, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+	                  -1, 0) == MAP_FAILED)
+	{
+		munmap(start, data);
+		return -1;
+	}
+
+#ifdef MADV_HUGEPAGE
+	if (!huge && (flags & (MEM_HUGE_THP | MEM_HUGE_TLB)))
+	{
+		madvise(start, data, MADV_HUGEPAGE);
+	}
+#endif
+
+	mem->data        = start;
+	mem->data_size   = data;
+	mem->page        = huge ? align : page;
+	mem->huge        = (flags & (MEM_HUGE_THP | MEM_HUGE_TLB)) ? align : 0;
+	mem->arena.bytes = start;
+	mem->mapped      = 1;
+
+	return 0;
+}
+
+/*
+ *   Make the pages of the memory prefer the NUMA node of the calling
+ *   thread, wherever they are first touched from. Returns the node,
+ *   -1 if it could not be done.
+ */
+static int mem_bind(mem_t *mem)
+{
+#if defined(SYS_getcpu) && defined(SYS_mbind) && defined(__linux__)
+	unsigned      cpu;
+	unsigned      node;
+	unsigned long mask;
+
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1 || node >= sizeof(mask) * 8)
+	{
+		return -1;
+	}
+
+	mask = 1UL << node;
+	if (syscall(SYS_mbind, mem->data, mem->data_size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) == -1)
+	{
+		return -1;
+	}
+
+	return (int)node;
+#else
+	return -1;
+#endif
+}
+
+/*
+ *   Bytes of the range backed by huge pages, from the host's account
+ *   of the process's mappings
+ */
+static word_t mem_huge_bytes(const byte_t *lo, const byte_t *hi)
+{
+	FILE          *file;
+	char          line[256];
+	unsigned long start;
+	unsigned long end;
+	unsigned long kb;
+	unsigned long total;
+	int           in;
+
+
+	file = fopen("/proc/self/smaps", "r");
+	if (file == NULL)
+	{
+		return 0;
+	}
+
+	in    = 0;
+	total = 0;
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+		{
+			in = (start < (uintptr_t)hi && end > (uintptr_t)lo);
+		}
+		else if (in && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+		                sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1))
+		{
+			total += kb << 10;
+		}
+	}
+
+	fclose(file);
+
+	return (total > (word_t)-1) ? (word_t)-1 : (word_t)total;
+}
+
+/*
+ *   Pages of the memory holding [addr, addr + size), size > 0
+ */
+static void mem_pages(const mem_t *mem, word_t addr, word_t size, size_t *first, size_t *last)
+{
+	size_t skew;
+
+
+	skew   = (size_t)(mem->arena.bytes - mem->data);
+	*first = (skew + addr) / mem->page;
+	*last  = (skew + addr + size - 1) / mem->page;
+}
+
+/*
+ *   Can the host access [addr, addr + size) for the guest? Reads need
+ *   pages mapped readable (R or X), writes W pages. Addresses past the
+ *   memory are left to the caller's own checks.
+ */
+static int mem_allowed(const mem_t *mem, word_t addr, word_t size, int need)
+{
+	size_t first;
+	size_t last;
+	size_t i;
+
+
+	if (mem->attrs == NULL || size == 0 || addr >= mem->arena.size)
+	{
+		return 1;
+	}
+
+	if (size > mem->arena.size - addr)
+	{
+		size = mem->arena.size - addr;
+	}
+
+	mem_pages(mem, addr, size, &first, &last);
+	for (i = first; i <= last; i++)
+	{
+		if (!(mem->attrs[i] & need))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ *   Read `size` bytes of the file from the offset
+ */
+static int mem_read_file(int fd, byte_t *at, size_t size, off_t offset)
+{
+	ssize_t n;
+
+
+	while (size > 0)
+	{
+		n = pread(fd, at, size, offset);
+		if (n <= 0)
+		{
+			return -1;
+		}
+
+		at     += n;
+		size   -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
 /*
  *   Implementation
  */
 
+/*
+ *   Allocate `size` bytes of memory, a whole number of words, mapped
+ *   on pages of its own (see mem_map()); plain heap memory where the
+ *   host cannot map it, without page attributes and file mappings.
+ */
+mem_t* mem_init(word_t size)
+{
+	return mem_init_with(size, 0);
+}
 
-mem_t* mem_init(void)
+/*
+ *   mem_init() with options (MEM_HUGE_*, MEM_NUMA_LOCAL). Options the
+ *   host cannot honour are dropped; mem_get_stats() tells what the
+ *   memory got.
+ */
+mem_t* mem_init_with(word_t size, int flags)
 {
 	mem_t *mem;
 
 
+	if (size == 0 || size % WORD_SIZE != 0)
+	{
+		return NULL;
+	}
+
 	mem = (mem_t *)malloc(sizeof(*mem));
 	if (mem == NULL)
 	{
 		return NULL;
 	}
 
-	mem->words = (word_t *)malloc(sizeof(word_t) * MEM_SIZE);
-	if (mem->words == NULL)
+	mem->arena.size = size;
+	mem->mapped     = 0;
+	mem->node       = -1;
+	mem->attrs      = NULL;
+	mem->embedded   = 0;
+	if (mem_map(mem, flags) == 0)
+	{
+		if (flags & MEM_NUMA_LOCAL)
+		{
+			mem->node = mem_bind(mem);
+		}
+
+		return mem;
+	}
+
+	mem->page        = (size_t)sysconf(_SC_PAGESIZE);
+	mem->huge        = 0;
+	mem->arena.bytes = (byte_t *)calloc(size, sizeof(byte_t));
+	if (mem->arena.bytes == NULL)
 	{
 		free(mem);
 		return NULL;
@@ -41,6 +362,47 @@ mem_t* mem_init(void)
 	return mem;
 }
 
+/*
+ *   Bytes mem_init_at() needs for a memory of `size` bytes, a whole
+ *   number of cache lines
+ */
+size_t mem_footprint(word_t size)
+{
+	return CACHE_ALIGN(sizeof(mem_t)) + CACHE_ALIGN((size_t)size);
+}
+
+/*
+ *   Memory in a block of the caller's: mem_footprint(size) zero-filled
+ *   bytes at `p`, aligned to a cache line. The guest bytes follow the
+ *   state structure; like the heap fallback of mem_init() the memory
+ *   has no pages of its own, so mem_protect() is not available.
+ *   mem_free() leaves the block to the caller.
+ */
+mem_t* mem_init_at(void *p, word_t size)
+{
+	mem_t *mem;
+
+
+	if (p == NULL || (uintptr_t)p % CACHE_LINE != 0 || size == 0 || size % WORD_SIZE != 0)
+	{
+		return NULL;
+	}
+
+	mem = (mem_t *)p;
+	mem->arena.bytes = (byte_t *)p + CACHE_ALIGN(sizeof(mem_t));
+	mem->arena.size  = size;
+	mem->mapped      = 0;
+	mem->data        = mem->arena.bytes;
+	mem->data_size   = CACHE_ALIGN((size_t)size);
+	mem->page        = (size_t)sysconf(_SC_PAGESIZE);
+	mem->huge        = 0;
+	mem->node        = -1;
+	mem->attrs       = NULL;
+	mem->embedded    = 1;
+
+	return mem;
+}
+
 int mem_free(mem_t *mem)
 {
 	if (mem == NULL)
@@ -51,7 +413,21 @@ int mem_free(mem_t *mem)
 	/*
 	 *   Free memory state structure items
 	 */
-	free(mem->words);
+	if (mem->mapped)
+	{
+		munmap(mem->data, mem->data_size);
+	}
+	else if (!mem->embedded)
+	{
+		free(mem->arena.bytes);
+	}
+
+	free(mem->attrs);
+
+	if (mem->embedded)
+	{
+		return 0;
+	}
 
 	/*
 	 *   Free memory state structure itself
@@ -61,34 +437,368 @@ int mem_free(mem_t *mem)
 	return 0;
 }
 
+/*
+ *   Aligned word access, addresses rounded down to a word
+ */
 int mem_read(mem_t *mem, word_t addr, word_t *w)
 {
-	word_t     w_addr;
+	if (mem == NULL || w == NULL)
+	{
+		return -1;
+	}
 
+	addr = addr / WORD_SIZE * WORD_SIZE;
+	if (!mem_allowed(mem, addr, WORD_SIZE, MEM_READABLE))
+	{
+		return -1;
+	}
 
+	return mem_load_u32(&mem->arena, addr, w);
+}
+
+int mem_write(mem_t *mem, word_t addr, word_t w)
+{
+	if (mem == NULL)
+	{
+		return -1;
+	}
+
+	addr = addr / WORD_SIZE * WORD_SIZE;
+	if (!mem_allowed(mem, addr, WORD_SIZE, MEM_ATTR_W))
+	{
+		return -1;
+	}
+
+	return mem_store_u32(&mem->arena, addr, w);
+}
+
+/*
+ *   Byte-addressed access, see mem_load_u8() and mem_load_u32()
+ */
+int mem_load_word(mem_t *mem, word_t addr, word_t *w)
+{
 	if (mem == NULL || w == NULL)
 	{
 		return -1;
 	}
 
-	w_addr = addr / WORD_SIZE;
-	*w     = mem->words[w_addr];
+	if (!mem_allowed(mem, addr, WORD_SIZE, MEM_READABLE))
+	{
+		return -1;
+	}
+
+	return mem_load_u32(&mem->arena, addr, w);
+}
+
+int mem_store_word(mem_t *mem, word_t addr, word_t w)
+{
+	if (mem == NULL)
+	{
+		return -1;
+	}
+
+	if (!mem_allowed(mem, addr, WORD_SIZE, MEM_ATTR_W))
+	{
+		return -1;
+	}
+
+	return mem_store_u32(&mem->arena, addr, w);
+}
+
+int mem_load_byte(mem_t *mem, word_t addr, byte_t *b)
+{
+	if (mem == NULL || b == NULL)
+	{
+		return -1;
+	}
+
+	if (!mem_allowed(mem, addr, 1, MEM_READABLE))
+	{
+		return -1;
+	}
+
+	return mem_load_u8(&mem->arena, addr, b);
+}
+
+int mem_store_byte(mem_t *mem, word_t addr, byte_t b)
+{
+	if (mem == NULL)
+	{
+		return -1;
+	}
+
+	if (!mem_allowed(mem, addr, 1, MEM_ATTR_W))
+	{
+		return -1;
+	}
+
+	return mem_store_u8(&mem->arena, addr, b);
+}
+
+/*
+ *   Block transfer between the memory and a host buffer, at memcpy
+ *   speed. The whole block has to lie in the memory.
+ */
+int mem_write_block(mem_t *mem, word_t addr, const void *data, word_t size)
+{
+	if (mem == NULL || data == NULL)
+	{
+		return -1;
+	}
+
+	if (size > mem->arena.size || addr > mem->arena.size - size || !mem_allowed(mem, addr, size, MEM_ATTR_W))
+	{
+		return -1;
+	}
+
+	memcpy(mem->arena.bytes + addr, data, size);
 
 	return 0;
 }
 
-int mem_write(mem_t *mem, word_t addr, word_t w)
+int mem_read_block(mem_t *mem, word_t addr, void *data, word_t size)
+{
+	if (mem == NULL || data == NULL)
+	{
+		return -1;
+	}
+
+	if (size > mem->arena.size || addr > mem->arena.size - size || !mem_allowed(mem, addr, size, MEM_READABLE))
+	{
+		return -1;
+	}
+
+	memcpy(data, mem->arena.bytes + addr, size);
+
+	return 0;
+}
+
+/*
+ *   Back the memory from the address on with the contents of the
+ *   file. The file is mapped private: its pages are read in as the
+ *   guest touches them, copied by the host when the guest writes
+ *   them, and the file itself never changes, so loading costs the
+ *   same whatever the size of the file. Mapping needs memory mapped
+ *   on normal pages and `addr` on a page boundary; otherwise the
+ *   file is read in. `size` gets the bytes loaded.
+ */
+int mem_map_file(mem_t *mem, word_t addr, const char *path, word_t *size)
+{
+	struct stat st;
+	size_t      page;
+	size_t      mapped;
+	byte_t      *at;
+	int         fd;
+	int         ret;
+
+
+	if (mem == NULL || path == NULL || size == NULL)
+	{
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size > (off_t)mem->arena.size ||
+	    addr > mem->arena.size - (word_t)st.st_size ||
+	    !mem_allowed(mem, addr, (word_t)st.st_size, MEM_ATTR_W))
+	{
+		close(fd);
+		return -1;
+	}
+
+	/*
+	 *   Whole pages of the file are mapped over the memory, the
+	 *   rest is read in so the bytes following it stay as they are
+	 */
+	at     = mem->arena.bytes + addr;
+	page   = (size_t)sysconf(_SC_PAGESIZE);
+	mapped = 0;
+	if (mem->mapped && mem->page == page && (uintptr_t)at % page == 0)
+	{
+		mapped = (size_t)st.st_size / page * page;
+	}
+
+	if (mapped > 0 && mmap(at, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+	{
+		/*
+		 *   A failed fixed mapping may leave a hole: put memory
+		 *   back and read the whole file in
+		 */
+		if (mmap(at, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+		         -1, 0) == MAP_FAILED)
+		{
+			close(fd);
+			return -1;
+		}
+
+		mapped = 0;
+	}
+
+	ret = mem_read_file(fd, at + mapped, (size_t)st.st_size - mapped, (off_t)mapped);
+	close(fd);
+	if (ret == -1)
+	{
+		return -1;
+	}
+
+	*size = (word_t)st.st_size;
+
+	return 0;
+}
+
+int mem_get_stats(mem_t *mem, mem_stats_t *stats)
+{
+	if (mem == NULL || stats == NULL)
+	{
+		return -1;
+	}
+
+	stats->page_size  = (word_t)mem->page;
+	stats->huge_size  = (word_t)mem->huge;
+	stats->huge_bytes = mem->mapped ? mem_huge_bytes(mem->data, mem->data + mem->data_size) : 0;
+	stats->node       = mem->node;
+
+	return 0;
+}
+
+/*
+ *   Set the attributes of the pages of [addr, addr + size), which
+ *   has to start and end on page boundaries (or at the end of the
+ *   memory). The CPU checks all three in software: R and W on the
+ *   loads and stores to pages it watches, X when it decodes, so its
+ *   engines stop on a denied access with their state up to date.
+ *   The host's page protection backs R and W up where it can (a page
+ *   keeping X stays readable) and the host's own accessors honour
+ *   all three. Needs memory mapped on pages of its own.
+ */
+int mem_protect(mem_t *mem, word_t addr, word_t size, int attrs)
 {
-	word_t     w_addr;
+	size_t first;
+	size_t last;
+	size_t skew;
+	size_t i;
+	int    prot;
+
+
+	if (mem == NULL || !mem->mapped || size == 0 || (attrs & ~MEM_ATTR_RWX) != 0)
+	{
+		return -1;
+	}
+
+	skew = (size_t)(mem->arena.bytes - mem->data);
+	if (size > mem->arena.size || addr > mem->arena.size - size || (skew + addr) % mem->page != 0 ||
+	    ((skew + addr + size) % mem->page != 0 && addr + size != mem->arena.size))
+	{
+		return -1;
+	}
+
+	if (mem->attrs == NULL)
+	{
+		mem->attrs = (byte_t *)malloc(mem->data_size / mem->page);
+		if (mem->attrs == NULL)
+		{
+			return -1;
+		}
+
+		memset(mem->attrs, MEM_ATTR_RWX, mem->data_size / mem->page);
+	}
+
+	/*
+	 *   Commands are fetched through host reads, so X maps readable
+	 */
+	prot  = (attrs & (MEM_ATTR_R | MEM_ATTR_X)) ? PROT_READ : PROT_NONE;
+	prot |= (attrs & MEM_ATTR_W) ? PROT_WRITE : 0;
 
+	mem_pages(mem, addr, size, &first, &last);
+	if (mprotect(mem->data + first * mem->page, (last - first + 1) * mem->page, prot) == -1)
+	{
+		return -1;
+	}
 
+	for (i = first; i <= last; i++)
+	{
+		mem->attrs[i] = (byte_t)attrs;
+	}
+
+	return 0;
+}
+
+/*
+ *   Attributes of the pages of [addr, addr + size): `all` gets those
+ *   every page has, `any` those some page has
+ */
+int mem_get_attrs(mem_t *mem, word_t addr, word_t size, int *all, int *any)
+{
+	size_t first;
+	size_t last;
+	size_t i;
+
+
+	if (mem == NULL || all == NULL || any == NULL || size == 0 ||
+	    size > mem->arena.size || addr > mem->arena.size - size)
+	{
+		return -1;
+	}
+
+	*all = MEM_ATTR_RWX;
+	*any = MEM_ATTR_RWX;
+	if (mem->attrs == NULL)
+	{
+		return 0;
+	}
+
+	*any = 0;
+	mem_pages(mem, addr, size, &first, &last);
+	for (i = first; i <= last; i++)
+	{
+		*all &= mem->attrs[i];
+		*any |= mem->attrs[i];
+	}
+
+	return 0;
+}
+
+word_t mem_size(mem_t *mem)
+{
 	if (mem == NULL)
+	{
+		return 0;
+	}
+
+	return mem->arena.size;
+}
+
+/*
+ *   Host address of guest byte 0, for callers that have checked
+ *   their addresses against the memory size themselves
+ */
+byte_t* mem_bytes(mem_t *mem)
+{
+	if (mem == NULL)
+	{
+		return NULL;
+	}
+
+	return mem->arena.bytes;
+}
+
+/*
+ *   Flat view of the memory, for callers accessing it through the
+ *   inline helpers of mem.h
+ */
+int mem_get_arena(mem_t *mem, mem_arena_t *arena)
+{
+	if (mem == NULL || arena == NULL)
 	{
 		return -1;
 	}
 
-	w_addr             = addr / WORD_SIZE;
-	mem->words[w_addr] = w;
+	*arena = mem->arena;
 
 	return 0;
 }
@@ -105,15 +815,14 @@ int mem_dump(mem_t *mem, word_t addr, word_t size)
 		return -1;
 	}
 
-	if (addr % WORD_SIZE != 0)
-	{
-		return -1;
-	}
-
 	printf("---------------- Memory ----------------\n");
-	for (i = addr; i < size; i += 4)
+	for (i = addr; i < size; i += WORD_SIZE)
 	{
-		word.w = mem->words[i / 4];
+		if (!mem_allowed(mem, i, WORD_SIZE, MEM_READABLE) ||
+		    mem_load_u32(&mem->arena, i, &word.w) == -1)
+		{
+			return -1;
+		}
 
 		printf("[0x%08x]: ", i);
 		for (j = 0; j < WORD_SIZE; j++)
@@ -5,25 +5,156 @@
 /*
  *   Includes
  */
+#include <string.h>
 #include "types.h"
 
 /*
  *   Constants
  */
-#define MEM_SIZE 1024 /* in words */
+#define MEM_SIZE 1024 /* Default size, in words */
+
+/*
+ *   Options of mem_init_with()
+ */
+#define MEM_HUGE_THP   0x01 /* Transparent huge pages                          */
+#define MEM_HUGE_TLB   0x02 /* Pages from the huge page pool, else as THP      */
+#define MEM_NUMA_LOCAL 0x04 /* Prefer the NUMA node of the thread creating it  */
+
+/*
+ *   Page attributes. Pages are those of mem_get_stats(), counted
+ *   from the start of the pages of the memory; every page starts
+ *   out with all three.
+ */
+#define MEM_ATTR_R   0x01 /* The guest may load from the page           */
+#define MEM_ATTR_W   0x02 /* The guest may store to the page            */
+#define MEM_ATTR_X   0x04 /* The guest may run commands from the page   */
+#define MEM_ATTR_RWX (MEM_ATTR_R | MEM_ATTR_W | MEM_ATTR_X)
 
 /*
  *   Types
  */
 typedef struct _mem_t mem_t;
 
+/*
+ *   Flat view of a memory: `size` bytes from `bytes`, valid as long
+ *   as the memory is
+ */
+typedef struct _mem_arena_t
+{
+	byte_t *bytes; /* Guest byte 0    */
+	word_t size;   /* Bytes of memory */
+} mem_arena_t;
+
+/*
+ *   What the memory got from the host. page_size is the granularity
+ *   of its mapping and of mem_protect(): the huge page size for pages
+ *   from the pool, the normal one otherwise, transparent huge pages
+ *   included, as the host may split those at any time. huge_bytes
+ *   tells how much of it they back.
+ */
+typedef struct _mem_stats_t
+{
+	word_t page_size;  /* Size of the pages it was mapped with            */
+	word_t huge_size;  /* Huge page size it is aligned to, 0 if none      */
+	word_t huge_bytes; /* Bytes of it on huge pages now (transparent too) */
+	int    node;       /* NUMA node it prefers, -1 if none                */
+} mem_stats_t;
+
 /*
  *   Prototypes
  */
-mem_t* mem_init (void);
+mem_t* mem_init (word_t size);
+mem_t* mem_init_with(word_t size, int flags);
+mem_t* mem_init_at  (void *p, word_t size);
+size_t mem_footprint(word_t size);
 int    mem_free (mem_t *mem);
 int    mem_read (mem_t *mem, word_t addr, word_t *w);
 int    mem_write(mem_t *mem, word_t addr, word_t w);
+int    mem_load_word (mem_t *mem, word_t addr, word_t *w);
+int    mem_store_word(mem_t *mem, word_t addr, word_t w);
+int    mem_load_byte (mem_t *mem, word_t addr, byte_t *b);
+int    mem_store_byte(mem_t *mem, word_t addr, byte_t b);
+int    mem_write_block(mem_t *mem, word_t addr, const void *data, word_t size);
+int    mem_read_block (mem_t *mem, word_t addr, void *data, word_t size);
+int    mem_map_file   (mem_t *mem, word_t addr, const char *path, word_t *size);
 int    mem_dump (mem_t *mem, word_t addr, word_t size);
+byte_t* mem_bytes(mem_t *mem);
+word_t mem_size (mem_t *mem);
+int    mem_get_stats(mem_t *mem, mem_stats_t *stats);
+int    mem_protect  (mem_t *mem, word_t addr, word_t size, int attrs);
+int    mem_get_attrs(mem_t *mem, word_t addr, word_t size, int *all, int *any);
+int    mem_get_arena(mem_t *mem, mem_arena_t *arena);
+
+/*
+ *   Typed access to an arena. Any address works, aligned or not;
+ *   each access is a single host load or store of its width, and
+ *   fails when it would run past the end of the memory.
+ */
+static inline int mem_load_u8(const mem_arena_t *arena, word_t addr, byte_t *v)
+{
+	if (addr >= arena->size)
+	{
+		return -1;
+	}
+
+	*v = arena->bytes[addr];
+
+	return 0;
+}
+
+static inline int mem_store_u8(const mem_arena_t *arena, word_t addr, byte_t v)
+{
+	if (addr >= arena->size)
+	{
+		return -1;
+	}
+
+	arena->bytes[addr] = v;
+
+	return 0;
+}
+
+static inline int mem_load_u32(const mem_arena_t *arena, word_t addr, word_t *v)
+{
+	if (addr > arena->size - WORD_SIZE)
+	{
+		return -1;
+	}
+
+	memcpy(v, arena->bytes + addr, WORD_SIZE);
+
+	return 0;
+}
+
+static inline int mem_store_u32(const mem_arena_t *arena, word_t addr, word_t v)
+{
+	if (addr > arena->size - WORD_SIZE)
+	{
+		return -1;
+	}
+
+	memcpy(arena->bytes + addr, &v, WORD_SIZE);
+
+	return 0;
+}
+
+/*
+ *   Unchecked word access, for addresses the caller has checked
+ *   against the memory already (the CPU does when it decodes)
+ */
+static inline word_t mem_peek_u32(const mem_arena_t *arena, word_t addr)
+{
+	word_t v;
+
+
+	memcpy(&v, arena->bytes + addr, WORD_SIZE);
+
+	return v;
+}
+
+static inline void mem_poke_u32(const mem_arena_t *arena, word_t addr, word_t v)
+{
+	memcpy(arena->bytes + addr, &v, WORD_SIZE);
+}
 
 #endif /* __MEM_H__ */
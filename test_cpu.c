@@ -0,0 +1,1311 @@
+/*
+ *   Includes
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "types.h"
+#include "asm.h"
+#include "cpu.h"
+#include "isa.h"
+#include "mem.h"
+#include "io.h"
+#include "vm.h"
+#include "aot.h"
+#include "batch.h"
+#include "cache.h"
+
+/*
+ *   Differential test of the run engines. Every program runs on the
+ *   portable engine without superinstructions, then on every engine
+ *   with superinstructions on and off and on the batch engine; each
+ *   run has to end the way the first one did: same return value,
+ *   commands executed, registers, flags and memory.
+ */
+
+/*
+ *   Constants
+ */
+#define TEST_MEM     (2 * MEM_SIZE * WORD_SIZE) /* Bytes of memory of a run              */
+#define TEST_HIGH    (MEM_SIZE * WORD_SIZE)     /* Start of the upper half of memory     */
+#define TEST_BUDGET  1000000                    /* Commands a run may execute at most    */
+#define TEST_CODE    4096                       /* Bytes of code of a program, at most   */
+#define TEST_SLICE   1000                       /* Budget of a run of the budget check   */
+#define TEST_OVERRUN 4                          /* Commands a run may go past its budget */
+#define TEST_PATH    128                        /* Longest path of a cache entry         */
+#define TEST_FILE    (TEST_MEM / 4 * 3)         /* Bytes of the file of the mapping check */
+
+/*
+ *   Types
+ */
+typedef struct _test_prog_t
+{
+	const char *name;
+	const char *text;  /* Assembler source                           */
+	int        closed; /* Attributes taken from the upper half of memory */
+} test_prog_t;
+
+/*
+ *   How a run ended
+ */
+typedef struct _test_end_t
+{
+	int         ret;      /* cpu_run_budget() return value */
+	word_t      executed; /* Commands executed             */
+	cpu_state_t state;    /* Registers and flags           */
+	byte_t      *mem;     /* Memory, TEST_MEM bytes        */
+} test_end_t;
+
+typedef struct _test_engine_t
+{
+	const char   *name;
+	cpu_engine_t engine;
+	int          fusion;
+} test_engine_t;
+
+/*
+ *   Access to the upper half of memory with an attribute taken away
+ */
+typedef struct _test_attr_t
+{
+	const char *name;
+	const char *text;     /* Assembler source                         */
+	int        closed;    /* Attribute taken from the upper half      */
+	word_t     ip;        /* Address of the command that has to fault */
+	word_t     executed;  /* Commands run before it                   */
+} test_attr_t;
+
+typedef struct _test_check_t
+{
+	const char *name;
+	int        (*check)(const test_engine_t *engine); /* Failures on the engine              */
+	int        engines;                               /* Run on every engine, not just one */
+} test_check_t;
+
+/*
+ *   Programs
+ */
+static const test_prog_t test_progs[] =
+{
+	{
+		"factorial",
+		"start\n"
+		"	mov $1 g0\n"
+		"	mov n  g1\n"
+		"	mov $1 g2\n"
+		"do\n"
+		"	mul  g1 g0\n"
+		"	sub  g1 g2\n"
+		"	mov  g2 g1\n"
+		"	mov  $1 g2\n"
+		"	cmp  $0 g1\n"
+		"	je   $done\n"
+		"	jump $do\n"
+		"done\n"
+		"	halt\n"
+		"n\n"
+		"	word 5\n"
+	},
+	{
+		/*
+		 *   Every addressing mode, branches taken and not taken,
+		 *   jumps through a register and through memory
+		 */
+		"branches",
+		"start\n"
+		"	mov $7 g0\n"
+		"	mov $3 g1\n"
+		"	mov g0 800\n"
+		"	add g1 800\n"
+		"	sub $100 800\n"
+		"	mul $2 800\n"
+		"	div $3 800\n"
+		"	add 800 g2\n"
+		"	mov 800 g3\n"
+		"	sub 800 g3\n"
+		"	mul g0 g1\n"
+		"	div g1 g0\n"
+		"	cmp g0 g1\n"
+		"	jg $x\n"
+		"	add $1 g5\n"
+		"x\n"
+		"	cmp 800 g1\n"
+		"	je $y\n"
+		"	add $1 g6\n"
+		"y\n"
+		"	cmp g1 800\n"
+		"	jg $z\n"
+		"	add $1 g7\n"
+		"z\n"
+		"	cmp $5 800\n"
+		"	cmp $5 g0\n"
+		"	je $w\n"
+		"	mov $1 g8\n"
+		"w\n"
+		"	mov $wl g9\n"
+		"	jump g9\n"
+		"	halt\n"
+		"wl\n"
+		"	mov $v g10\n"
+		"	mov g10 804\n"
+		"	jump 804\n"
+		"	halt\n"
+		"v\n"
+		"	mov 804 g11\n"
+		"	add g11 g12\n"
+		"	sub g12 g11\n"
+		"	cmp $0 g11\n"
+		"	je $end\n"
+		"	mov $99 g13\n"
+		"end\n"
+		"	halt\n"
+	},
+	{
+		/*
+		 *   Long enough to be promoted through every tier and traced
+		 */
+		"loop",
+		"start\n"
+		"	mov $0 g3\n"
+		"loop\n"
+		"	mov g3 2048\n"
+		"	add $1 g3\n"
+		"	mov 2048 g4\n"
+		"	add g4 g5\n"
+		"	cmp $100000 g3\n"
+		"	je $end\n"
+		"	jump $loop\n"
+		"end\n"
+		"	halt\n"
+	},
+	{
+		/*
+		 *   Superinstruction pairs, in and out of hot loops
+		 */
+		"pairs",
+		"start\n"
+		"	mov $0 g3\n"
+		"loop\n"
+		"	mov $1 g1\n"
+		"	add g1 g2\n"
+		"	mov $4 22\n"
+		"	add $1 g3\n"
+		"	cmp $3000 g3\n"
+		"	je $next\n"
+		"	jump $loop\n"
+		"next\n"
+		"	mov $1 g4\n"
+		"mid\n"
+		"	add g4 g5\n"
+		"	cmp $10 g5\n"
+		"	jg $mid\n"
+		"	halt\n"
+	},
+	{
+		"div0",
+		"start\n"
+		"	mov $0 g1\n"
+		"	mov $3 g0\n"
+		"	div $5 g1\n"
+		"	mov $2 g2\n"
+		"	halt\n"
+	},
+	{
+		/*
+		 *   A store over the operand of a command already run
+		 */
+		"smc",
+		"start\n"
+		"	mov $0 g3\n"
+		"loop\n"
+		"	mov $1 g1\n"
+		"	add g1 g2\n"
+		"	mov $5 12\n"
+		"	add $1 g3\n"
+		"	cmp $2 g3\n"
+		"	je $end\n"
+		"	jump $loop\n"
+		"end\n"
+		"	halt\n"
+	},
+	{
+		/*
+		 *   A hot loop storing over the operand of its own add $0 g4
+		 *   (at 30, operand at 32) on every iteration
+		 */
+		"smc_hot",
+		"start\n"
+		"	mov $0 g3\n"
+		"loop\n"
+		"	mov g3 32\n"
+		"	add $1 g3\n"
+		"	add $0 g4\n"
+		"	cmp $5000 g3\n"
+		"	je $end\n"
+		"	jump $loop\n"
+		"end\n"
+		"	halt\n"
+	},
+	{
+		/*
+		 *   IP read right after a mov $imm it may be fused with, in
+		 *   a hot loop. The assembler has no name for IP, so the
+		 *   words hold mov ip g1 and add ip g2.
+		 */
+		"ip_read",
+		"start\n"
+		"	mov $0 g3\n"
+		"loop\n"
+		"	mov $1 g0\n"
+		"ip0\n"
+		"	word 1029\n"
+		"ip1\n"
+		"	word 196608\n"
+		"ip2\n"
+		"	word 67174400\n"
+		"ip3\n"
+		"	word 0\n"
+		"ip4\n"
+		"	word 4\n"
+		"	add $1 g3\n"
+		"	cmp $3000 g3\n"
+		"	je $end\n"
+		"	jump $loop\n"
+		"end\n"
+		"	halt\n"
+	},
+	{
+		"fault_load",
+		"start\n"
+		"	mov $1 g1\n"
+		"	mov $2 g3\n"
+		"	mov 9000 g2\n"
+		"	halt\n"
+	},
+	{
+		"fault_store",
+		"start\n"
+		"	mov $0 g3\n"
+		"loop\n"
+		"	add $1 g3\n"
+		"	cmp $2000 g3\n"
+		"	jg $loop\n"
+		"	mov g3 8190\n"
+		"	halt\n"
+	},
+	{
+		"fault_jump",
+		"start\n"
+		"	mov $7 g0\n"
+		"	jump $20000\n"
+		"	halt\n"
+	},
+	{
+		/*
+		 *   Upper half closed: the first load from it, past a hot
+		 *   loop, fails
+		 */
+		"fault_unread",
+		"start\n"
+		"	mov $0 g3\n"
+		"loop\n"
+		"	mov g3 2048\n"
+		"	add $1 g3\n"
+		"	cmp $2000 g3\n"
+		"	jg $loop\n"
+		"	mov $5 g0\n"
+		"	add 4096 g2\n"
+		"	halt\n",
+		MEM_ATTR_RWX
+	},
+	{
+		/*
+		 *   Never halts: ends on the budget
+		 */
+		"budget",
+		"start\n"
+		"	mov $0 g0\n"
+		"loop\n"
+		"	add $1 g0\n"
+		"	mov g0 1000\n"
+		"	jump $loop\n"
+	},
+};
+
+#define NR_TEST_PROGS (sizeof(test_progs) / sizeof(test_progs[0]))
+
+/*
+ *   Program of the checks: 1 + 4 * 3000 + 1 commands to the halt
+ */
+#define TEST_COUNTED    \
+	"start\n"           \
+	"	mov $0 g3\n"     \
+	"loop\n"            \
+	"	add $1 g3\n"     \
+	"	mov g3 2048\n"   \
+	"	cmp $3000 g3\n"  \
+	"	jg $loop\n"      \
+	"	halt\n"
+#define TEST_COUNTED_NR (1 + 4 * 3000 + 1)
+
+/*
+ *   Loop long enough to get hot, then one access to the upper half
+ *   by the command at 36, after 1 + 3 * 2000 commands
+ */
+#define TEST_WARM       \
+	"start\n"           \
+	"	mov $0 g3\n"     \
+	"loop\n"            \
+	"	add $1 g3\n"     \
+	"	cmp $2000 g3\n"  \
+	"	jg $loop\n"
+#define TEST_WARM_NR    (1 + 3 * 2000)
+
+static const test_attr_t test_attrs[] =
+{
+	{ "store", TEST_WARM "	mov g3 4096\n" "	halt\n", MEM_ATTR_W, 36,   TEST_WARM_NR     },
+	{ "load",  TEST_WARM "	add 4096 g2\n" "	halt\n", MEM_ATTR_R, 36,   TEST_WARM_NR     },
+	{ "fetch", TEST_WARM "	jump $4096\n"  "	halt\n", MEM_ATTR_X, 4096, TEST_WARM_NR + 1 },
+};
+
+#define NR_TEST_ATTRS (sizeof(test_attrs) / sizeof(test_attrs[0]))
+
+static const test_engine_t test_reference = { "portable", CPU_ENGINE_PORTABLE, 0 };
+
+static const test_engine_t test_engines[] =
+{
+	{ "portable+fusion", CPU_ENGINE_PORTABLE, 1 },
+	{ "threaded",        CPU_ENGINE_THREADED, 0 },
+	{ "threaded+fusion", CPU_ENGINE_THREADED, 1 },
+	{ "jit",             CPU_ENGINE_JIT,      0 },
+	{ "jit+fusion",      CPU_ENGINE_JIT,      1 },
+	{ "tiered",          CPU_ENGINE_TIERED,   0 },
+	{ "tiered+fusion",   CPU_ENGINE_TIERED,   1 },
+	{ "aot",             CPU_ENGINE_AOT,      0 },
+	{ "aot+fusion",      CPU_ENGINE_AOT,      1 },
+};
+
+#define NR_TEST_ENGINES (sizeof(test_engines) / sizeof(test_engines[0]))
+
+/*
+ *   Local utility functions
+ */
+
+/*
+ *   Assemble the source of the program through a file
+ */
+static int test_assemble(const test_prog_t *prog, byte_t *code, word_t *size)
+{
+	char path[64];
+	FILE *file;
+	int  ret;
+
+
+	snprintf(path, sizeof(path), "/tmp/test_cpu_%d.text", (int)getpid());
+	file = fopen(path, "w");
+	if (file == NULL)
+	{
+		return -1;
+	}
+
+	fputs(prog->text, file);
+	fclose(file);
+
+	ret = asm_assemble_to(path, code, TEST_CODE, size);
+	remove(path);
+
+	return ret;
+}
+
+/*
+ *   Attach an ahead-of-time module built from the code
+ */
+static int test_aot(cpu_t *cpu, word_t size)
+{
+	char src[64];
+	char so[64];
+	int  ret;
+
+
+	snprintf(src, sizeof(src), "/tmp/test_cpu_%d.c", (int)getpid());
+	snprintf(so, sizeof(so), "/tmp/test_cpu_%d.so", (int)getpid());
+
+	ret = cpu_aot_emit(cpu, 0, size, src);
+	if (ret == 0)
+	{
+		ret = aot_compile(src, so);
+	}
+
+	if (ret == 0)
+	{
+		ret = cpu_aot_attach(cpu, so);
+	}
+
+	remove(src);
+	remove(so);
+
+	return ret;
+}
+
+/*
+ *   Run the code on the engine, with the attributes taken from the
+ *   upper half of memory. Returns 0 when it ran, 1 when the engine is
+ *   not available, -1 on failure to set the run up.
+ */
+static int test_run(const byte_t *code, word_t size, int closed, cpu_engine_t engine, int fusion, test_end_t *end)
+{
+	mem_t *mem;
+	io_t  *io;
+	cpu_t *cpu;
+	int   ret;
+
+
+	mem = mem_init(TEST_MEM);
+	io  = io_init();
+	cpu = (mem != NULL && io != NULL) ? cpu_init(mem, io) : NULL;
+	if (cpu == NULL)
+	{
+		cpu_free(cpu);
+		io_free(io);
+		mem_free(mem);
+		return -1;
+	}
+
+	ret  = cpu_poweron(cpu);
+	ret += cpu_set_fusion(cpu, fusion);
+	ret += cpu_load_code(cpu, 0, (byte_t *)code, size);
+	if (ret == 0 && engine == CPU_ENGINE_AOT && test_aot(cpu, size) == -1)
+	{
+		ret = 1;
+	}
+
+	if (ret == 0 && cpu_set_engine(cpu, engine) == -1)
+	{
+		ret = 1;
+	}
+
+	if (ret == 0 && closed != 0)
+	{
+		ret = cpu_protect(cpu, TEST_HIGH, TEST_MEM - TEST_HIGH, MEM_ATTR_RWX & ~closed);
+	}
+
+	if (ret == 0)
+	{
+		end->ret = cpu_run_budget(cpu, TEST_BUDGET, &end->executed);
+		cpu_get_state(cpu, &end->state);
+		ret = (closed != 0) ? cpu_protect(cpu, TEST_HIGH, TEST_MEM - TEST_HIGH, MEM_ATTR_RWX) : 0;
+		memcpy(end->mem, mem_bytes(mem), TEST_MEM);
+	}
+
+	cpu_free(cpu);
+	io_free(io);
+	mem_free(mem);
+
+	return (ret < 0) ? -1 : ret;
+}
+
+/*
+ *   Run the code as the only instance of a batch. The batch engine
+ *   does not hand memory back, so the reference's is taken for it.
+ *   Its lanes hold BATCH_MEM bytes, the lower half of memory only:
+ *   programs touching the upper half fault past the end of both.
+ */
+static int test_batch(const byte_t *code, word_t size, const test_end_t *ref, test_end_t *end)
+{
+	batch_patch_t  patch;
+	batch_result_t result;
+
+
+	/*
+	 *   A lane needs a patch: store the zero already there
+	 */
+	patch.addr  = BATCH_MEM - WORD_SIZE;
+	patch.value = 0;
+	if (batch_run(code, size, &patch, 1, TEST_BUDGET, &result) == -1)
+	{
+		return -1;
+	}
+
+	end->ret      = result.ret;
+	end->executed = result.executed;
+	end->state    = result.state;
+	memcpy(end->mem, ref->mem, TEST_MEM);
+
+	return 0;
+}
+
+/*
+ *   Tell how the run differs from the reference. Returns the number
+ *   of differences.
+ */
+static int test_compare(const char *prog, const char *engine, const test_end_t *ref, const test_end_t *end)
+{
+	word_t i;
+	int    diffs;
+
+
+	diffs = 0;
+	if (end->ret != ref->ret || end->executed != ref->executed)
+	{
+		printf("\t%s on %s: returned %d after %u commands, expected %d after %u\n", prog, engine,
+		       end->ret, end->executed, ref->ret, ref->executed);
+		diffs++;
+	}
+
+	for (i = 0; i < CPU_NR_REGS; i++)
+	{
+		if (end->state.regs[i] != ref->state.regs[i])
+		{
+			printf("\t%s on %s: register %u is 0x%08x, expected 0x%08x\n", prog, engine, i,
+			       end->state.regs[i], ref->state.regs[i]);
+			diffs++;
+		}
+	}
+
+	/*
+	 *   Native code may hand back a compare as an equivalent pair
+	 *   of operands (see jit.c), so the flags they give are compared
+	 */
+	if (ISA_FLAG_EQU(end->state.cmp[0], end->state.cmp[1]) != ISA_FLAG_EQU(ref->state.cmp[0], ref->state.cmp[1]) ||
+	    ISA_FLAG_GREATER(end->state.cmp[0], end->state.cmp[1]) !=
+	    ISA_FLAG_GREATER(ref->state.cmp[0], ref->state.cmp[1]) ||
+	    end->state.halt != ref->state.halt || end->state.error != ref->state.error)
+	{
+		printf("\t%s on %s: flags differ (cmp %u/%u halt %u error %u, expected cmp %u/%u halt %u error %u)\n",
+		       prog, engine, end->state.cmp[0], end->state.cmp[1], end->state.halt, end->state.error,
+		       ref->state.cmp[0], ref->state.cmp[1], ref->state.halt, ref->state.error);
+		diffs++;
+	}
+
+	for (i = 0; i < TEST_MEM; i++)
+	{
+		if (end->mem[i] != ref->mem[i])
+		{
+			printf("\t%s on %s: memory differs first at 0x%08x\n", prog, engine, i);
+			diffs++;
+			break;
+		}
+	}
+
+	return diffs;
+}
+
+/*
+ *   Set up an instance running the source on the engine. Returns 0
+ *   when it is ready, 1 when the engine is not available, -1 on
+ *   failure to set it up.
+ */
+static int test_open(const char *text, cpu_engine_t engine, int fusion, vm_t **vm)
+{
+	static byte_t code[TEST_CODE];
+	test_prog_t   prog;
+	word_t        size;
+	cpu_t         *cpu;
+	int           ret;
+
+
+	prog.name   = "check";
+	prog.text   = text;
+	prog.closed = 0;
+	if (test_assemble(&prog, code, &size) == -1)
+	{
+		return -1;
+	}
+
+	*vm = vm_init(TEST_MEM);
+	cpu = vm_cpu(*vm);
+	if (cpu == NULL)
+	{
+		return -1;
+	}
+
+	ret  = cpu_poweron(cpu);
+	ret += cpu_set_fusion(cpu, fusion);
+	ret += cpu_load_code(cpu, 0, code, size);
+	if (ret == 0 && engine == CPU_ENGINE_AOT && test_aot(cpu, size) == -1)
+	{
+		ret = 1;
+	}
+
+	if (ret == 0 && cpu_set_engine(cpu, engine) == -1)
+	{
+		ret = 1;
+	}
+
+	if (ret != 0)
+	{
+		vm_free(*vm);
+		*vm = NULL;
+	}
+
+	return (ret < 0) ? -1 : ret;
+}
+
+/*
+ *   Checks the differential runs cannot see, each on every engine.
+ *   They return the number of failures.
+ */
+
+/*
+ *   A stop requested before a run ends it before its first command
+ *   and is taken by it: the next run goes on to the halt
+ */
+static int test_stop(const test_engine_t *engine)
+{
+	vm_t   *vm;
+	word_t executed;
+	word_t total;
+	int    fails;
+	int    ret;
+
+
+	if (test_open(TEST_COUNTED, engine->engine, engine->fusion, &vm) != 0)
+	{
+		return 0;
+	}
+
+	fails = 0;
+	cpu_request_stop(vm_cpu(vm));
+	ret = cpu_run_budget(vm_cpu(vm), TEST_BUDGET, &executed);
+	if (ret != 1 || executed != 0)
+	{
+		printf("\tstop_request on %s: stopped run returned %d after %u commands, expected 1 after 0\n",
+		       engine->name, ret, executed);
+		fails++;
+	}
+
+	ret = cpu_run_budget(vm_cpu(vm), TEST_BUDGET, &total);
+	if (ret != 0 || total != TEST_COUNTED_NR)
+	{
+		printf("\tstop_request on %s: next run returned %d after %u commands, expected 0 after %u\n",
+		       engine->name, ret, total, TEST_COUNTED_NR);
+		fails++;
+	}
+
+	vm_free(vm);
+
+	return fails;
+}
+
+/*
+ *   Runs on a small budget use it up, go at most one block or loop
+ *   iteration past it, and add up to the commands of one long run
+ */
+static int test_budget(const test_engine_t *engine)
+{
+	vm_t   *vm;
+	word_t executed;
+	word_t total;
+	int    fails;
+	int    ret;
+
+
+	if (test_open(TEST_COUNTED, engine->engine, engine->fusion, &vm) != 0)
+	{
+		return 0;
+	}
+
+	fails = 0;
+	total = 0;
+	do
+	{
+		ret = cpu_run_budget(vm_cpu(vm), TEST_SLICE, &executed);
+		total += executed;
+		if (ret == 1 && (executed < TEST_SLICE || executed > TEST_SLICE + TEST_OVERRUN))
+		{
+			printf("\tbudget_runs on %s: run of %u commands executed %u\n", engine->name, TEST_SLICE, executed);
+			fails++;
+		}
+	} while (ret == 1 && fails == 0);
+
+	if (ret != 0 || total != TEST_COUNTED_NR)
+	{
+		printf("\tbudget_runs on %s: returned %d after %u commands in all, expected 0 after %u\n",
+		       engine->name, ret, total, TEST_COUNTED_NR);
+		fails++;
+	}
+
+	vm_free(vm);
+
+	return fails;
+}
+
+/*
+ *   A store to a page without W, a load from one without R and a
+ *   command fetched from one without X fault: the run returns -1
+ *   with the error flag set and IP on the command, and the page is
+ *   left as it was
+ */
+static int test_attr(const test_engine_t *engine)
+{
+	static byte_t code[TEST_CODE];
+	test_prog_t   prog;
+	test_end_t    end;
+	word_t        size;
+	word_t        a;
+	word_t        i;
+	int           fails;
+	int           ret;
+
+
+	end.mem = (byte_t *)malloc(TEST_MEM);
+	if (end.mem == NULL)
+	{
+		return 1;
+	}
+
+	fails = 0;
+	for (a = 0; a < NR_TEST_ATTRS; a++)
+	{
+		prog.name   = test_attrs[a].name;
+		prog.text   = test_attrs[a].text;
+		prog.closed = test_attrs[a].closed;
+		if (test_assemble(&prog, code, &size) == -1)
+		{
+			printf("\tattributes: unable to assemble %s\n", prog.name);
+			fails++;
+			continue;
+		}
+
+		ret = test_run(code, size, prog.closed, engine->engine, engine->fusion, &end);
+		if (ret == 1)
+		{
+			continue;
+		}
+
+		if (ret == -1 || end.ret != -1 || !end.state.error || end.state.regs[ISA_REG_IP] != test_attrs[a].ip ||
+		    end.executed != test_attrs[a].executed)
+		{
+			printf("\tattributes: %s on %s returned %d after %u commands, error %u, IP 0x%08x, "
+			       "expected -1 after %u, error 1, IP 0x%08x\n", prog.name, engine->name, end.ret,
+			       end.executed, end.state.error, end.state.regs[ISA_REG_IP], test_attrs[a].executed,
+			       test_attrs[a].ip);
+			fails++;
+			continue;
+		}
+
+		for (i = TEST_HIGH; i < TEST_MEM && end.mem[i] == 0; i++)
+		{
+		}
+
+		if (i < TEST_MEM)
+		{
+			printf("\tattributes: %s on %s wrote to 0x%08x\n", prog.name, engine->name, i);
+			fails++;
+		}
+	}
+
+	free(end.mem);
+
+	return fails;
+}
+
+/*
+ *   Commands marked by the verifier, of the code at 0: the number
+ *   marked and whether the one at `ip` is
+ */
+static int test_marks(cpu_t *cpu, word_t size, word_t ip, int *marked)
+{
+	byte_t marks[TEST_CODE];
+	word_t i;
+	int    nr;
+
+
+	if (cpu_get_verified(cpu, 0, size, marks) == -1)
+	{
+		return -1;
+	}
+
+	nr = 0;
+	for (i = 0; i < size; i++)
+	{
+		nr += (marks[i] != 0);
+	}
+
+	*marked = (marks[ip] != 0);
+
+	return nr;
+}
+
+/*
+ *   Marks of verified commands, which run without the load and store
+ *   checks, only hold while what they were given for does: pages
+ *   losing W and invalidated code drop them, and marks handed to
+ *   cpu_load_verified() are checked again
+ */
+static int test_verify(const test_engine_t *engine)
+{
+	static byte_t code[TEST_CODE];
+	static byte_t all[TEST_CODE];
+	test_prog_t   prog;
+	mem_t         *mem;
+	io_t          *io;
+	cpu_t         *cpu;
+	word_t        size;
+	int           marked;
+	int           fails;
+	int           nr;
+
+
+	prog.name   = "verify";
+	prog.text   = test_attrs[0].text;
+	prog.closed = 0;
+	mem = mem_init(TEST_MEM);
+	io  = io_init();
+	cpu = (mem != NULL && io != NULL) ? cpu_init_with(mem, io, engine->engine) : NULL;
+	if (cpu == NULL || test_assemble(&prog, code, &size) == -1 || cpu_poweron(cpu) == -1 ||
+	    cpu_load_code(cpu, 0, code, size) == -1)
+	{
+		printf("\tverifier: unable to load the code\n");
+		cpu_free(cpu);
+		io_free(io);
+		mem_free(mem);
+		return 1;
+	}
+
+	/*
+	 *   Every command of the code passes, the store to the upper
+	 *   half included
+	 */
+	fails = 0;
+	nr = test_marks(cpu, size, test_attrs[0].ip, &marked);
+	if (nr != 6 || !marked)
+	{
+		printf("\tverifier: %d commands marked at load time, the store %s, expected 6 with it\n", nr,
+		       marked ? "too" : "not");
+		fails++;
+	}
+
+	cpu_protect(cpu, TEST_HIGH, TEST_MEM - TEST_HIGH, MEM_ATTR_R | MEM_ATTR_X);
+	nr = test_marks(cpu, size, test_attrs[0].ip, &marked);
+	if (nr != 0)
+	{
+		printf("\tverifier: %d commands still marked once a page lost W\n", nr);
+		fails++;
+	}
+
+	/*
+	 *   Marks claiming the store, now to a page without W, lose it
+	 */
+	memset(all, 1, size);
+	cpu_load_verified(cpu, 0, code, size, all);
+	nr = test_marks(cpu, size, test_attrs[0].ip, &marked);
+	if (nr != 5 || marked)
+	{
+		printf("\tverifier: %d commands marked from the results given, the store %s, expected 5 without it\n",
+		       nr, marked ? "too" : "not");
+		fails++;
+	}
+
+	cpu_invalidate(cpu, 0, size);
+	nr = test_marks(cpu, size, test_attrs[0].ip, &marked);
+	if (nr != 0)
+	{
+		printf("\tverifier: %d commands still marked once the code was invalidated\n", nr);
+		fails++;
+	}
+
+	cpu_free(cpu);
+	io_free(io);
+	mem_free(mem);
+
+	return fails;
+}
+
+/*
+ *   Memory backed by a file is a private copy: the guest's stores
+ *   land in memory, not in the file nor in other memories mapping
+ *   it. The file ends past a page boundary so its tail is read in.
+ */
+static int test_map(const test_engine_t *engine)
+{
+	static byte_t code[TEST_CODE];
+	static byte_t image[TEST_FILE];
+	static byte_t check[TEST_FILE];
+	test_prog_t   prog;
+	char          path[64];
+	mem_t         *mem[2];
+	io_t          *io;
+	cpu_t         *cpu;
+	FILE          *file;
+	word_t        executed;
+	word_t        size;
+	word_t        w[2];
+	word_t        i;
+	int           fails;
+	int           ret;
+
+
+	prog.name   = "map_file";
+	prog.text   = TEST_COUNTED;
+	prog.closed = 0;
+	if (test_assemble(&prog, code, &size) == -1)
+	{
+		return 1;
+	}
+
+	for (i = 0; i < TEST_FILE; i++)
+	{
+		image[i] = (i < size) ? code[i] : (byte_t)i;
+	}
+
+	snprintf(path, sizeof(path), "/tmp/test_cpu_%d.img", (int)getpid());
+	file = fopen(path, "wb");
+	if (file == NULL || fwrite(image, 1, TEST_FILE, file) != TEST_FILE)
+	{
+		printf("\tmap_file: unable to write %s\n", path);
+		if (file != NULL)
+		{
+			fclose(file);
+		}
+		return 1;
+	}
+
+	fclose(file);
+
+	mem[0] = mem_init(TEST_MEM);
+	mem[1] = mem_init(TEST_MEM);
+	io     = io_init();
+	cpu    = (mem[0] != NULL && io != NULL) ? cpu_init_with(mem[0], io, engine->engine) : NULL;
+	ret    = (cpu != NULL && mem[1] != NULL) ? 0 : -1;
+	if (ret == 0)
+	{
+		ret  = mem_map_file(mem[0], 0, path, &size);
+		ret += cpu_poweron(cpu);
+		ret += cpu_load_memory(cpu, 0, size);
+	}
+
+	fails    = 0;
+	executed = 0;
+	if (ret != 0 || size != TEST_FILE || cpu_run_budget(cpu, TEST_BUDGET, &executed) != 0 ||
+	    executed != TEST_COUNTED_NR)
+	{
+		printf("\tmap_file: mapped code ran %u commands, expected %u to the halt\n", executed, TEST_COUNTED_NR);
+		fails++;
+	}
+
+	/*
+	 *   The file and a fresh mapping of it still hold the image
+	 */
+	mem_read(mem[0], 2048, &w[0]);
+	memcpy(&w[1], image + 2048, WORD_SIZE);
+	file = fopen(path, "rb");
+	if (file == NULL || fread(check, 1, TEST_FILE, file) != TEST_FILE ||
+	    memcmp(check, image, TEST_FILE) != 0 || w[0] != 3000)
+	{
+		printf("\tmap_file: the store went to the file\n");
+		fails++;
+	}
+
+	if (file != NULL)
+	{
+		fclose(file);
+	}
+
+	if (mem[1] == NULL || mem_map_file(mem[1], 0, path, &size) == -1 ||
+	    memcmp(mem_bytes(mem[1]), image, TEST_FILE) != 0)
+	{
+		printf("\tmap_file: another mapping of the file saw the store\n");
+		fails++;
+	}
+
+	remove(path);
+	cpu_free(cpu);
+	io_free(io);
+	mem_free(mem[0]);
+	mem_free(mem[1]);
+
+	return fails;
+}
+
+/*
+ *   Entries of the cache with the extension: how many, the sum of
+ *   their inode numbers (which changes when any of them is written
+ *   again) and the path of one of them
+ */
+static int test_entries(const char *dir, const char *ext, unsigned long *inodes, char *path)
+{
+	DIR           *d;
+	struct dirent *ent;
+	size_t        len;
+	int           nr;
+
+
+	nr      = 0;
+	*inodes = 0;
+	d = opendir(dir);
+	if (d == NULL)
+	{
+		return -1;
+	}
+
+	while ((ent = readdir(d)) != NULL)
+	{
+		len = strlen(ent->d_name);
+		if (len > strlen(ext) && strcmp(ent->d_name + len - strlen(ext), ext) == 0)
+		{
+			*inodes += (unsigned long)ent->d_ino;
+			snprintf(path, TEST_PATH, "%s/%s", dir, ent->d_name);
+			nr++;
+		}
+	}
+
+	closedir(d);
+
+	return nr;
+}
+
+/*
+ *   Load the source through the cache into a fresh instance and run
+ *   it. Returns what cache_load() returned; `executed` gets the
+ *   commands run to the halt, 0 if it did not halt.
+ */
+static int test_cache_run(cache_t *cache, const char *text, word_t *executed)
+{
+	static byte_t code[TEST_CODE];
+	test_prog_t   prog;
+	word_t        size;
+	vm_t          *vm;
+	int           ret;
+
+
+	prog.name   = "cache";
+	prog.text   = text;
+	prog.closed = 0;
+	*executed   = 0;
+	vm = vm_init(TEST_MEM);
+	if (vm == NULL || test_assemble(&prog, code, &size) == -1 || cpu_poweron(vm_cpu(vm)) == -1)
+	{
+		vm_free(vm);
+		return -1;
+	}
+
+	ret = cache_load(cache, vm_cpu(vm), 0, code, size);
+	if (ret == 0)
+	{
+		cpu_set_engine(vm_cpu(vm), CPU_ENGINE_AOT);
+	}
+
+	if (ret != -1 && cpu_run_budget(vm_cpu(vm), TEST_BUDGET, executed) != 0)
+	{
+		*executed = 0;
+	}
+
+	vm_free(vm);
+
+	return ret;
+}
+
+/*
+ *   Code loaded again hits the entries made the first time, and code
+ *   never loaded misses them. Entries made for other code under the
+ *   same key, and a cache directory open to others, are not used.
+ */
+static int test_cache(const test_engine_t *engine)
+{
+	char          dir[TEST_PATH];
+	char          path[TEST_PATH];
+	char          name[TEST_PATH];
+	cache_t       *cache;
+	unsigned long so[2];
+	unsigned long ver[2];
+	unsigned long code;
+	word_t        executed;
+	FILE          *file;
+	int           fails;
+	int           first;
+	int           ret;
+	int           nr;
+
+
+	strcpy(dir, "/tmp/test_cpu_XXXXXX");
+	if (mkdtemp(dir) == NULL || (cache = cache_open(dir)) == NULL)
+	{
+		printf("\tcache: unable to open a cache\n");
+		return 1;
+	}
+
+	/*
+	 *   Miss, then hit: nothing is made again
+	 */
+	fails = 0;
+	first = test_cache_run(cache, TEST_COUNTED, &executed);
+	test_entries(dir, ".so", &so[0], name);
+	test_entries(dir, ".ver", &ver[0], name);
+	nr = test_entries(dir, ".code", &code, path);
+	if (first == -1 || executed != TEST_COUNTED_NR || nr != 1)
+	{
+		printf("\tcache: first load returned %d, ran %u commands, made %d entries\n", first, executed, nr);
+		fails++;
+	}
+
+	ret = test_cache_run(cache, TEST_COUNTED, &executed);
+	test_entries(dir, ".so", &so[1], name);
+	test_entries(dir, ".ver", &ver[1], name);
+	if (ret != first || executed != TEST_COUNTED_NR || so[1] != so[0] || ver[1] != ver[0])
+	{
+		printf("\tcache: second load returned %d, ran %u commands, entries %s\n", ret, executed,
+		       (so[1] != so[0] || ver[1] != ver[0]) ? "made again" : "kept");
+		fails++;
+	}
+
+	/*
+	 *   The key now names other code: its entries are neither used
+	 *   nor replaced, and the code runs without a module
+	 */
+	file = fopen(path, "r+b");
+	if (file != NULL)
+	{
+		fputc(0xff, file);
+		fclose(file);
+	}
+
+	ret = test_cache_run(cache, TEST_COUNTED, &executed);
+	test_entries(dir, ".so", &so[1], name);
+	test_entries(dir, ".ver", &ver[1], name);
+	if (file == NULL || ret != 1 || executed != TEST_COUNTED_NR || so[1] != so[0] || ver[1] != ver[0])
+	{
+		printf("\tcache: load under a key of other code returned %d, ran %u commands\n", ret, executed);
+		fails++;
+	}
+
+	/*
+	 *   Other code misses
+	 */
+	ret = test_cache_run(cache, test_progs[0].text, &executed);
+	nr  = test_entries(dir, ".code", &code, name);
+	if (ret != first || executed == 0 || nr != 2)
+	{
+		printf("\tcache: other code returned %d, ran %u commands, %d entries\n", ret, executed, nr);
+		fails++;
+	}
+
+	/*
+	 *   Open to others: not opened, not loaded from
+	 */
+	chmod(dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+	ret = test_cache_run(cache, TEST_COUNTED, &executed);
+	if (ret != -1 || cache_open(dir) != NULL)
+	{
+		printf("\tcache: a directory open to others was used\n");
+		fails++;
+	}
+
+	chmod(dir, S_IRWXU);
+	cache_purge(cache);
+	cache_close(cache);
+	rmdir(dir);
+
+	return fails;
+}
+
+static const test_check_t test_checks[] =
+{
+	{ "stop_request", test_stop,   1 },
+	{ "budget_runs",  test_budget, 1 },
+	{ "attributes",   test_attr,   1 },
+	{ "verifier",     test_verify, 0 },
+	{ "map_file",     test_map,    0 },
+	{ "cache",        test_cache,  0 },
+};
+
+#define NR_TEST_CHECKS (sizeof(test_checks) / sizeof(test_checks[0]))
+
+/*
+ *   Implementation
+ */
+
+int main(int argc, char **argv)
+{
+	static byte_t code[TEST_CODE];
+	test_end_t    ref;
+	test_end_t    end;
+	word_t        size;
+	word_t        p;
+	word_t        e;
+	word_t        c;
+	int           failed;
+	int           checks;
+	int           diffs;
+	int           runs;
+	int           ret;
+
+
+	ref.mem = (byte_t *)malloc(TEST_MEM);
+	end.mem = (byte_t *)malloc(TEST_MEM);
+	if (ref.mem == NULL || end.mem == NULL)
+	{
+		return 1;
+	}
+
+	failed = 0;
+	for (p = 0; p < NR_TEST_PROGS; p++)
+	{
+		if (test_assemble(&test_progs[p], code, &size) == -1 ||
+		    test_run(code, size, test_progs[p].closed, CPU_ENGINE_PORTABLE, 0, &ref) != 0)
+		{
+			printf("%-12s: unable to run\n", test_progs[p].name);
+			failed++;
+			continue;
+		}
+
+		diffs = 0;
+		runs  = 0;
+		for (e = 0; e < NR_TEST_ENGINES; e++)
+		{
+			ret = test_run(code, size, test_progs[p].closed, test_engines[e].engine, test_engines[e].fusion, &end);
+			if (ret == 1)
+			{
+				continue;
+			}
+
+			if (ret == -1)
+			{
+				printf("\t%s on %s: unable to run\n", test_progs[p].name, test_engines[e].name);
+				diffs++;
+				continue;
+			}
+
+			diffs += test_compare(test_progs[p].name, test_engines[e].name, &ref, &end);
+			runs++;
+		}
+
+		/*
+		 *   Batch lanes have no page attributes
+		 */
+		if (test_progs[p].closed == 0 && test_batch(code, size, &ref, &end) == 0)
+		{
+			diffs += test_compare(test_progs[p].name, "batch", &ref, &end);
+			runs++;
+		}
+
+		printf("%-12s: %s (%s after %u commands, %d runs compared)\n", test_progs[p].name,
+		       diffs ? "FAILED" : "ok", ref.ret == 0 ? "halted" : ref.ret == 1 ? "out of budget" : "error",
+		       ref.executed, runs);
+		failed += (diffs != 0);
+	}
+
+	free(ref.mem);
+	free(end.mem);
+
+	checks = 0;
+	for (c = 0; c < NR_TEST_CHECKS; c++)
+	{
+		diffs = test_checks[c].check(&test_reference);
+		for (e = 0; test_checks[c].engines && e < NR_TEST_ENGINES; e++)
+		{
+			diffs += test_checks[c].check(&test_engines[e]);
+		}
+
+		printf("%-12s: %s\n", test_checks[c].name, diffs ? "FAILED" : "ok");
+		checks += (diffs != 0);
+	}
+
+	printf("%d of %d programs and %d of %d checks failed\n", failed, (int)NR_TEST_PROGS, checks,
+	       (int)NR_TEST_CHECKS);
+
+	return failed != 0 || checks != 0;
+}
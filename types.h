@@ -3,6 +3,8 @@
 #define __TYPES_H__
 
 #define WORD_SIZE sizeof(word_t)
+#define CACHE_LINE 64 /* Bytes of a host cache line */
+#define CACHE_ALIGN(n) (((n) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
 
 typedef unsigned char byte_t;
 typedef unsigned int  word_t;
@@ -0,0 +1,155 @@
+/*
+ *   Includes
+ */
+#include <stdint.h>
+#include <sys/mman.h>
+#include "types.h"
+#include "mem.h"
+#include "io.h"
+#include "cpu.h"
+#include "vm.h"
+
+/*
+ *   Types
+ */
+
+/*
+ *   A whole instance in one block: this structure, the IO, the memory
+ *   and the CPU with the directory of its side tables, each on its own
+ *   cache lines; the CPU allocates the pages of the side tables as it
+ *   decodes code. The memory has no pages of its own (see
+ *   mem_init_at()), which suits the small memories instances are
+ *   packed by the thousand for.
+ */
+struct _vm_t
+{
+	cpu_t  *cpu;        /* CPU, in the block                            */
+	mem_t  *mem;        /* Memory, in the block                         */
+	io_t   *io;         /* Input/Output facility, in the block          */
+	size_t block_size;  /* Bytes vm_init() mapped, 0 for an arena       */
+};
+
+/*
+ *   Implementation
+ */
+
+/*
+ *   Bytes of the block of an instance with `size` bytes of memory
+ */
+size_t vm_footprint(word_t size)
+{
+	return CACHE_ALIGN(sizeof(vm_t)) + io_footprint() + mem_footprint(size) + cpu_footprint(size);
+}
+
+/*
+ *   Instance in an arena of the caller's: at least vm_footprint(size)
+ *   zero-filled bytes, aligned to a cache line. Fresh anonymous
+ *   mappings qualify as they are; the pages of the directories are
+ *   then paid for only once the code is run. vm_free() leaves the
+ *   arena to the caller.
+ */
+vm_t* vm_init_at(void *arena, size_t arena_size, word_t size)
+{
+	vm_t   *vm;
+	byte_t *at;
+
+
+	if (arena == NULL || (uintptr_t)arena % CACHE_LINE != 0 || arena_size < vm_footprint(size))
+	{
+		return NULL;
+	}
+
+	vm = (vm_t *)arena;
+	at = (byte_t *)arena + CACHE_ALIGN(sizeof(vm_t));
+
+	vm->io  = io_init_at(at);
+	at += io_footprint();
+	vm->mem = mem_init_at(at, size);
+	at += mem_footprint(size);
+	if (vm->io == NULL || vm->mem == NULL)
+	{
+		return NULL;
+	}
+
+	vm->cpu = cpu_init_at(at, vm->mem, vm->io);
+	if (vm->cpu == NULL)
+	{
+		return NULL;
+	}
+
+	vm->block_size = 0;
+
+	return vm;
+}
+
+/*
+ *   Instance in a block of its own, one allocation
+ */
+vm_t* vm_init(word_t size)
+{
+	vm_t   *vm;
+	void   *block;
+	size_t bytes;
+
+
+	/*
+	 *   A fresh mapping is zero without being written to, so the
+	 *   instance costs the pages it touches (a zeroing allocator
+	 *   would touch them all)
+	 */
+	bytes = vm_footprint(size);
+	block = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (block == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	vm = vm_init_at(block, bytes, size);
+	if (vm == NULL)
+	{
+		munmap(block, bytes);
+		return NULL;
+	}
+
+	vm->block_size = bytes;
+
+	return vm;
+}
+
+int vm_free(vm_t *vm)
+{
+	if (vm == NULL)
+	{
+		return -1;
+	}
+
+	/*
+	 *   The parts leave the block alone; the CPU frees what it
+	 *   allocated on demand
+	 */
+	cpu_free(vm->cpu);
+	mem_free(vm->mem);
+	io_free(vm->io);
+
+	if (vm->block_size > 0)
+	{
+		munmap(vm, vm->block_size);
+	}
+
+	return 0;
+}
+
+cpu_t* vm_cpu(vm_t *vm)
+{
+	return (vm != NULL) ? vm->cpu : NULL;
+}
+
+mem_t* vm_mem(vm_t *vm)
+{
+	return (vm != NULL) ? vm->mem : NULL;
+}
+
+io_t* vm_io(vm_t *vm)
+{
+	return (vm != NULL) ? vm->io : NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef __VM_H__
+#define __VM_H__
+
+/*
+ *   Includes
+ */
+#include "types.h"
+#include "mem.h"
+#include "io.h"
+#include "cpu.h"
+
+/*
+ *   Types
+ */
+typedef struct _vm_t vm_t;
+
+/*
+ *   Prototypes. vm_footprint() is about 5 KiB for the default 4 KiB
+ *   of memory; the CPU then allocates about 6 KiB of predecoded tables
+ *   for each 256 bytes of memory it runs code from.
+ */
+vm_t*  vm_init     (word_t size);
+vm_t*  vm_init_at  (void *arena, size_t arena_size, word_t size);
+size_t vm_footprint(word_t size);
+int    vm_free     (vm_t *vm);
+cpu_t* vm_cpu      (vm_t *vm);
+mem_t* vm_mem      (vm_t *vm);
+io_t*  vm_io       (vm_t *vm);
+
+#endif /* __VM_H__ */